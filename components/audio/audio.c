@@ -3,104 +3,375 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
 
+#include "esp_attr.h"
 #include "esp_err.h"
 #include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
 
 #include "freertos/projdefs.h"
+#include "freertos/queue.h"
 #include "hal/i2s_types.h"
 #include "driver/i2s.h"
 
+#include "mp3common.h"
 #include "mp3dec.h"
 
+#include "audio_library.h"
+#include "event_log.h"
+#include "flash_alarm.h"
+#include "mp3_index.h"
+#include "pcm_cache.h"
+#include "pcm_process.h"
+#include "resampler.h"
+#include "ring_buffer.h"
+#include "storage.h"
+#include "tone.h"
+
 #define I2S_PORT_NUM            (0)
 #define SAMPLE_RATE             44100
-#define PI                      (3.14159265)
-#define WAVE_FREQ_HZ            (400)
+#define TONE_BUFFER_FRAMES      (4 * 4410)
+#define LOOP_MIN_BLOCK_FRAMES   1024
+#define LOOP_MAX_SEGMENTS       8
 #define BIT_PER_SAMPLE          16
 
-#define AUDIO_BUFFER_SIZE       16000
+#define FRAMES_PER_WRITE        1     // commands are handled between writes
+#define MAX_FRAME_SAMPLES       2304  // 1152 stereo samples
+#define RESAMPLE_BUFFER_FRAMES  3200  // one 576 frame mpeg 2.5 granule at 8 kHz -> 44.1 kHz
+#define PCM_SLOT_SAMPLES        (2 * RESAMPLE_BUFFER_FRAMES)
+#define SILENT_FRAME_BYTES      417   // 128 kbps 44.1 kHz stereo Layer III
+#define DEFAULT_GAIN_Q15        0x4000 // half of full scale
+#define PCM_CHUNK_SIZE          4096
+
+#define AUDIO_BUFFER_SIZE       16384 // must be a power of two
+#define READ_CHUNK_SIZE         4096
+#define READ_AHEAD_SIZE         CONFIG_AUDIO_READ_AHEAD_SIZE
+#define SECTOR_SIZE             512
+
+#if READ_AHEAD_SIZE % SECTOR_SIZE != 0
+#error "CONFIG_AUDIO_READ_AHEAD_SIZE must be a multiple of the sector size"
+#endif
+
+#define READER_START            (1 << 0)
+#define READER_SPACE            (1 << 1)
 
 struct audio_source {
     char file_path[128];
     bool is_file;
+    uint32_t tone_freq;
+    const struct tone_pattern_t *pattern;  // NULL for a steady tone at tone_freq
     SemaphoreHandle_t lock;
 };
 
 static const char *I2S_TAG = "I2S";
 static const char *AUDIO_TAG = "Audio";
 
+#define CMD_QUEUE_LEN           8
+
+// Decoding runs on APP_CPU next to nothing else, the output task follows
+// the i2s interrupt which is allocated on the core installing the driver,
+// aud_init is called on PRO_CPU.
+#define DECODE_CORE             APP_CPU_NUM
+#define OUTPUT_CORE             PRO_CPU_NUM
+#define DECODE_PRIORITY         18
+#define READER_PRIORITY         20
+#define OUTPUT_PRIORITY         22
+#define DECODE_STACK            4096
+#define READER_STACK            3072
+#define OUTPUT_STACK            2048
+#define OUTPUT_WRITE_TIMEOUT    pdMS_TO_TICKS(50)
+
 enum {
     AUD_NONE = 0,
     AUD_PLAY,
     AUD_PAUSE,
     AUD_SWAP,
     AUD_STOP,
+    AUD_SEEK,
+};
+
+struct aud_cmd_t {
+    uint8_t type;
+    uint32_t arg;       // position for AUD_SEEK
+    int64_t issued_us;
+};
+
+/**
+ * Time and output of one source, see _meter_end.
+ */
+struct source_meter_t {
+    int64_t start;
+    uint64_t blocked;
+    uint64_t bytes;
+    uint64_t output_busy;
+};
+
+/**
+ * Block of whole waveform periods played back to back for duration frames.
+ */
+struct loop_segment_t {
+    const short *data;
+    uint32_t frames;
+    uint32_t duration;  // 0 to repeat forever
+};
+
+/**
+ * Decode position of the mp3 stream being played.
+ */
+struct mp3_stream_t {
+    struct mp3_index_t *index;
+    uint32_t offset;    // file offset of the next byte in RING
+    uint32_t frame;     // index of the next frame
+    const uint8_t *mapped;  // whole file when memory mapped, decoded in place without RING
+    uint32_t mapped_size;
+};
+
+/**
+ * One of the two pcm buffers between the decode and output tasks. busy is
+ * set by the decode task when it hands the buffer over and cleared by the
+ * output task once it is written to i2s.
+ */
+struct pcm_slot_t {
+    int16_t *data;
+    size_t bytes;
+    volatile bool busy;
+};
+
+struct audio_output {
+    struct pcm_slot_t slots[2];
+    int fill;                  // next slot the decode task fills
+    int drain;                 // next slot the output task writes
+    volatile bool discard;     // drop queued pcm on a source switch
+    volatile bool paused;      // hold queued pcm until resumed, i2s is stopped
+    TaskHandle_t task;
+};
+
+/**
+ * SD reader feeding the mp3 decoder through RING.
+ */
+struct audio_reader {
+    FILE *file;
+    volatile bool cancel;
+    TaskHandle_t task;
+    SemaphoreHandle_t data_ready;  // given whenever data is committed
+    SemaphoreHandle_t done;        // given once per stream when the reader lets go of file
 };
 
 static struct audio_source SOURCE = {
     .file_path = "",
-    .is_file = false
+    .is_file = false,
+    .tone_freq = 0,
+    .pattern = NULL
 };
 
+static QueueHandle_t CMD_QUEUE = NULL;
+static struct aud_cmd_stats_t CMD_STATS = {0};
+static struct aud_cpu_stats_t CPU_STATS = {0};
+static struct aud_output_stats_t OUTPUT_STATS = {0};
+
+static volatile uint32_t GAIN_Q15 = DEFAULT_GAIN_Q15;
+static volatile uint32_t FADE_IN_MS = 0;
+
 static bool _IS_PAUSED = false;
 static bool _IS_STOPPED = true;
 
+// Where the next file source starts, set by seeks and by stopping an mp3.
+static uint32_t START_MS = 0;
+static bool CAN_RESUME = false;
+static bool POSITIONED = false;  // the current mp3 got as far as start_ms
+static volatile uint32_t POSITION_MS = 0;
+static volatile uint32_t DURATION_MS = 0;
+
 static TaskHandle_t AUDIO_HANDLE = NULL;
+// Held while the library is scanned and while a stream is probed, both
+// use the probe buffer of mp3_index.
+static SemaphoreHandle_t LIBRARY_LOCK = NULL;
+
+/**
+ * Working memory of the sources. Only one source plays at a time, so the
+ * tone and mp3 buffers share it.
+ */
+static union {
+    short tone[2 * TONE_BUFFER_FRAMES];
+    struct {
+        uint8_t ring[AUDIO_BUFFER_SIZE + MAINBUF_SIZE];
+        short decode[FRAMES_PER_WRITE * MAX_FRAME_SAMPLES];
+        struct resampler_t resampler;
+    } mp3;
+} ARENA;
+static HMP3Decoder DECODER = NULL;
+static size_t DECODER_BYTES = 0;
+static unsigned char SILENT_FRAME[SILENT_FRAME_BYTES] = {0xff, 0xfb, 0x90, 0x00};
+static struct ring_buffer_t RING;
+static struct mp3_index_t INDEX;
+static int16_t PCM_SLOTS[2][PCM_SLOT_SAMPLES];
+// stdio buffer of the one file being streamed, see aud_open_stream.
+static DMA_ATTR uint8_t READ_AHEAD[READ_AHEAD_SIZE];
+static struct audio_output OUTPUT = {
+    .slots = {
+        {.data = PCM_SLOTS[0]},
+        {.data = PCM_SLOTS[1]},
+    },
+};
+static struct audio_reader READER = {
+    .file = NULL,
+    .cancel = false
+};
 
 void aud_main(void* unused);
+void aud_reader(void* unused);
+void aud_output(void* unused);
+void _flush_output();
 
 /**
+ * Record the command-to-effect latency of a command applied now.
+ */
+void _record_latency(const struct aud_cmd_t *cmd, int64_t now) {
+    uint32_t latency = (uint32_t) (now - cmd->issued_us);
+    CMD_STATS.count++;
+    CMD_STATS.last_us = latency;
+    CMD_STATS.total_us += latency;
+    if (latency > CMD_STATS.max_us) {
+        CMD_STATS.max_us = latency;
+    }
+}
+
+/**
+ * Apply every pending command, blocking on the queue while paused or stopped.
+ * Redundant commands are coalesced, e.g. pause followed by resume leaves the
+ * stream running and touches nothing.
+ *
  * Return true if a loaded audio source should exit.
  * False if an audio source currently playing, should not exit
  */
-bool _handle_messages() {
-    uint32_t ret = ulTaskNotifyTake(pdTRUE, 0);
-    switch (ret) {
-        case AUD_NONE:
-            break;
-        case AUD_PLAY:
-            i2s_start(I2S_PORT_NUM);
-            _IS_PAUSED = false; break;
-            return false;
-        case AUD_PAUSE:
-            i2s_stop(I2S_PORT_NUM);
-            _IS_PAUSED = true; break;
-            return false;
-        case AUD_SWAP:
+bool _handle_controls() {
+    struct aud_cmd_t pending[CMD_QUEUE_LEN];
+    TickType_t wait = 0;
+    int64_t wait_start = 0;
+    while (1) {
+        int n_pending = 0;
+        bool pause = _IS_PAUSED;
+        bool resume = false;
+        bool seek = false;
+        int exit_cmd = AUD_NONE;
+
+        while (n_pending < CMD_QUEUE_LEN &&
+               xQueueReceive(CMD_QUEUE, &pending[n_pending], wait) == pdTRUE) {
+            wait = 0;
+            switch (pending[n_pending].type) {
+                case AUD_PLAY:
+                    pause = false;
+                    resume = true;
+                    break;
+                case AUD_PAUSE:
+                    pause = true; break;
+                case AUD_SEEK:
+                    START_MS = pending[n_pending].arg;
+                    seek = true;
+                    break;
+                case AUD_SWAP:
+                    START_MS = 0;
+                    CAN_RESUME = false;
+                    // fall through
+                case AUD_STOP:
+                    exit_cmd = pending[n_pending].type;
+                    pause = false;
+                    break;
+            }
+            n_pending++;
+        }
+
+        if (exit_cmd != AUD_NONE) {
+            _flush_output();
             i2s_stop(I2S_PORT_NUM);
             i2s_zero_dma_buffer(I2S_PORT_NUM);
             _IS_PAUSED = false;
+            OUTPUT.paused = false;
+            _IS_STOPPED = exit_cmd == AUD_STOP;
+        }
+        else if (_IS_STOPPED && resume && CAN_RESUME) {
+            // Restart the stopped mp3 from START_MS.
             _IS_STOPPED = false;
-            return true;
-        case AUD_STOP:
+            _IS_PAUSED = false;
+        }
+        else if (!_IS_STOPPED && seek) {
+            // Restart the source at START_MS, keeping it paused if it was.
+            _flush_output();
             i2s_stop(I2S_PORT_NUM);
             i2s_zero_dma_buffer(I2S_PORT_NUM);
-            _IS_PAUSED = false;
-            _IS_STOPPED = true;
-            return true;
-    };
-    return false;
-}
+            _IS_PAUSED = pause;
+            OUTPUT.paused = pause;
+            exit_cmd = AUD_SEEK;
+        }
+        else if (!_IS_STOPPED && pause != _IS_PAUSED) {
+            if (pause) {
+                OUTPUT.paused = true;
+                i2s_stop(I2S_PORT_NUM);
+            } else {
+                i2s_start(I2S_PORT_NUM);
+                OUTPUT.paused = false;
+                xTaskNotifyGive(OUTPUT.task);
+            }
+            _IS_PAUSED = pause;
+        }
+        else if (n_pending > 1) {
+            CMD_STATS.coalesced += n_pending;
+        }
 
-bool _handle_controls() {
-    while (1) {
-        bool to_exit = _handle_messages();
-        if (to_exit) {
+        int64_t now = esp_timer_get_time();
+        if (wait_start != 0) {
+            CPU_STATS.blocked_us += now - wait_start;
+        }
+        for (int i = 0; i < n_pending; i++) {
+            _record_latency(&pending[i], now);
+        }
+
+        if (exit_cmd != AUD_NONE) {
             return true;
         }
-        else if (!_IS_PAUSED) {
+        else if (!_IS_PAUSED && !_IS_STOPPED) {
             return false;
         }
-        vTaskDelay(pdMS_TO_TICKS(100));    
+        wait = portMAX_DELAY;
+        wait_start = esp_timer_get_time();
     }
     return false;
 }
 
+aud_err_t _send_command(uint8_t type, uint32_t arg) {
+    struct aud_cmd_t cmd = {
+        .type = type,
+        .arg = arg,
+        .issued_us = esp_timer_get_time()
+    };
+    if (!CMD_QUEUE || xQueueSend(CMD_QUEUE, &cmd, 0) != pdTRUE) {
+        return AUD_FAIL;
+    }
+    return AUD_OKAY;
+}
+
+/**
+ * Delete the tasks a failed aud_init got to create and its command queue,
+ * so commands are refused instead of waiting for a task that is missing.
+ */
+static void _abandon_tasks(void) {
+    TaskHandle_t *tasks[] = {&READER.task, &OUTPUT.task, &AUDIO_HANDLE};
+    for (size_t i = 0; i < sizeof(tasks) / sizeof(tasks[0]); i++) {
+        if (*tasks[i]) {
+            vTaskDelete(*tasks[i]);
+            *tasks[i] = NULL;
+        }
+    }
+    if (CMD_QUEUE) {
+        vQueueDelete(CMD_QUEUE);
+        CMD_QUEUE = NULL;
+    }
+}
+
 aud_err_t aud_init(const struct aud_i2s_config_t *config) {
     esp_err_t ret;
     i2s_config_t i2s_config = {
@@ -114,6 +385,15 @@ aud_err_t aud_init(const struct aud_i2s_config_t *config) {
         .use_apll = false
     };
 
+    // The only heap allocation of the audio engine, kept for its lifetime.
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    DECODER = MP3InitDecoder();
+    DECODER_BYTES = free_before - heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    if (!DECODER) {
+        ESP_LOGE(AUDIO_TAG, "Out of Memory: Unable to create mp3 decoder.");
+        return AUD_FAIL;
+    }
+
     ret = i2s_driver_install(I2S_PORT_NUM, &i2s_config, 0, NULL);
     if (ret == ESP_OK) {
         ESP_LOGI(I2S_TAG, "Successfully installed i2s driver.");
@@ -140,7 +420,26 @@ aud_err_t aud_init(const struct aud_i2s_config_t *config) {
     if (ret == ESP_OK) {
         ESP_LOGI(I2S_TAG, "Successfully set i2s pin coniguration.");
         vSemaphoreCreateBinary(SOURCE.lock);
-        ret = xTaskCreate(aud_main, "Audio Main", 2048, NULL, 32, &AUDIO_HANDLE);
+        LIBRARY_LOCK = xSemaphoreCreateMutex();
+        CMD_QUEUE = xQueueCreate(CMD_QUEUE_LEN, sizeof(struct aud_cmd_t));
+        rb_init(&RING, ARENA.mp3.ring, AUDIO_BUFFER_SIZE, MAINBUF_SIZE);
+        READER.data_ready = xSemaphoreCreateBinary();
+        READER.done = xSemaphoreCreateBinary();
+        if (!SOURCE.lock || !LIBRARY_LOCK || !CMD_QUEUE || !READER.data_ready || !READER.done) {
+            ESP_LOGE(AUDIO_TAG, "Out of Memory: Unable to create audio queue and semaphores.");
+            _abandon_tasks();
+            return AUD_FAIL;
+        }
+        if (xTaskCreate(aud_reader, "Audio Reader", READER_STACK, NULL, READER_PRIORITY, &READER.task) != pdPASS ||
+            xTaskCreatePinnedToCore(aud_output, "Audio Output", OUTPUT_STACK, NULL, OUTPUT_PRIORITY, &OUTPUT.task,
+                                    OUTPUT_CORE) != pdPASS ||
+            xTaskCreatePinnedToCore(aud_main, "Audio Main", DECODE_STACK, NULL, DECODE_PRIORITY, &AUDIO_HANDLE,
+                                    DECODE_CORE) != pdPASS) {
+            ESP_LOGE(AUDIO_TAG, "Out of Memory: Unable to create audio tasks.");
+            _abandon_tasks();
+            return AUD_FAIL;
+        }
+        aud_log_memory_budget();
         return AUD_OKAY;
     } else if (ret == ESP_ERR_INVALID_ARG) {
         ESP_LOGE(I2S_TAG, "Invalid Argument in setting i2s pin configuration.");
@@ -154,45 +453,299 @@ aud_err_t aud_init(const struct aud_i2s_config_t *config) {
     }
 };
 
-void lower_volume(short* out, int n_samples) {
-    for (int i = 0; i < n_samples; i++) {
-        out[i] = out[i] / 2;
+/**
+ * Output stage, writes the slots the decode task hands over to i2s in
+ * order. Blocking on DMA here lets the decode task work on the other slot.
+ */
+void aud_output(void *unused) {
+    while (1) {
+        struct pcm_slot_t *slot = &OUTPUT.slots[OUTPUT.drain];
+        int64_t idle_start = esp_timer_get_time();
+        while (!slot->busy) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        int64_t start = esp_timer_get_time();
+        OUTPUT_STATS.idle_us += start - idle_start;
+
+        const uint8_t *src = (const uint8_t *) slot->data;
+        size_t left = slot->bytes;
+        while (left > 0 && !OUTPUT.discard) {
+            if (OUTPUT.paused) {
+                // Sleep until resumed or flushed, stopped i2s takes nothing.
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                continue;
+            }
+            // The timeout only matters for a write that i2s was stopped
+            // under, so a pause or flush in the middle of it is noticed.
+            size_t written = 0;
+            i2s_write(I2S_PORT_NUM, src, left, &written, OUTPUT_WRITE_TIMEOUT);
+            src += written;
+            left -= written;
+        }
+        OUTPUT_STATS.busy_us += esp_timer_get_time() - start;
+        OUTPUT_STATS.buffers++;
+
+        OUTPUT.drain ^= 1;
+        slot->busy = false;
+        xTaskNotifyGive(AUDIO_HANDLE);
     }
 }
 
-void mono_to_stereo(short* out, int n_samples) {
-    for (int i = n_samples - 1; i >= 0; i--) {
-        out[2 * i]     = out[i];
-        out[2 * i + 1] = out[i];
+/**
+ * Get the next slot to fill, waiting for the output task to finish with
+ * it. The wait counts as blocked time of the decode task.
+ */
+int16_t *_acquire_slot() {
+    const int fill = OUTPUT.fill;
+    struct pcm_slot_t *slot = &OUTPUT.slots[fill];
+    if (slot->busy) {
+        int64_t start = esp_timer_get_time();
+        while (slot->busy) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        CPU_STATS.blocked_us += esp_timer_get_time() - start;
     }
+    slot->data = PCM_SLOTS[fill];
+    return slot->data;
 }
 
+/**
+ * Hand size bytes at pcm, which must lie in the acquired slot, to the
+ * output task.
+ */
+void _submit_slot(const int16_t *pcm, size_t size) {
+    struct pcm_slot_t *slot = &OUTPUT.slots[OUTPUT.fill];
+    slot->data = (int16_t *) pcm;
+    slot->bytes = size;
+    slot->busy = true;
+    OUTPUT.fill ^= 1;
+    CPU_STATS.bytes_written += size;
+    xTaskNotifyGive(OUTPUT.task);
+}
 
-void sine_wave() {
-    printf("Playing Sine Wave\n");
-    short *output_buffer = malloc(8 * 4410 * sizeof(short));
-    if (!output_buffer) {
-        ESP_LOGE(AUDIO_TAG, "Input Buffer failed to allocate.");
-        return;
+/**
+ * Copy pcm through the slots, for sources that render into their own buffers.
+ */
+void _output_write(const void *src, size_t size) {
+    const uint8_t *pcm = (const uint8_t *) src;
+    while (size > 0) {
+        size_t chunk = size < sizeof(PCM_SLOTS[0]) ? size : sizeof(PCM_SLOTS[0]);
+        int16_t *slot = _acquire_slot();
+        memcpy(slot, pcm, chunk);
+        _submit_slot(slot, chunk);
+        pcm += chunk;
+        size -= chunk;
     }
-    size_t i2s_bytes_written = 0;
-    int j = 0;
-    i2s_set_clk(I2S_PORT_NUM, SAMPLE_RATE, I2S_BITS_PER_SAMPLE_16BIT, I2S_CHANNEL_STEREO);
-    i2s_start(I2S_PORT_NUM);
+}
+
+/**
+ * Wait until both slots are written, so i2s can be reclocked.
+ */
+void _drain_output() {
+    for (int i = 0; i < 2; i++) {
+        _acquire_slot();
+        OUTPUT.fill ^= 1;
+    }
+}
+
+/**
+ * Drop pcm still queued for the output task.
+ */
+void _flush_output() {
+    OUTPUT.discard = true;
+    xTaskNotifyGive(OUTPUT.task);
+    _drain_output();
+    OUTPUT.discard = false;
+}
+
+/**
+ * Drain the output and reclock i2s for the next source.
+ */
+esp_err_t _set_clk(uint32_t rate, i2s_channel_t channel) {
+    _drain_output();
+    return i2s_set_clk(I2S_PORT_NUM, rate, I2S_BITS_PER_SAMPLE_16BIT, channel);
+}
+
+void _meter_start(struct source_meter_t *meter) {
+    meter->start = esp_timer_get_time();
+    meter->blocked = CPU_STATS.blocked_us;
+    meter->bytes = CPU_STATS.bytes_written;
+    meter->output_busy = OUTPUT_STATS.busy_us;
+}
+
+/**
+ * Account a finished source and log its share of busy time and how much
+ * audio it produced per second of busy time.
+ */
+void _meter_end(const struct source_meter_t *meter, const char *label) {
+    int64_t active = esp_timer_get_time() - meter->start;
+    int64_t busy = active - (int64_t) (CPU_STATS.blocked_us - meter->blocked);
+    uint64_t bytes = CPU_STATS.bytes_written - meter->bytes;
+    uint64_t output_busy = OUTPUT_STATS.busy_us - meter->output_busy;
+    CPU_STATS.active_us += active;
+    if (active > 0 && busy > 0) {
+        ESP_LOGI(AUDIO_TAG, "%s: decode busy %d%%, output busy %d%% of %d ms, %d KB/s of busy time.",
+                 label,
+                 (int) (100 * busy / active),
+                 (int) (100 * output_busy / active),
+                 (int) (active / 1000),
+                 (int) (bytes * 1000 / busy / 1024));
+    }
+}
+
+/**
+ * Lay out one period-aligned block per step of pattern in buffer. Silent
+ * steps share a block of zeros. Returns the number of segments, or 0 if
+ * the pattern sweeps or its blocks do not fit, in which case it has to be
+ * synthesised while playing.
+ */
+int _build_loop(const struct tone_pattern_t *pattern,
+                short *buffer,
+                uint32_t buffer_frames,
+                struct loop_segment_t *segments) {
+
+    if (pattern->n_steps > LOOP_MAX_SEGMENTS) {
+        return 0;
+    }
+    uint32_t used = 0;
+    const short *silence = NULL;
+    for (int i = 0; i < pattern->n_steps; i++) {
+        const struct tone_step_t *step = &pattern->steps[i];
+        segments[i].duration = (uint32_t) ((uint64_t) step->duration_ms * SAMPLE_RATE / 1000);
+
+        if (step->amplitude == 0 || step->start_hz == 0) {
+            if (!silence) {
+                if (used + LOOP_MIN_BLOCK_FRAMES > buffer_frames) {
+                    return 0;
+                }
+                memset(buffer + 2 * used, 0, 2 * LOOP_MIN_BLOCK_FRAMES * sizeof(short));
+                silence = buffer + 2 * used;
+                used += LOOP_MIN_BLOCK_FRAMES;
+            }
+            segments[i].data = silence;
+            segments[i].frames = LOOP_MIN_BLOCK_FRAMES;
+            continue;
+        }
+        if (step->start_hz != step->end_hz) {
+            return 0;
+        }
+
+        uint32_t periods = 0;
+        uint32_t frames = tone_period_frames(step->start_hz, SAMPLE_RATE, &periods);
+        // Repeat short periods so each write hands DMA a reasonable block.
+        uint32_t repeats = (LOOP_MIN_BLOCK_FRAMES + frames - 1) / frames;
+        if (used + frames * repeats > buffer_frames) {
+            return 0;
+        }
+        tone_render_periodic(buffer + 2 * used, frames * repeats, periods * repeats, step->amplitude);
+        segments[i].data = buffer + 2 * used;
+        segments[i].frames = frames * repeats;
+        used += frames * repeats;
+    }
+    return pattern->n_steps;
+}
+
+/**
+ * Feed precomputed segments to DMA until a command ends the source.
+ * No samples are computed here, the task sleeps on DMA between writes.
+ */
+void _play_loop(const struct loop_segment_t *segments, int n_segments) {
+    while (1) {
+        for (int i = 0; i < n_segments; i++) {
+            const struct loop_segment_t *segment = &segments[i];
+            uint32_t remaining = segment->duration;
+            do {
+                if (_handle_controls()) {
+                    return;
+                }
+                uint32_t frames = segment->frames;
+                if (segment->duration != 0) {
+                    frames = remaining < frames ? remaining : frames;
+                    remaining -= frames;
+                }
+                _output_write(segment->data, 2 * frames * sizeof(short));
+            } while (segment->duration == 0 || remaining > 0);
+        }
+    }
+}
+
+/**
+ * Synthesise the pattern while playing, used for sweeps.
+ */
+void _play_streaming(struct tone_t *tone, short *output_buffer) {
     while (1) {
         if (_handle_controls()) {
             break;
         }
-        for (int i = 1; i < 4 * 4410; i++) {
-            output_buffer[2 * i] = (short)(sin(PI * (float) (2 * 441 * j) / (float) SAMPLE_RATE) * (float) 0x00ff);
-            output_buffer[2 * i + 1] = output_buffer[2 * i];
-            j++;
-        }
+        int64_t render_start = esp_timer_get_time();
+        tone_render(tone, output_buffer, TONE_BUFFER_FRAMES);
+        ESP_LOGD(AUDIO_TAG, "Rendered %d tone frames in %d us.",
+                 TONE_BUFFER_FRAMES, (int) (esp_timer_get_time() - render_start));
 
-        i2s_write(I2S_PORT_NUM, output_buffer, 8 * 4410 * sizeof(short), &i2s_bytes_written, portMAX_DELAY);
-        vTaskDelay(1);
+        _output_write(output_buffer, 2 * TONE_BUFFER_FRAMES * sizeof(short));
     }
-    free(output_buffer);
+}
+
+/**
+ * Play a tone pattern, or a steady tone at freq when pattern is NULL.
+ */
+void sine_wave(const struct tone_pattern_t *pattern, uint32_t freq) {
+    printf("Playing Sine Wave\n");
+    short *output_buffer = ARENA.tone;
+
+    const struct tone_step_t steady_step = {
+        .start_hz = freq,
+        .end_hz = freq,
+        .duration_ms = 0,
+        .amplitude = TONE_DEFAULT_AMPLITUDE
+    };
+    const struct tone_pattern_t steady = {
+        .steps = &steady_step,
+        .n_steps = 1
+    };
+    if (!pattern) {
+        pattern = &steady;
+    }
+
+    struct source_meter_t meter;
+    _meter_start(&meter);
+    struct loop_segment_t segments[LOOP_MAX_SEGMENTS];
+    int n_segments = _build_loop(pattern, output_buffer, TONE_BUFFER_FRAMES, segments);
+
+    _set_clk(SAMPLE_RATE, I2S_CHANNEL_STEREO);
+    i2s_start(I2S_PORT_NUM);
+    if (n_segments > 0) {
+        ESP_LOGI(AUDIO_TAG, "Looping precomputed tone buffer.");
+        _play_loop(segments, n_segments);
+    } else {
+        struct tone_t tone;
+        tone_start(&tone, pattern, SAMPLE_RATE);
+        _play_streaming(&tone, output_buffer);
+    }
+    _meter_end(&meter, "Tone");
+}
+
+void aud_get_cpu_stats(struct aud_cpu_stats_t *stats) {
+    *stats = CPU_STATS;
+}
+
+void aud_get_output_stats(struct aud_output_stats_t *stats) {
+    *stats = OUTPUT_STATS;
+}
+
+void aud_log_memory_budget() {
+    const size_t statics = sizeof(ARENA) + sizeof(PCM_SLOTS) + sizeof(INDEX) + sizeof(SILENT_FRAME) +
+        sizeof(READ_AHEAD);
+    const size_t stacks = DECODE_STACK + READER_STACK + OUTPUT_STACK;
+    ESP_LOGI(AUDIO_TAG, "Memory budget: arena %u (tone %u, mp3 %u), pcm slots %u, index %u, read-ahead %u bytes.",
+             (unsigned) sizeof(ARENA), (unsigned) sizeof(ARENA.tone), (unsigned) sizeof(ARENA.mp3),
+             (unsigned) sizeof(PCM_SLOTS), (unsigned) sizeof(INDEX), (unsigned) sizeof(READ_AHEAD));
+    ESP_LOGI(AUDIO_TAG, "Memory budget: %u static, %u decoder heap, %u task stacks, %u total bytes.",
+             (unsigned) statics, (unsigned) DECODER_BYTES, (unsigned) stacks,
+             (unsigned) (statics + DECODER_BYTES + stacks));
+    ESP_LOGI(AUDIO_TAG, "Heap: %u bytes free, %u minimum free.",
+             (unsigned) heap_caps_get_free_size(MALLOC_CAP_DEFAULT),
+             (unsigned) heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
 }
 
 void log_mp3_err_ret(int ret, bool frame) {
@@ -227,6 +780,7 @@ void log_mp3_err_ret(int ret, bool frame) {
         default:
             ESP_LOGW(AUDIO_TAG, "MP3 Decode: ERR_MP3_ERR_UNKOWN."); break;
     }
+    evlog_add(EVLOG_DECODE_ERROR, frame, (uint32_t) ret);
     if (frame) {
         ESP_LOGI(AUDIO_TAG, "Frame error code returned.");
     } else {
@@ -235,179 +789,564 @@ void log_mp3_err_ret(int ret, bool frame) {
     return;
 }
 
+/**
+ * Fill RING from READER.file until end of file or until cancelled.
+ * The task idles between streams waiting for READER_START.
+ */
+void aud_reader(void *unused) {
+    while (1) {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, READER_START | READER_SPACE, &bits, portMAX_DELAY);
+        if (!(bits & READER_START)) {
+            continue;
+        }
+        while (!READER.cancel) {
+            uint8_t *window = NULL;
+            uint32_t free_bytes = rb_write_window(&RING, &window);
+            if (free_bytes == 0) {
+                // Wait for the decoder to consume, re-check cancel periodically.
+                xTaskNotifyWait(0, READER_SPACE, NULL, pdMS_TO_TICKS(50));
+                continue;
+            }
+            size_t to_read = free_bytes < READ_CHUNK_SIZE ? free_bytes : READ_CHUNK_SIZE;
+            size_t bytes_read = fread(window, sizeof(char), to_read, READER.file);
+            if (bytes_read > 0) {
+                rb_commit(&RING, bytes_read);
+                xSemaphoreGive(READER.data_ready);
+            }
+            if (bytes_read != to_read) {
+                if (ferror(READER.file)) {
+                    ESP_LOGW(AUDIO_TAG, "Read error in audio file, ending stream.");
+                } else {
+                    ESP_LOGI(AUDIO_TAG, "End of file encounted. Finishing stream.");
+                }
+                break;
+            }
+        }
+        rb_set_eof(&RING);
+        xSemaphoreGive(READER.data_ready);
+        xSemaphoreGive(READER.done);
+    }
+}
+
+FILE *aud_open_stream(const char *path) {
+    FILE *file = storage_fopen(path, "r");
+    if (file && setvbuf(file, (char *) READ_AHEAD, _IOFBF, sizeof(READ_AHEAD)) != 0) {
+        ESP_LOGW(AUDIO_TAG, "No read-ahead buffer for %s.", path);
+    }
+    return file;
+}
+
+void _start_reader(FILE *file) {
+    READER.file = file;
+    rb_reset(&RING);
+    READER.cancel = false;
+    xSemaphoreTake(READER.data_ready, 0);
+    xSemaphoreTake(READER.done, 0);
+    xTaskNotify(READER.task, READER_START, eSetBits);
+}
+
+void _stop_reader() {
+    READER.cancel = true;
+    xTaskNotify(READER.task, READER_SPACE, eSetBits);
+    xSemaphoreTake(READER.done, portMAX_DELAY);
+    fclose(READER.file);
+    READER.file = NULL;
+}
+
+/**
+ * Get a contiguous window holding at least one whole frame, waiting on the
+ * reader if needed. Less than a frame is only returned at end of file.
+ * A mapped stream hands out the rest of the file in place.
+ */
+uint32_t _wait_for_input(struct mp3_stream_t *stream, uint8_t **window) {
+    if (stream->mapped) {
+        *window = (uint8_t *) stream->mapped + stream->offset;
+        return stream->offset < stream->mapped_size ? stream->mapped_size - stream->offset : 0;
+    }
+    uint32_t available = rb_read_window(&RING, window, MAINBUF_SIZE);
+    while (available < MAINBUF_SIZE && !rb_is_eof(&RING)) {
+        xSemaphoreTake(READER.data_ready, pdMS_TO_TICKS(100));
+        available = rb_read_window(&RING, window, MAINBUF_SIZE);
+    }
+    return available;
+}
+
+void _consume(struct mp3_stream_t *stream, uint32_t n_bytes) {
+    if (!stream->mapped) {
+        rb_consume(&RING, n_bytes);
+    }
+    stream->offset += n_bytes;
+}
+
+/**
+ * True once no more input will arrive, always for a mapped stream.
+ */
+bool _input_done(const struct mp3_stream_t *stream) {
+    return stream->mapped || rb_is_eof(&RING);
+}
+
+/**
+ * Decode up to n_frames frames from RING into output_buffer in the
+ * stream's own channel layout, adding each frame to the stream's index.
+ * Sets *end_of_stream once the input is exhausted.
+ */
 int decode_n_frames(
         int n_frames,
-        HMP3Decoder *mp3d,
-        unsigned char* input_buffer,
-        int *input_buffer_size,
+        HMP3Decoder mp3d,
         short *output_buffer,
-        MP3FrameInfo *frame_info) {
+        MP3FrameInfo *frame_info,
+        struct mp3_stream_t *stream,
+        bool *end_of_stream) {
 
     int samples_decoded = 0;
-    unsigned char **input_buffer_ref = &input_buffer;
 
     int err_d = 0;
     int i = 0;
-    while (i < n_frames && *input_buffer_size > 8000) {
-        int offset = MP3FindSyncWord(*input_buffer_ref, *input_buffer_size);
+    while (i < n_frames) {
+        uint8_t *window = NULL;
+        int available = _wait_for_input(stream, &window);
+        if (available == 0) {
+            *end_of_stream = true;
+            break;
+        }
 
+        int offset = MP3FindSyncWord(window, available);
         if (offset < 0) {
-            // Force audio buffer to completely empty
-            ESP_LOGI(AUDIO_TAG, "Exiting, no frame header found.");
-            *input_buffer_size = 0;
-            return 0;
+            if (_input_done(stream)) {
+                ESP_LOGI(AUDIO_TAG, "Exiting, no frame header found.");
+                *end_of_stream = true;
+                break;
+            }
+            // Keep the last bytes in case a sync word straddles the window.
+            _consume(stream, available - 1);
+            continue;
         }
-        *input_buffer_ref += offset;
-        *input_buffer_size -= offset;
-
+        unsigned char *frame = window + offset;
+        int bytes_left = available - offset;
+        _consume(stream, offset);
+        const uint32_t frame_offset = stream->offset;
 
-        err_d = MP3GetNextFrameInfo(mp3d, frame_info, *input_buffer_ref);
+        err_d = MP3GetNextFrameInfo(mp3d, frame_info, frame);
         log_mp3_err_ret(err_d, true);
         if (err_d < 0) {
-            *input_buffer_ref += 1;
-            *input_buffer_size -= 1;
+            _consume(stream, 1);
             continue;
         }
         err_d = MP3Decode(mp3d,
-                          input_buffer_ref,
-                          input_buffer_size,
+                          &frame,
+                          &bytes_left,
                           output_buffer + samples_decoded,
                           0);
         log_mp3_err_ret(err_d, false);
 
+        if (err_d == ERR_MP3_INDATA_UNDERFLOW && _input_done(stream)) {
+            // Truncated last frame.
+            *end_of_stream = true;
+            break;
+        }
+
+        if (err_d == ERR_MP3_MAINDATA_UNDERFLOW) {
+            // First frame after a seek, its bit reservoir is in frames
+            // that were skipped. Play it as silence to keep the timing.
+            memset(output_buffer + samples_decoded, 0, frame_info->outputSamps * sizeof(short));
+            err_d = ERR_MP3_NONE;
+        }
+
         if (err_d == ERR_MP3_INVALID_HUFFCODES) {
+            _consume(stream, 1);
             break;
         }
 
         if (err_d < 0) {
-            *input_buffer_ref += 1;
-            *input_buffer_size -= 1;
+            _consume(stream, 1);
             continue;
         }
+        _consume(stream, available - offset - bytes_left);
 
-        if (frame_info->nChans == 1) {
-            mono_to_stereo(output_buffer + samples_decoded, frame_info->outputSamps);
-            samples_decoded += frame_info->outputSamps;
-        }
-
+        mp3_index_add(stream->index, stream->frame, frame_offset);
+        stream->frame++;
         samples_decoded += frame_info->outputSamps;
         ++i;
     }
+    if (!stream->mapped) {
+        xTaskNotify(READER.task, READER_SPACE, eSetBits);
+    }
     return samples_decoded;
 }
 
-void play_mp3(const void *filepath_v) {
-    const char* filepath = (char*) filepath_v;
-    
-    HMP3Decoder mp3d = MP3InitDecoder();
+void _log_stream_stats() {
+    ESP_LOGI(AUDIO_TAG, "Stream buffer: min fill %u of %u bytes, %u underruns.",
+             (unsigned) RING.min_fill, (unsigned) RING.capacity, (unsigned) RING.underruns);
+}
+
+/**
+ * Output format of an mp3 stream, fixed by its first decoded frame.
+ */
+struct stream_format_t {
+    uint32_t rate;
+    int in_channels;
+    int out_channels;
+    bool resample;
+};
 
-    FILE *audio_file = fopen(filepath, "r");
-    unsigned char *input_buffer = malloc(AUDIO_BUFFER_SIZE * sizeof(unsigned char));
-    short *output_buffer = malloc(10 * 2304 * sizeof(short));
+/**
+ * Clock i2s for the format of the first decoded frame. Rates i2s can not
+ * be clocked at are resampled to SAMPLE_RATE.
+ */
+void _configure_output(const MP3FrameInfo *frame_info, struct stream_format_t *format) {
+    format->in_channels = frame_info->nChans;
+#if CONFIG_AUDIO_MONO_I2S
+    format->out_channels = frame_info->nChans;
+#else
+    format->out_channels = 2;
+#endif
+    format->rate = frame_info->samprate;
+    format->resample = false;
 
-    if (!audio_file) {
-        ESP_LOGE(AUDIO_TAG, "Failed to open audio file.");
+    const i2s_channel_t channel = format->out_channels == 1 ? I2S_CHANNEL_MONO : I2S_CHANNEL_STEREO;
+    esp_err_t ret = ESP_ERR_NOT_SUPPORTED;
+#if CONFIG_AUDIO_FORCE_RESAMPLE
+    if (format->rate == SAMPLE_RATE)
+#endif
+    {
+        ret = _set_clk(format->rate, channel);
     }
-
-    if (!input_buffer) {
-        ESP_LOGE(AUDIO_TAG, "Input Buffer failed to allocate.");
+    if (ret == ESP_OK) {
+        ESP_LOGI(AUDIO_TAG, "Stream is %u Hz, %d channel(s).", (unsigned) format->rate, format->in_channels);
         return;
     }
 
-    if (!output_buffer) {
-        ESP_LOGE(AUDIO_TAG, "Output Buffer failed to allocate.");
-        return;
+    if (resampler_init(&ARENA.mp3.resampler, format->rate, SAMPLE_RATE, format->in_channels)) {
+        ESP_LOGI(AUDIO_TAG, "Resampling %u Hz stream to %d Hz.", (unsigned) format->rate, SAMPLE_RATE);
+        format->resample = true;
+    } else {
+        ESP_LOGW(AUDIO_TAG, "Can not play %u Hz, stream will play at the wrong speed.", (unsigned) format->rate);
     }
+    format->rate = SAMPLE_RATE;
+    _set_clk(SAMPLE_RATE, channel);
+}
+
+/**
+ * Stream an already decoded pcm sidecar straight from RING to i2s,
+ * starting start_ms in.
+ *
+ * @return true if the sidecar played to the end.
+ */
+bool play_pcm(FILE *pcm_file, const struct pcm_cache_header_t *header, uint32_t start_ms) {
+    const uint32_t frame_bytes = header->channels * sizeof(short);
+    const uint32_t total_frames = header->data_bytes / frame_bytes;
+    uint32_t position = (uint32_t) ((uint64_t) start_ms * header->sample_rate / 1000);
+    if (position >= total_frames) {
+        position = 0;
+    }
+    fseek(pcm_file, position * frame_bytes, SEEK_CUR);
+    DURATION_MS = (uint32_t) ((uint64_t) total_frames * 1000 / header->sample_rate);
+    POSITIONED = true;
+    _start_reader(pcm_file);
+
+    struct source_meter_t meter;
+    _meter_start(&meter);
 
-    size_t i2s_bytes_written = 0;
-    size_t bytes_to_read = AUDIO_BUFFER_SIZE;
-    int input_buffer_size = 0;
-    MP3FrameInfo frame_info; 
+    // Gain and clipping are already applied, only the fade-in is left.
+    struct pcm_process_t process;
+    pcm_process_init(&process, PCM_UNITY_GAIN, (uint32_t) ((uint64_t) FADE_IN_MS * header->sample_rate / 1000));
 
-    i2s_set_clk(I2S_PORT_NUM, SAMPLE_RATE, I2S_BITS_PER_SAMPLE_16BIT, I2S_CHANNEL_STEREO);
-    
-    bool unfinished_file = true;
+    const i2s_channel_t channel = header->channels == 1 ? I2S_CHANNEL_MONO : I2S_CHANNEL_STEREO;
+    _set_clk(header->sample_rate, channel);
     i2s_start(I2S_PORT_NUM);
-    while (unfinished_file) {
+    bool end_of_stream = false;
+    while (1) {
         if (_handle_controls()) {
             break;
         }
-        unsigned long bytes_read = fread(input_buffer + input_buffer_size, 
-                                         sizeof(char), 
-                                         bytes_to_read, 
-                                         audio_file);
+        uint8_t *window = NULL;
+        uint32_t available = rb_read_window(&RING, &window, PCM_CHUNK_SIZE);
+        while (available < PCM_CHUNK_SIZE && !rb_is_eof(&RING)) {
+            xSemaphoreTake(READER.data_ready, pdMS_TO_TICKS(100));
+            available = rb_read_window(&RING, &window, PCM_CHUNK_SIZE);
+        }
+        if (available > PCM_CHUNK_SIZE) {
+            available = PCM_CHUNK_SIZE;
+        }
+        available -= available % frame_bytes;
+        if (available == 0) {
+            end_of_stream = true;
+            break;
+        }
+        int16_t *slot = _acquire_slot();
+        memcpy(slot, window, available);
+        rb_consume(&RING, available);
+        if (header->channels == 1) {
+            pcm_fade_mono(&process, slot, available / frame_bytes);
+        } else {
+            pcm_fade_stereo(&process, slot, available / frame_bytes);
+        }
+        _submit_slot(slot, available);
+        xTaskNotify(READER.task, READER_SPACE, eSetBits);
+        position += available / frame_bytes;
+        POSITION_MS = (uint32_t) ((uint64_t) position * 1000 / header->sample_rate);
+    }
+    _meter_end(&meter, "PCM cache");
+    _log_stream_stats();
+    _stop_reader();
+    return end_of_stream;
+}
 
-        if (bytes_read != bytes_to_read) {
-            if (feof(audio_file)) {
-                ESP_LOGI(AUDIO_TAG, "End of file encounted. Exiting or finishing stream.");
-                if (bytes_read == 0) {
-                    break;
-                } else {
-                    unfinished_file = false; 
-                }
-            } else { // retry read
-                bytes_read = fread(input_buffer + input_buffer_size, 
-                                         sizeof(char), 
-                                         bytes_to_read, 
-                                         audio_file);
-                if (bytes_read == 0) {
-                    break;
-                }
-            }
+/**
+ * Clear what the decoder carries from frame to frame so the single
+ * instance can start a new stream. A silent frame flushes the imdct
+ * overlap and the synthesis filter, the bit reservoir is dropped directly.
+ */
+void _reset_decoder(HMP3Decoder mp3d) {
+    unsigned char *frame = SILENT_FRAME;
+    int bytes_left = sizeof(SILENT_FRAME);
+    MP3Decode(mp3d, &frame, &bytes_left, ARENA.mp3.decode, 0);
+
+    MP3DecInfo *info = (MP3DecInfo *) mp3d;
+    info->mainDataBegin = 0;
+    info->mainDataBytes = 0;
+}
+
+/**
+ * Map the flash copy of the alarm and index it. The probe reads the
+ * mapping through fmemopen, playback decodes straight from it.
+ */
+bool _open_flash_alarm(struct flash_alarm_t *alarm) {
+    if (flash_alarm_map(alarm) != ESP_OK) {
+        ESP_LOGE(AUDIO_TAG, "No alarm in flash.");
+        return false;
+    }
+    FILE *probe = fmemopen((void *) alarm->data, alarm->size, "r");
+    bool found = probe && mp3_index_open_memory(&INDEX, FLASH_ALARM_NAME, alarm->size, alarm->src_mtime, probe);
+    if (probe) {
+        fclose(probe);
+    }
+    if (!found) {
+        ESP_LOGE(AUDIO_TAG, "No mp3 stream in flash alarm.");
+        flash_alarm_unmap(alarm);
+    }
+    return found;
+}
+
+/**
+ * Decode and play an mp3 file, or the flash alarm for FLASH_ALARM_NAME,
+ * from start_ms.
+ *
+ * @return true if the file played to the end.
+ */
+bool _play_mp3(const char *filepath, uint32_t start_ms) {
+    struct pcm_cache_header_t header;
+    const uint32_t gain = GAIN_Q15;
+    const bool in_flash = strcmp(filepath, FLASH_ALARM_NAME) == 0;
+    struct flash_alarm_t alarm = {0};
+    FILE *audio_file = NULL;
+    if (in_flash) {
+        if (!_open_flash_alarm(&alarm)) {
+            _IS_STOPPED = true;
+            return false;
+        }
+    } else {
+        FILE *pcm_file = pcm_cache_open(filepath, gain, &header);
+        if (pcm_file) {
+            ESP_LOGI(AUDIO_TAG, "Playing decoded pcm cache of %s.", filepath);
+            return play_pcm(pcm_file, &header, start_ms);
         }
-        input_buffer_size += bytes_read;
 
-        if (input_buffer_size == 0) {
+        audio_file = aud_open_stream(filepath);
+        if (!audio_file) {
+            ESP_LOGE(AUDIO_TAG, "Failed to open audio file.");
+            _IS_STOPPED = true;
+            return false;
+        }
+        // A library entry already holds the probed layout. A scan still
+        // running is waited for, its entry saves the probe.
+        xSemaphoreTake(LIBRARY_LOCK, portMAX_DELAY);
+        const struct aud_lib_entry_t *entry = aud_lib_find(filepath);
+        bool found = true;
+        if (entry) {
+            mp3_index_open_known(&INDEX, filepath, &entry->mp3, entry->frame_bytes);
+        } else {
+            found = mp3_index_open(&INDEX, filepath, audio_file);
+        }
+        xSemaphoreGive(LIBRARY_LOCK);
+        if (!found) {
+            ESP_LOGE(AUDIO_TAG, "No mp3 stream in %s.", filepath);
+            fclose(audio_file);
             _IS_STOPPED = true;
+            return false;
+        }
+    }
+
+    // Positions are in samples per channel from the first decoded sample,
+    // the gapless pre-roll and padding are never played.
+    const uint32_t rate = INDEX.header.sample_rate;
+    const uint32_t frame_samples = INDEX.header.frame_samples;
+    const uint64_t skip = mp3_index_skip(&INDEX);
+    bool exact;
+    const uint64_t length = mp3_index_samples(&INDEX, &exact);
+    const uint64_t end = skip != 0 && exact ? skip + length : UINT64_MAX;
+    uint64_t target = (uint64_t) start_ms * rate / 1000;
+    // Past an estimated length may still be in the file, a target past it
+    // only ends the stream early.
+    if (exact && target >= length) {
+        target = 0;
+    }
+    target += skip;
+    DURATION_MS = (uint32_t) (length * 1000 / rate);
+    POSITIONED = true;
+
+    struct mp3_stream_t stream = {
+        .index = &INDEX,
+        .mapped = alarm.data,
+        .mapped_size = alarm.size,
+    };
+    stream.offset = mp3_index_locate(&INDEX, (uint32_t) (target / frame_samples), &stream.frame);
+
+    HMP3Decoder mp3d = DECODER;
+    short *output_buffer = ARENA.mp3.decode;
+    _reset_decoder(mp3d);
+    if (audio_file) {
+        fseek(audio_file, stream.offset, SEEK_SET);
+        _start_reader(audio_file);
+    }
+
+    // The cache holds audio before the fade-in, so while it is being
+    // written the ramp runs as a separate pass. Only whole passes of files
+    // are cached, the flash copy is already fast to read.
+    struct pcm_cache_writer_t cache = {0};
+    bool caching = !in_flash && target == skip && pcm_cache_begin(&cache, filepath, gain);
+    struct pcm_process_t process;
+    struct pcm_process_t fade;
+
+    struct source_meter_t meter;
+    _meter_start(&meter);
+    MP3FrameInfo frame_info = {0};
+    struct stream_format_t format = {0};
+
+    bool end_of_stream = false;
+    while (!end_of_stream) {
+        if (_handle_controls()) {
             break;
         }
 
+        // Decode straight into the next output slot unless the resampler
+        // writes the slot.
+        int16_t *slot = _acquire_slot();
+        short *decoded = format.resample ? output_buffer : slot;
         int samples_decoded = decode_n_frames(
-                10,
+                FRAMES_PER_WRITE,
                 mp3d, 
-                input_buffer, 
-                &input_buffer_size, 
-                output_buffer, 
-                &frame_info
+                decoded, 
+                &frame_info,
+                &stream,
+                &end_of_stream
                 );
 
-        if (samples_decoded != 0) { 
-            lower_volume(output_buffer, samples_decoded);
-        }
-
-        bytes_to_read = AUDIO_BUFFER_SIZE - input_buffer_size;
         if (samples_decoded == 0) {
             continue;
         }
+        if (format.rate == 0) {
+            _configure_output(&frame_info, &format);
+            if (format.resample) {
+                memcpy(output_buffer, decoded, samples_decoded * sizeof(short));
+                decoded = output_buffer;
+            }
+            const uint32_t fade_frames = (uint32_t) ((uint64_t) FADE_IN_MS * format.rate / 1000);
+            pcm_process_init(&process, gain, caching ? 0 : fade_frames);
+            pcm_process_init(&fade, PCM_UNITY_GAIN, caching ? fade_frames : 0);
+            i2s_start(I2S_PORT_NUM);
+        }
+        if (caching && GAIN_Q15 != gain) {
+            ESP_LOGI(AUDIO_TAG, "Gain changed, dropping pcm cache of this pass.");
+            pcm_cache_abort(&cache);
+            caching = false;
+        }
+        pcm_process_set_gain(&process, GAIN_Q15);
 
-        memmove(input_buffer, input_buffer + AUDIO_BUFFER_SIZE - input_buffer_size, input_buffer_size);
+        // Free format streams may change layout mid stream, keep the first.
+        if (frame_info.nChans != format.in_channels) {
+            continue;
+        }
+        // Drop what is before the start position or past the gapless end.
+        const uint64_t last = (uint64_t) stream.frame * frame_samples;
+        const uint64_t first = last - samples_decoded / format.in_channels;
+        const uint64_t from = first > target ? first : target;
+        const uint64_t to = last < end ? last : end;
+        if (to <= from) {
+            continue;
+        }
+        POSITION_MS = (uint32_t) ((to - skip) * 1000 / rate);
+        int16_t *pcm = decoded + (from - first) * format.in_channels;
+        int frames = (int) (to - from);
+        if (format.resample) {
+            frames = resampler_process(&ARENA.mp3.resampler, pcm, frames, slot);
+            pcm = slot;
+        }
+        int samples_out = 0;
+        if (format.in_channels == 2) {
+            samples_out = pcm_process_stereo(&process, pcm, frames);
+        } else if (format.out_channels == 1) {
+            samples_out = pcm_process_mono(&process, pcm, frames);
+        } else {
+            samples_out = pcm_process_mono_to_stereo(&process, pcm, frames);
+        }
 
-        i2s_write(I2S_PORT_NUM, output_buffer, samples_decoded * sizeof(short), &i2s_bytes_written, portMAX_DELAY);
-        vTaskDelay(pdMS_TO_TICKS(5));
+        if (caching) {
+            pcm_cache_append(&cache, pcm, samples_out * sizeof(short));
+        }
+        if (format.out_channels == 1) {
+            pcm_fade_mono(&fade, pcm, frames);
+        } else {
+            pcm_fade_stereo(&fade, pcm, frames);
+        }
+        _submit_slot(pcm, samples_out * sizeof(short));
     };
+    _meter_end(&meter, "MP3 decode");
+    _log_stream_stats();
     // Clean up
-    ESP_LOGI(AUDIO_TAG, "Cleaning mp3 decoder.");
-    MP3FreeDecoder(mp3d);
-    ESP_LOGI(AUDIO_TAG, "Cleaning input buffer.");
-    free(input_buffer);
-    ESP_LOGI(AUDIO_TAG, "Closing audio file.");
-    fclose(audio_file);
-    ESP_LOGI(AUDIO_TAG, "Cleaning output buffer.");
-    free(output_buffer);
+    if (in_flash) {
+        flash_alarm_unmap(&alarm);
+    } else {
+        ESP_LOGI(AUDIO_TAG, "Stopping reader and closing audio file.");
+        _stop_reader();
+    }
+    if (end_of_stream) {
+        mp3_index_finish(&INDEX, filepath, stream.frame);
+    }
+    if (end_of_stream && caching && format.rate != 0) {
+        pcm_cache_finish(&cache, format.rate, format.out_channels);
+    } else {
+        pcm_cache_abort(&cache);
+    }
+    return end_of_stream;
+}
+
+void play_mp3(const char *filepath, uint32_t start_ms) {
+    POSITION_MS = start_ms;
+    DURATION_MS = 0;
+    POSITIONED = false;
+    if (_play_mp3(filepath, start_ms)) {
+        START_MS = 0;
+    } else if (_IS_STOPPED && POSITIONED) {
+        // Stopped part way, aud_resume picks up from here.
+        START_MS = POSITION_MS;
+        CAN_RESUME = true;
+    }
+}
+
+void aud_get_stream_stats(struct aud_stream_stats_t *stats) {
+    stats->capacity = RING.capacity;
+    stats->fill_level = rb_fill_level(&RING);
+    stats->min_fill = RING.min_fill;
+    stats->underruns = RING.underruns;
 }
+
 aud_err_t aud_play_mp3(char* filepath) {
     ESP_LOGI(AUDIO_TAG, "Notifying audio task to switch to playing mp3 file.");
     // Obtain the lock to prevent the audio loop from reading audio source before it haqs been written.
     if (xSemaphoreTake(SOURCE.lock, 0)) {
-        eTaskState state = eTaskGetState(AUDIO_HANDLE);
-        uint32_t ret = pdPASS;
-        if (state != eSuspended) {
-            ret = xTaskNotify(AUDIO_HANDLE, AUD_SWAP, eSetValueWithoutOverwrite);
-        }
-        else {
-            vTaskResume(AUDIO_HANDLE);
-        }
-        if (ret == pdPASS) {
+        if (_send_command(AUD_SWAP, 0) == AUD_OKAY) {
             ESP_LOGI(AUDIO_TAG, "Switching to playing mp3 file.");
             SOURCE.is_file = true;
             strcpy(SOURCE.file_path, filepath);
@@ -415,7 +1354,7 @@ aud_err_t aud_play_mp3(char* filepath) {
             return AUD_OKAY;
         }
         else {
-            ESP_LOGI(AUDIO_TAG, "Failed to send play mp3 notification. The previous message may not have been accepted");
+            ESP_LOGI(AUDIO_TAG, "Failed to queue play mp3 command. The command queue is full.");
             xSemaphoreGive(SOURCE.lock);
             return AUD_FAIL;
         }
@@ -424,26 +1363,39 @@ aud_err_t aud_play_mp3(char* filepath) {
         return AUD_FAIL;
     }
 }
-aud_err_t aud_play_sine(uint32_t freq) {
-    ESP_LOGI(AUDIO_TAG, "Notifying audio task to switch to playing sine wave");
+
+aud_err_t aud_play_flash_alarm() {
+    return aud_play_mp3(FLASH_ALARM_NAME);
+}
+
+aud_err_t aud_scan_library(const char *dir) {
+    if (!LIBRARY_LOCK) {
+        ESP_LOGW(AUDIO_TAG, "Audio not initialised, library of %s not scanned.", dir);
+        return AUD_FAIL;
+    }
+    xSemaphoreTake(LIBRARY_LOCK, portMAX_DELAY);
+    esp_err_t ret = aud_lib_scan(dir);
+    xSemaphoreGive(LIBRARY_LOCK);
+    if (ret != ESP_OK) {
+        ESP_LOGW(AUDIO_TAG, "Failed to scan the library of %s (%s).", dir, esp_err_to_name(ret));
+        return AUD_FAIL;
+    }
+    return AUD_OKAY;
+}
+
+aud_err_t _play_tone(const struct tone_pattern_t *pattern, uint32_t freq) {
     if (xSemaphoreTake(SOURCE.lock, 0)) {
-        eTaskState state = eTaskGetState(AUDIO_HANDLE);
-        uint32_t ret = pdPASS;
-        if (state != eSuspended) {
-            ret = xTaskNotify(AUDIO_HANDLE, AUD_SWAP, eSetValueWithoutOverwrite);
-        }
-        else {
-            vTaskResume(AUDIO_HANDLE);
-        }
-        if (ret == pdPASS) {
+        if (_send_command(AUD_SWAP, 0) == AUD_OKAY) {
             ESP_LOGI(AUDIO_TAG, "Switching to playing sine wave.");
             SOURCE.is_file = false;
             SOURCE.file_path[0] = '\0';
+            SOURCE.tone_freq = freq;
+            SOURCE.pattern = pattern;
             xSemaphoreGive(SOURCE.lock);
             return AUD_OKAY;
         }
         else {
-            ESP_LOGI(AUDIO_TAG, "Failed to send play sine notification. The previous message may not have been accepted");
+            ESP_LOGI(AUDIO_TAG, "Failed to queue play sine command. The command queue is full.");
             xSemaphoreGive(SOURCE.lock);
             return AUD_FAIL;
         }
@@ -453,74 +1405,193 @@ aud_err_t aud_play_sine(uint32_t freq) {
     }
 }
 
+aud_err_t aud_play_sine(uint32_t freq) {
+    if (freq == 0 || freq > SAMPLE_RATE / 2) {
+        ESP_LOGW(AUDIO_TAG, "Tone frequency %u Hz out of range.", (unsigned) freq);
+        return AUD_FAIL;
+    }
+    ESP_LOGI(AUDIO_TAG, "Notifying audio task to switch to playing sine wave");
+    return _play_tone(NULL, freq);
+}
+
+aud_err_t aud_play_pattern(const struct tone_pattern_t *pattern) {
+    ESP_LOGI(AUDIO_TAG, "Notifying audio task to switch to playing tone pattern");
+    return _play_tone(pattern, 0);
+}
+
 aud_err_t aud_pause() {
-    ESP_LOGI(AUDIO_TAG, "Sending pause notification.");
-    uint32_t ret = xTaskNotify(AUDIO_HANDLE, AUD_PAUSE, eSetValueWithoutOverwrite);
-    if (ret == pdPASS) {
-        ESP_LOGI(AUDIO_TAG, "Sending pause notification successful.");
+    ESP_LOGI(AUDIO_TAG, "Sending pause command.");
+    if (_send_command(AUD_PAUSE, 0) == AUD_OKAY) {
+        ESP_LOGI(AUDIO_TAG, "Sending pause command successful.");
         return AUD_OKAY;
     }
     else {
-        ESP_LOGI(AUDIO_TAG, "Failed to send pause notification. The previous message may not have been accepted");
+        ESP_LOGI(AUDIO_TAG, "Failed to send pause command. The command queue is full.");
         return AUD_FAIL;
     }
 }
 
 
 aud_err_t aud_resume() {
-    ESP_LOGI(AUDIO_TAG, "Sending resume notification.");
-    uint32_t ret = xTaskNotify(AUDIO_HANDLE, AUD_PLAY, eSetValueWithoutOverwrite);
-    if (ret == pdPASS) {
-        ESP_LOGI(AUDIO_TAG, "Sending resume notification successful.");
+    ESP_LOGI(AUDIO_TAG, "Sending resume command.");
+    if (_send_command(AUD_PLAY, 0) == AUD_OKAY) {
+        ESP_LOGI(AUDIO_TAG, "Sending resume command successful.");
         return AUD_OKAY;
     }
     else {
-        ESP_LOGI(AUDIO_TAG, "Failed to send resume notification. The previous message may not have been accepted");
+        ESP_LOGI(AUDIO_TAG, "Failed to send resume command. The command queue is full.");
         return AUD_FAIL;
     }
 }
 
 aud_err_t aud_stop() {
-    ESP_LOGI(AUDIO_TAG, "Sending stop notification to audio task.");
-    uint32_t ret = xTaskNotify(AUDIO_HANDLE, AUD_STOP, eSetValueWithoutOverwrite);
-    if (ret == pdPASS) {
-        ESP_LOGI(AUDIO_TAG, "Sending stop notification successful.");
+    ESP_LOGI(AUDIO_TAG, "Sending stop command to audio task.");
+    if (_send_command(AUD_STOP, 0) == AUD_OKAY) {
+        ESP_LOGI(AUDIO_TAG, "Sending stop command successful.");
         return AUD_OKAY;
     }
     else {
-        ESP_LOGI(AUDIO_TAG, "Failed to send stop notification. The previous message may not have been accepted");
+        ESP_LOGI(AUDIO_TAG, "Failed to send stop command. The command queue is full.");
+        return AUD_FAIL;
+    }
+}
+
+bool aud_is_playing() {
+    return !_IS_STOPPED && !_IS_PAUSED;
+}
+
+aud_err_t aud_seek(uint32_t position_ms) {
+    ESP_LOGI(AUDIO_TAG, "Sending seek command to audio task.");
+    if (_send_command(AUD_SEEK, position_ms) == AUD_OKAY) {
+        return AUD_OKAY;
+    }
+    else {
+        ESP_LOGI(AUDIO_TAG, "Failed to send seek command. The command queue is full.");
+        return AUD_FAIL;
+    }
+}
+
+uint32_t aud_get_position_ms() {
+    return POSITION_MS;
+}
+
+uint32_t aud_get_duration_ms() {
+    return DURATION_MS;
+}
+
+aud_err_t aud_set_gain(uint32_t gain_q15) {
+    if (gain_q15 > PCM_MAX_GAIN) {
+        ESP_LOGW(AUDIO_TAG, "Gain out of range.");
         return AUD_FAIL;
     }
+    GAIN_Q15 = gain_q15;
+    return AUD_OKAY;
 }
 
+uint32_t aud_get_gain() {
+    return GAIN_Q15;
+}
+
+aud_err_t aud_set_fade_in(uint32_t fade_ms) {
+    FADE_IN_MS = fade_ms;
+    return AUD_OKAY;
+}
+
+void aud_get_cmd_stats(struct aud_cmd_stats_t *stats) {
+    *stats = CMD_STATS;
+}
+
+#if CONFIG_AUDIO_HEAP_CHECK
+#define STRESS_SOURCES          5
+#define STRESS_PLAY_MS          20
+#define STRESS_SLACK_BYTES      1024  // other tasks allocating meanwhile
+
+/**
+ * Wait for the audio task to take every queued command, then let the
+ * new source run for a moment.
+ */
+static void _stress_settle() {
+    while (uxQueueMessagesWaiting(CMD_QUEUE) > 0) {
+        vTaskDelay(1);
+    }
+    vTaskDelay(pdMS_TO_TICKS(STRESS_PLAY_MS));
+}
+
+aud_err_t aud_swap_stress(char *mp3_path, uint32_t n_swaps) {
+    size_t baseline = 0;
+    size_t lowest = SIZE_MAX;
+    uint32_t refused = 0;
+    esp_log_level_set(AUDIO_TAG, ESP_LOG_WARN);
+    // The first round of every source is not counted, it may make state
+    // that lives on, e.g. the card's stdio locks.
+    for (uint32_t i = 0; i < STRESS_SOURCES + n_swaps; i++) {
+        aud_err_t ret;
+        switch (i % STRESS_SOURCES) {
+            case 0: ret = aud_play_sine(220 + i % 1000); break;
+            case 1: ret = aud_play_pattern(&TONE_BEEP_CADENCE); break;
+            case 2: ret = aud_play_pattern(&TONE_SIREN_SWEEP); break;
+            case 3: ret = aud_play_mp3(mp3_path); break;
+            default: ret = aud_stop(); break;
+        }
+        refused += ret != AUD_OKAY;
+        _stress_settle();
+        if (i % STRESS_SOURCES == STRESS_SOURCES - 1) {
+            const size_t free_bytes = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+            baseline = i == STRESS_SOURCES - 1 ? free_bytes : baseline;
+            lowest = free_bytes < lowest ? free_bytes : lowest;
+        }
+    }
+    aud_stop();
+    _stress_settle();
+    esp_log_level_set(AUDIO_TAG, ESP_LOG_INFO);
+
+    const size_t final = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    ESP_LOGI(AUDIO_TAG, "Swap stress: %u swaps, %u refused, %u bytes free before, %u after, %u lowest when stopped.",
+             (unsigned) n_swaps, (unsigned) refused, (unsigned) baseline, (unsigned) final, (unsigned) lowest);
+    if (final + STRESS_SLACK_BYTES < baseline) {
+        ESP_LOGE(AUDIO_TAG, "Swap stress: heap shrank by %u bytes.", (unsigned) (baseline - final));
+        return AUD_FAIL;
+    }
+    return AUD_OKAY;
+}
+#endif
+
 void aud_main(void *unused) {
 
     while (1) {
+#if CONFIG_AUDIO_HEAP_CHECK
         heap_caps_check_integrity(MALLOC_CAP_DEFAULT, true);
+#endif
+        // Blocks on the command queue until a source is selected.
         _handle_controls();
-
         if (_IS_STOPPED) {
-            vTaskSuspend(NULL);
+            continue;
         }
+
         const char* file_path = NULL;
         bool is_file = false;
+        uint32_t tone_freq = 0;
+        const struct tone_pattern_t *pattern = NULL;
 
         if (xSemaphoreTake(SOURCE.lock, pdMS_TO_TICKS(1000))) {
             file_path = SOURCE.file_path;
             is_file = SOURCE.is_file;
+            tone_freq = SOURCE.tone_freq;
+            pattern = SOURCE.pattern;
             xSemaphoreGive(SOURCE.lock);
         } 
         else {
-             ESP_LOGW(AUDIO_TAG, "Failed to obtain audio source lock. Suspending.");
-             vTaskSuspend(NULL);
+             ESP_LOGW(AUDIO_TAG, "Failed to obtain audio source lock. Stopping.");
+             _IS_STOPPED = true;
+             continue;
         }
 
         if (is_file) {
-            play_mp3(file_path);
+            play_mp3(file_path, START_MS);
         } 
         else {
         ESP_LOGI(AUDIO_TAG, "main Leftover mem: %d", (int) heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
-            sine_wave();
+            sine_wave(pattern, tone_freq);
         }
     }
 }
@@ -1,8 +1,13 @@
 #ifndef _AUDIO_H
 #define _AUDIO_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "sdkconfig.h"
+
+#include "tone.h"
+
 // I2S pins for amp
 #define I2S_LRC                 26    // Left Right Clock (A.K.A. WS) #define I2S_BCLK                25    // Bit Clock
 #define I2S_BCLK                25    // Bit Clock
@@ -16,21 +21,159 @@ struct aud_i2s_config_t {
     uint32_t din_gpio;
 };
 
+/**
+ * Fill level counters of the mp3 stream buffer, reset when a stream starts.
+ */
+struct aud_stream_stats_t {
+    uint32_t capacity;
+    uint32_t fill_level;
+    uint32_t min_fill;
+    uint32_t underruns;
+};
+
+/**
+ * Command-to-effect latency of pause/resume/play/stop commands, measured
+ * from the api call to the point the audio task applies the command.
+ */
+struct aud_cmd_stats_t {
+    uint32_t count;
+    uint32_t coalesced;   // commands that cancelled out without an effect
+    uint32_t last_us;
+    uint32_t max_us;
+    uint64_t total_us;
+};
+
+/**
+ * Time the decode task spent playing sources and, of that, time blocked
+ * waiting for a free output buffer or on the command queue. Busy time is
+ * active_us - blocked_us.
+ */
+struct aud_cpu_stats_t {
+    uint64_t active_us;
+    uint64_t blocked_us;
+    uint64_t bytes_written;  // pcm bytes handed to the output task
+};
+
+/**
+ * Output task time writing buffers to i2s, mostly waiting on DMA, and time
+ * idle waiting for the decode task. Decode and DMA overlap when the decode
+ * busy time plus busy_us exceeds the time played.
+ */
+struct aud_output_stats_t {
+    uint64_t busy_us;
+    uint64_t idle_us;
+    uint32_t buffers;
+};
+
 typedef enum {
     AUD_OKAY = 0,
     AUD_FAIL = 1
 } aud_err_t;
 
+/**
+ * Call from a task pinned to PRO_CPU, the i2s interrupt is allocated on
+ * the calling core and the output task is pinned there.
+ */
 aud_err_t aud_init(const struct aud_i2s_config_t *config);
 
+/**
+ * Play a steady tone until stopped. freq must be between 1 Hz and half
+ * the output sample rate.
+ */
 aud_err_t aud_play_sine(uint32_t freq);
 
+/**
+ * Play an alarm pattern (see tone.h) until stopped. The pattern must stay
+ * valid while it is playing.
+ */
+aud_err_t aud_play_pattern(const struct tone_pattern_t *pattern);
+
 aud_err_t aud_play_mp3(char* filepath);
 
+/**
+ * Play the copy of the alarm kept in the flash "alarm" partition (see
+ * flash_alarm.h), for when the SD card is missing. It is decoded straight
+ * from the memory mapped partition.
+ */
+aud_err_t aud_play_flash_alarm();
+
+/**
+ * Build the sound library of dir (see audio_library.h) while no stream is
+ * probed. Playback started meanwhile waits for the scan and then uses its
+ * entries. Needs aud_init.
+ */
+aud_err_t aud_scan_library(const char *dir);
+
 aud_err_t aud_pause();
 
+/**
+ * Resume a paused source. A stopped mp3 restarts where it was stopped.
+ */
 aud_err_t aud_resume();
 
 aud_err_t aud_stop();
 
+/**
+ * @return true while a source is playing, neither stopped nor paused.
+ */
+bool aud_is_playing();
+
+/**
+ * Move the current mp3 to position_ms. While stopped the position is
+ * kept for the next aud_resume. Exact once the file has an index sidecar,
+ * estimated from its Xing header or bitrate before that.
+ */
+aud_err_t aud_seek(uint32_t position_ms);
+
+uint32_t aud_get_position_ms();
+
+/**
+ * Length of the current mp3 in ms, 0 if unknown. Estimated from the
+ * bitrate until the file has an index sidecar, if it has no Xing or VBRI
+ * header.
+ */
+uint32_t aud_get_duration_ms();
+
+/**
+ * Set the mp3 output gain in Q15, 32768 is unity and up to 65535 is
+ * allowed, peaks are soft clipped. Takes effect from the next frame.
+ */
+aud_err_t aud_set_gain(uint32_t gain_q15);
+
+uint32_t aud_get_gain();
+
+/**
+ * Ramp mp3 sources up from silence over fade_ms when they start, for a
+ * progressive alarm. 0 disables the ramp.
+ */
+aud_err_t aud_set_fade_in(uint32_t fade_ms);
+
+void aud_get_stream_stats(struct aud_stream_stats_t *stats);
+
+void aud_get_cmd_stats(struct aud_cmd_stats_t *stats);
+
+void aud_get_cpu_stats(struct aud_cpu_stats_t *stats);
+
+void aud_get_output_stats(struct aud_output_stats_t *stats);
+
+/**
+ * Log the memory reserved by the audio engine and the current heap. All
+ * of it is taken in aud_init, playing and switching sources allocates
+ * nothing.
+ */
+void aud_log_memory_budget();
+
+#if CONFIG_AUDIO_HEAP_CHECK
+/**
+ * Swap sources n_swaps times, cycling through a steady tone, both tone
+ * patterns, mp3_path and stop, and compare the free heap before and
+ * after. Each source runs for a moment so it gets to allocate if it
+ * does. Blocks the caller for about 20 ms per swap.
+ *
+ * @return AUD_FAIL if the free heap shrank by more than other tasks
+ *         can account for.
+ */
+aud_err_t aud_swap_stress(char *mp3_path, uint32_t n_swaps);
+#endif
+
 #endif
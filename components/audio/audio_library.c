@@ -0,0 +1,236 @@
+#include "audio_library.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+
+#include "storage.h"
+
+#define DIR_LEN                 32
+
+static const char *LIB_TAG = "Audio Library";
+
+static char DIR_PATH[DIR_LEN];
+static struct aud_lib_entry_t ENTRIES[AUD_LIB_MAX_ENTRIES];
+static size_t N_ENTRIES = 0;
+// Set once the scan is complete, lookups before then find nothing.
+static volatile bool READY = false;
+
+static bool _join(const char *name, char *out, size_t size) {
+    int n = snprintf(out, size, "%s/%s", DIR_PATH, name);
+    return n >= 0 && (size_t) n < size;
+}
+
+static bool _is_playable(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot && strcasecmp(dot, ".mp3") == 0;
+}
+
+static void _load() {
+    char path[MP3_INDEX_PATH_LEN];
+    if (!_join(AUD_LIB_FILE, path, sizeof(path))) {
+        return;
+    }
+    FILE *file = storage_fopen(path, "r");
+    if (!file) {
+        return;
+    }
+    struct aud_lib_file_header_t header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+        header.magic == AUD_LIB_MAGIC &&
+        header.version == AUD_LIB_VERSION &&
+        header.entry_size == sizeof(struct aud_lib_entry_t) &&
+        header.n_entries <= AUD_LIB_MAX_ENTRIES &&
+        fread(ENTRIES, sizeof(ENTRIES[0]), header.n_entries, file) == header.n_entries;
+    fclose(file);
+    if (!valid) {
+        ESP_LOGI(LIB_TAG, "Discarding stale library %s.", path);
+        return;
+    }
+    N_ENTRIES = header.n_entries;
+    for (size_t i = 0; i < N_ENTRIES; i++) {
+        ENTRIES[i].name[AUD_LIB_NAME_LEN - 1] = '\0';
+    }
+}
+
+static void _save() {
+    char path[MP3_INDEX_PATH_LEN];
+    char tmp_path[MP3_INDEX_PATH_LEN];
+    if (!_join(AUD_LIB_FILE, path, sizeof(path)) || !_join(AUD_LIB_TMP_FILE, tmp_path, sizeof(tmp_path))) {
+        return;
+    }
+    FILE *file = storage_fopen(tmp_path, "w");
+    if (!file) {
+        ESP_LOGW(LIB_TAG, "Failed to create library %s.", tmp_path);
+        return;
+    }
+    const struct aud_lib_file_header_t header = {
+        .magic = AUD_LIB_MAGIC,
+        .version = AUD_LIB_VERSION,
+        .entry_size = sizeof(struct aud_lib_entry_t),
+        .n_entries = N_ENTRIES,
+    };
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(ENTRIES, sizeof(ENTRIES[0]), N_ENTRIES, file) == N_ENTRIES &&
+        storage_fsync(file) == 0;
+    ok = (fclose(file) == 0) && ok;
+
+    // FAT rename does not replace an existing file.
+    storage_unlink(path);
+    if (!ok || storage_rename(tmp_path, path) != 0) {
+        ESP_LOGW(LIB_TAG, "Failed to complete library %s.", path);
+        storage_unlink(tmp_path);
+        return;
+    }
+    ESP_LOGI(LIB_TAG, "Wrote library %s, %u sounds.", path, (unsigned) N_ENTRIES);
+}
+
+static struct aud_lib_entry_t *_find_name(const char *name) {
+    for (size_t i = 0; i < N_ENTRIES; i++) {
+        if (strcasecmp(ENTRIES[i].name, name) == 0) {
+            return &ENTRIES[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Probe the stream layout of name into entry. scratch holds the index,
+ * which is too large for the stack.
+ */
+static bool _probe(struct aud_lib_entry_t *entry, const char *name, struct mp3_index_t *scratch) {
+    char path[MP3_INDEX_PATH_LEN];
+    if (!_join(name, path, sizeof(path))) {
+        return false;
+    }
+    FILE *file = storage_fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    scratch->path[0] = '\0';
+    bool found = mp3_index_open(scratch, path, file);
+    fclose(file);
+    if (!found || scratch->header.sample_rate == 0) {
+        ESP_LOGW(LIB_TAG, "No mp3 stream in %s.", path);
+        return false;
+    }
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->name, name);
+    entry->format = AUD_LIB_MP3;
+    entry->duration_ms = (uint32_t) (mp3_index_samples(scratch, NULL) * 1000 / scratch->header.sample_rate);
+    entry->frame_bytes = scratch->frame_bytes;
+    entry->mp3 = scratch->header;
+    entry->mp3.n_points = 0;
+    return true;
+}
+
+/**
+ * Drop entries whose file is gone or no longer plays.
+ *
+ * @return true if any were dropped.
+ */
+static bool _compact(const bool *keep) {
+    size_t n = 0;
+    for (size_t i = 0; i < N_ENTRIES; i++) {
+        if (keep[i]) {
+            ENTRIES[n++] = ENTRIES[i];
+        }
+    }
+    bool changed = n != N_ENTRIES;
+    N_ENTRIES = n;
+    return changed;
+}
+
+esp_err_t aud_lib_scan(const char *dir) {
+    if (READY) {
+        return ESP_OK;
+    }
+    int n = snprintf(DIR_PATH, sizeof(DIR_PATH), "%s", dir);
+    if (n < 0 || (size_t) n >= sizeof(DIR_PATH)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    DIR *directory = storage_opendir(dir);
+    if (!directory) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    struct mp3_index_t *scratch = malloc(sizeof(*scratch));
+    if (!scratch) {
+        closedir(directory);
+        return ESP_ERR_NO_MEM;
+    }
+
+    _load();
+    bool keep[AUD_LIB_MAX_ENTRIES] = {false};
+    bool changed = false;
+    uint32_t n_probed = 0;
+    struct dirent *item;
+    while ((item = readdir(directory)) != NULL) {
+        const char *name = item->d_name;
+        if (item->d_type == DT_DIR || !_is_playable(name)) {
+            continue;
+        }
+        char path[MP3_INDEX_PATH_LEN];
+        struct stat st;
+        if (strlen(name) >= AUD_LIB_NAME_LEN || !_join(name, path, sizeof(path)) ||
+            storage_stat(path, &st) != 0) {
+            ESP_LOGW(LIB_TAG, "Skipping %s.", name);
+            continue;
+        }
+        struct aud_lib_entry_t *entry = _find_name(name);
+        if (entry && entry->mp3.src_size == (uint32_t) st.st_size &&
+            entry->mp3.src_mtime == (uint32_t) st.st_mtime) {
+            keep[entry - ENTRIES] = true;
+            continue;
+        }
+        if (!entry && N_ENTRIES == AUD_LIB_MAX_ENTRIES) {
+            ESP_LOGW(LIB_TAG, "Library full, skipping %s.", name);
+            continue;
+        }
+        // A changed file that no longer plays is dropped by _compact.
+        struct aud_lib_entry_t *slot = entry ? entry : &ENTRIES[N_ENTRIES];
+        n_probed++;
+        if (!_probe(slot, name, scratch)) {
+            continue;
+        }
+        if (!entry) {
+            N_ENTRIES++;
+        }
+        keep[slot - ENTRIES] = true;
+        changed = true;
+    }
+    closedir(directory);
+    free(scratch);
+
+    changed = _compact(keep) || changed;
+    if (changed) {
+        _save();
+    }
+    ESP_LOGI(LIB_TAG, "%u sounds in %s, %u probed.", (unsigned) N_ENTRIES, dir, (unsigned) n_probed);
+    READY = true;
+    return ESP_OK;
+}
+
+size_t aud_lib_count() {
+    return READY ? N_ENTRIES : 0;
+}
+
+const struct aud_lib_entry_t *aud_lib_get(size_t i) {
+    return i < aud_lib_count() ? &ENTRIES[i] : NULL;
+}
+
+const struct aud_lib_entry_t *aud_lib_find(const char *path) {
+    const size_t dir_len = strlen(DIR_PATH);
+    if (!READY || strncmp(path, DIR_PATH, dir_len) != 0 || path[dir_len] != '/') {
+        return NULL;
+    }
+    return _find_name(path + dir_len + 1);
+}
+
+bool aud_lib_path(const struct aud_lib_entry_t *entry, char *out, size_t size) {
+    return _join(entry->name, out, size);
+}
@@ -0,0 +1,80 @@
+#ifndef _AUDIO_LIBRARY_H
+#define _AUDIO_LIBRARY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "mp3_index.h"
+
+#define AUD_LIB_FILE            "sounds.lib"
+#define AUD_LIB_TMP_FILE        "sounds.li~"
+#define AUD_LIB_MAGIC           0x42494c41  // "ALIB"
+#define AUD_LIB_VERSION         1
+#define AUD_LIB_MAX_ENTRIES     32
+#define AUD_LIB_NAME_LEN        32
+
+enum {
+    AUD_LIB_MP3 = 1,
+};
+
+/**
+ * A playable file in the library directory. The mp3 header is the one
+ * mp3_index probed, without seek points, so playing the entry needs no
+ * second probe.
+ */
+struct aud_lib_entry_t {
+    char name[AUD_LIB_NAME_LEN];
+    uint8_t format;
+    uint8_t reserved[3];
+    uint32_t duration_ms;          // estimated from the bitrate without a Xing header
+    uint32_t frame_bytes;          // of the first frame
+    struct mp3_index_header_t mp3; // sample rate, channels, first frame offset, source size and mtime
+};
+
+/**
+ * Start of the library file in the scanned directory, followed by
+ * n_entries entries.
+ */
+struct aud_lib_file_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t n_entries;
+};
+
+/**
+ * Build the library of dir, e.g. "/sd". Entries are loaded from the
+ * library file and only files whose size or mtime changed are probed
+ * again, the file is rewritten if anything changed. Runs once, later
+ * calls return straight away, so lookups never see the table change.
+ * Probes with mp3_index_open, on the device call it through
+ * aud_scan_library so no stream is probed at the same time.
+ */
+esp_err_t aud_lib_scan(const char *dir);
+
+size_t aud_lib_count();
+
+/**
+ * @return the entry at i in directory order, NULL past the end.
+ */
+const struct aud_lib_entry_t *aud_lib_get(size_t i);
+
+/**
+ * Look up a full path, e.g. "/sd/alarm.mp3". Names compare without case
+ * like FAT does.
+ *
+ * @return NULL if the library is not scanned or has no such file.
+ */
+const struct aud_lib_entry_t *aud_lib_find(const char *path);
+
+/**
+ * Full path of entry for aud_play_mp3.
+ *
+ * @return false if the result does not fit in size bytes.
+ */
+bool aud_lib_path(const struct aud_lib_entry_t *entry, char *out, size_t size);
+
+#endif // _AUDIO_LIBRARY_H
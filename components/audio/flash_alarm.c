@@ -0,0 +1,125 @@
+#include "flash_alarm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "storage.h"
+
+static const char *FLASH_TAG = "Flash Alarm";
+
+// Set once the copy in flash passed its crc check.
+static bool VERIFIED = false;
+
+static const esp_partition_t *_partition() {
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, FLASH_ALARM_SUBTYPE, FLASH_ALARM_PARTITION);
+}
+
+static uint32_t _sector_align(uint32_t size) {
+    return (size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+}
+
+esp_err_t flash_alarm_update(const char *src_path) {
+    const esp_partition_t *partition = _partition();
+    if (!partition) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    struct stat st;
+    if (storage_stat(src_path, &st) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    struct flash_alarm_header_t header;
+    esp_err_t ret = esp_partition_read(partition, 0, &header, sizeof(header));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (header.magic == FLASH_ALARM_MAGIC &&
+        header.src_size == (uint32_t) st.st_size &&
+        header.src_mtime == (uint32_t) st.st_mtime) {
+        return ESP_OK;
+    }
+    if (sizeof(header) + st.st_size > partition->size) {
+        ESP_LOGW(FLASH_TAG, "%s does not fit in the %u byte partition.", src_path, (unsigned) partition->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    FILE *file = storage_fopen(src_path, "r");
+    if (!file) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint8_t *chunk = malloc(FLASH_ALARM_COPY_SIZE);
+    if (!chunk) {
+        fclose(file);
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(FLASH_TAG, "Copying %s to flash.", src_path);
+    VERIFIED = false;
+    ret = esp_partition_erase_range(partition, 0, _sector_align(sizeof(header) + st.st_size));
+
+    header = (struct flash_alarm_header_t) {
+        .magic = FLASH_ALARM_MAGIC,
+        .size = 0,
+        .src_size = (uint32_t) st.st_size,
+        .src_mtime = (uint32_t) st.st_mtime,
+        .crc = 0,
+    };
+    while (ret == ESP_OK && header.size < header.src_size) {
+        size_t n = fread(chunk, 1, FLASH_ALARM_COPY_SIZE, file);
+        if (n == 0) {
+            ret = ESP_FAIL;
+            break;
+        }
+        header.crc = esp_rom_crc32_le(header.crc, chunk, n);
+        ret = esp_partition_write(partition, sizeof(header) + header.size, chunk, n);
+        header.size += n;
+    }
+    if (ret == ESP_OK) {
+        ret = esp_partition_write(partition, 0, &header, sizeof(header));
+    }
+    if (ret == ESP_OK) {
+        ESP_LOGI(FLASH_TAG, "Copied %u bytes to flash.", (unsigned) header.size);
+    } else {
+        ESP_LOGW(FLASH_TAG, "Failed to copy %s to flash (%s).", src_path, esp_err_to_name(ret));
+    }
+    fclose(file);
+    free(chunk);
+    return ret;
+}
+
+esp_err_t flash_alarm_map(struct flash_alarm_t *alarm) {
+    const esp_partition_t *partition = _partition();
+    struct flash_alarm_header_t header;
+    if (!partition ||
+        esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK ||
+        header.magic != FLASH_ALARM_MAGIC ||
+        sizeof(header) + header.size > partition->size) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const void *mapped = NULL;
+    esp_err_t ret = esp_partition_mmap(partition, 0, sizeof(header) + header.size, SPI_FLASH_MMAP_DATA,
+                                       &mapped, &alarm->handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    alarm->data = (const uint8_t *) mapped + sizeof(header);
+    alarm->size = header.size;
+    alarm->src_mtime = header.src_mtime;
+    if (!VERIFIED) {
+        if (esp_rom_crc32_le(0, alarm->data, alarm->size) != header.crc) {
+            ESP_LOGE(FLASH_TAG, "Flash alarm is corrupt.");
+            flash_alarm_unmap(alarm);
+            return ESP_ERR_INVALID_CRC;
+        }
+        VERIFIED = true;
+    }
+    return ESP_OK;
+}
+
+void flash_alarm_unmap(struct flash_alarm_t *alarm) {
+    spi_flash_munmap(alarm->handle);
+    alarm->data = NULL;
+    alarm->size = 0;
+}
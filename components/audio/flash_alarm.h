@@ -0,0 +1,55 @@
+#ifndef _FLASH_ALARM_H
+#define _FLASH_ALARM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+
+#define FLASH_ALARM_PARTITION   "alarm"
+#define FLASH_ALARM_SUBTYPE     0x40
+#define FLASH_ALARM_MAGIC       0x4d4c4641  // "AFLM"
+#define FLASH_ALARM_NAME        "flash:alarm"  // index name of the flash copy
+#define FLASH_ALARM_COPY_SIZE   4096
+
+/**
+ * Start of the alarm partition. The mp3 follows the header. The header is
+ * written after the data, so an interrupted upload leaves no magic and is
+ * never played.
+ */
+struct flash_alarm_header_t {
+    uint32_t magic;
+    uint32_t size;        // mp3 bytes after the header
+    uint32_t src_size;    // of the SD file it was copied from
+    uint32_t src_mtime;
+    uint32_t crc;         // of the mp3 bytes
+};
+
+/**
+ * Memory mapped alarm, valid until flash_alarm_unmap.
+ */
+struct flash_alarm_t {
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t src_mtime;
+    spi_flash_mmap_handle_t handle;
+};
+
+/**
+ * Copy src_path into the alarm partition unless it already holds the
+ * same size and mtime. Erases and writes flash, so nothing may be playing
+ * from the partition meanwhile.
+ */
+esp_err_t flash_alarm_update(const char *src_path);
+
+/**
+ * Map the alarm partition. The crc is checked on the first map after boot.
+ *
+ * @return ESP_ERR_NOT_FOUND if there is no partition or no complete copy.
+ */
+esp_err_t flash_alarm_map(struct flash_alarm_t *alarm);
+
+void flash_alarm_unmap(struct flash_alarm_t *alarm);
+
+#endif // _FLASH_ALARM_H
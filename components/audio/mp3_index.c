@@ -0,0 +1,389 @@
+#include "mp3_index.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+
+#include "pcm_cache.h"
+#include "storage.h"
+
+#define PROBE_SIZE              4096
+#define ID3V2_HEADER_SIZE       10
+#define ID3V1_SIZE              128
+#define XING_FRAMES             0x1
+#define XING_BYTES              0x2
+#define XING_TOC                0x4
+#define XING_QUALITY            0x8
+#define VBRI_OFFSET             36    // header + 32 bytes, fixed for every layout
+
+static const char *INDEX_TAG = "MP3 Index";
+
+// Too large for a task stack and shared by every probe, callers on the
+// device are serialised by the library lock of audio.c.
+static uint8_t PROBE[PROBE_SIZE];
+
+// kbps, Layer III only.
+static const uint16_t BITRATES[2][15] = {
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},  // MPEG 1
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},      // MPEG 2 and 2.5
+};
+static const uint32_t SAMPLE_RATES[3] = {44100, 48000, 32000};
+
+static uint32_t _be32(const uint8_t *b) {
+    return ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | b[3];
+}
+
+bool mp3_parse_header(const uint8_t *data, struct mp3_frame_header_t *header) {
+    if (data[0] != 0xff || (data[1] & 0xe0) != 0xe0) {
+        return false;
+    }
+    const int version = (data[1] >> 3) & 0x3;   // 0: 2.5, 2: 2, 3: 1
+    const int layer = (data[1] >> 1) & 0x3;     // 1: III
+    const int bitrate_idx = data[2] >> 4;
+    const int rate_idx = (data[2] >> 2) & 0x3;
+    if (version == 1 || layer != 1 || bitrate_idx == 0 || bitrate_idx == 15 || rate_idx == 3) {
+        return false;
+    }
+    const bool mpeg1 = version == 3;
+    const uint32_t bitrate = BITRATES[mpeg1 ? 0 : 1][bitrate_idx] * 1000;
+
+    header->sample_rate = SAMPLE_RATES[rate_idx] >> (mpeg1 ? 0 : (version == 2 ? 1 : 2));
+    header->channels = (data[3] >> 6) == 3 ? 1 : 2;
+    header->frame_samples = mpeg1 ? 1152 : 576;
+    header->frame_bytes = header->frame_samples / 8 * bitrate / header->sample_rate + ((data[2] >> 1) & 0x1);
+    return true;
+}
+
+static bool _stat_source(const char *src_path, struct mp3_index_header_t *header) {
+    struct stat st;
+    if (storage_stat(src_path, &st) != 0) {
+        return false;
+    }
+    header->src_size = (uint32_t) st.st_size;
+    header->src_mtime = (uint32_t) st.st_mtime;
+    return true;
+}
+
+static bool _load(struct mp3_index_t *index, const char *src_path) {
+    char path[MP3_INDEX_PATH_LEN];
+    if (!aud_sidecar_path(src_path, MP3_INDEX_EXT, path, sizeof(path))) {
+        return false;
+    }
+    FILE *file = storage_fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    const struct mp3_index_header_t expected = index->header;
+    struct mp3_index_header_t *header = &index->header;
+    bool valid = fread(header, sizeof(*header), 1, file) == 1 &&
+        header->magic == MP3_INDEX_MAGIC &&
+        header->version == MP3_INDEX_VERSION &&
+        header->src_size == expected.src_size &&
+        header->src_mtime == expected.src_mtime &&
+        header->n_points > 0 && header->n_points <= MP3_INDEX_MAX_POINTS &&
+        fread(index->points, sizeof(uint32_t), header->n_points, file) == header->n_points;
+    fclose(file);
+
+    if (!valid) {
+        ESP_LOGI(INDEX_TAG, "Discarding stale index %s.", path);
+        storage_unlink(path);
+        index->header = expected;
+        return false;
+    }
+    index->complete = true;
+    index->scanned = header->n_frames;
+    return true;
+}
+
+/**
+ * Skip ID3v2 tags, there may be more than one.
+ */
+static uint32_t _skip_id3v2(FILE *file) {
+    uint32_t offset = 0;
+    uint8_t tag[ID3V2_HEADER_SIZE];
+    while (fseek(file, offset, SEEK_SET) == 0 &&
+           fread(tag, 1, sizeof(tag), file) == sizeof(tag) &&
+           memcmp(tag, "ID3", 3) == 0) {
+        // Syncsafe size excluding the header, plus an optional footer.
+        const uint32_t size = ((uint32_t) (tag[6] & 0x7f) << 21) | ((uint32_t) (tag[7] & 0x7f) << 14) |
+                              ((uint32_t) (tag[8] & 0x7f) << 7) | (tag[9] & 0x7f);
+        offset += ID3V2_HEADER_SIZE + size + ((tag[5] & 0x10) ? ID3V2_HEADER_SIZE : 0);
+    }
+    return offset;
+}
+
+/**
+ * Read the Xing/Info header and the LAME tag behind it, or a VBRI header,
+ * from the first frame.
+ *
+ * @return true if the frame only carries stream information.
+ */
+static bool _parse_info_frame(struct mp3_index_t *index, const uint8_t *frame, uint32_t available,
+                              const struct mp3_frame_header_t *first) {
+    struct mp3_index_header_t *header = &index->header;
+    // Side information length depends on version and channels.
+    const uint32_t side = first->frame_samples == 1152 ? (first->channels == 1 ? 17 : 32)
+                                                        : (first->channels == 1 ? 9 : 17);
+    const uint8_t *xing = frame + 4 + side;
+    if (4 + side + 8 <= available && (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0)) {
+        const uint32_t flags = _be32(xing + 4);
+        const uint8_t *p = xing + 8;
+        const uint8_t *end = frame + available;
+        if ((flags & XING_FRAMES) && p + 4 <= end) {
+            header->n_frames = _be32(p);
+            p += 4;
+        }
+        if (flags & XING_BYTES) {
+            p += 4;
+        }
+        if ((flags & XING_TOC) && p + 100 <= end) {
+            memcpy(index->toc, p, sizeof(index->toc));
+            index->has_toc = true;
+            p += 100;
+        }
+        if (flags & XING_QUALITY) {
+            p += 4;
+        }
+        if (p + 24 <= end && (memcmp(p, "LAME", 4) == 0 || memcmp(p, "Lavc", 4) == 0 || memcmp(p, "Lavf", 4) == 0)) {
+            header->enc_delay = (uint16_t) ((p[21] << 4) | (p[22] >> 4));
+            header->enc_padding = (uint16_t) (((p[22] & 0x0f) << 8) | p[23]);
+        }
+        return true;
+    }
+    const uint8_t *vbri = frame + VBRI_OFFSET;
+    if (VBRI_OFFSET + 18 <= available && memcmp(vbri, "VBRI", 4) == 0) {
+        header->n_frames = _be32(vbri + 14);
+        return true;
+    }
+    return false;
+}
+
+static bool _probe(struct mp3_index_t *index, FILE *file) {
+    struct mp3_index_header_t *header = &index->header;
+    const uint32_t offset = _skip_id3v2(file);
+    if (fseek(file, offset, SEEK_SET) != 0) {
+        return false;
+    }
+    const uint32_t available = fread(PROBE, 1, sizeof(PROBE), file);
+
+    // A header followed by another header, so a stray sync pattern in the
+    // tag padding is not mistaken for the first frame.
+    struct mp3_frame_header_t first;
+    struct mp3_frame_header_t next;
+    uint32_t i = 0;
+    for (; i + 4 <= available; i++) {
+        if (!mp3_parse_header(PROBE + i, &first)) {
+            continue;
+        }
+        const uint32_t following = i + first.frame_bytes;
+        if (following + 4 > available || mp3_parse_header(PROBE + following, &next)) {
+            break;
+        }
+    }
+    if (i + 4 > available) {
+        ESP_LOGW(INDEX_TAG, "No mp3 frame in the first %u bytes.", (unsigned) available);
+        return false;
+    }
+
+    header->sample_rate = first.sample_rate;
+    header->channels = first.channels;
+    header->frame_samples = first.frame_samples;
+    header->data_start = offset + i;
+    index->frame_bytes = first.frame_bytes;
+    if (_parse_info_frame(index, PROBE + i, available - i, &first)) {
+        header->data_start += first.frame_bytes;
+    }
+
+    header->data_end = header->src_size;
+    uint8_t tag[3];
+    if (header->src_size > ID3V1_SIZE &&
+        fseek(file, header->src_size - ID3V1_SIZE, SEEK_SET) == 0 &&
+        fread(tag, 1, sizeof(tag), file) == sizeof(tag) &&
+        memcmp(tag, "TAG", 3) == 0) {
+        header->data_end -= ID3V1_SIZE;
+    }
+    ESP_LOGI(INDEX_TAG, "Probed %u Hz, %u frames, delay %u, padding %u.", (unsigned) header->sample_rate,
+             (unsigned) header->n_frames, header->enc_delay, header->enc_padding);
+    return true;
+}
+
+static bool _open(struct mp3_index_t *index, const char *src_path, const struct mp3_index_header_t *source,
+                  FILE *file, bool persist) {
+    if (strcmp(index->path, src_path) == 0 &&
+        index->header.src_size == source->src_size &&
+        index->header.src_mtime == source->src_mtime) {
+        return true;
+    }
+
+    memset(index, 0, sizeof(*index));
+    index->header = *source;
+    index->header.magic = MP3_INDEX_MAGIC;
+    index->header.version = MP3_INDEX_VERSION;
+    index->header.interval = MP3_INDEX_INTERVAL;
+    // The probe also runs for a loaded index, the Xing table and first
+    // frame size are not persisted.
+    if (!_probe(index, file)) {
+        return false;
+    }
+    index->persist = persist;
+    if (persist) {
+        _load(index, src_path);
+    }
+    strncpy(index->path, src_path, sizeof(index->path) - 1);
+    return true;
+}
+
+bool mp3_index_open(struct mp3_index_t *index, const char *src_path, FILE *file) {
+    struct mp3_index_header_t source = {0};
+    if (!_stat_source(src_path, &source)) {
+        return false;
+    }
+    return _open(index, src_path, &source, file, true);
+}
+
+bool mp3_index_open_memory(struct mp3_index_t *index, const char *name, uint32_t src_size, uint32_t src_mtime,
+                           FILE *file) {
+    const struct mp3_index_header_t source = {
+        .src_size = src_size,
+        .src_mtime = src_mtime,
+    };
+    return _open(index, name, &source, file, false);
+}
+
+void mp3_index_open_known(struct mp3_index_t *index, const char *src_path, const struct mp3_index_header_t *header,
+                          uint32_t frame_bytes) {
+    if (strcmp(index->path, src_path) == 0 &&
+        index->header.src_size == header->src_size &&
+        index->header.src_mtime == header->src_mtime) {
+        return;
+    }
+    memset(index, 0, sizeof(*index));
+    index->header = *header;
+    index->header.interval = MP3_INDEX_INTERVAL;
+    index->header.n_points = 0;
+    index->frame_bytes = frame_bytes;
+    index->persist = true;
+    _load(index, src_path);
+    strncpy(index->path, src_path, sizeof(index->path) - 1);
+}
+
+void mp3_index_add(struct mp3_index_t *index, uint32_t frame, uint32_t offset) {
+    if (index->complete || frame != index->scanned) {
+        return;
+    }
+    index->scanned++;
+
+    struct mp3_index_header_t *header = &index->header;
+    if (frame % header->interval != 0) {
+        return;
+    }
+    if (header->n_points == MP3_INDEX_MAX_POINTS) {
+        if (header->interval > UINT16_MAX / 2) {
+            return;
+        }
+        // Out of room, halve the resolution.
+        for (uint32_t i = 0; i < MP3_INDEX_MAX_POINTS / 2; i++) {
+            index->points[i] = index->points[2 * i];
+        }
+        header->n_points = MP3_INDEX_MAX_POINTS / 2;
+        header->interval *= 2;
+        if (frame % header->interval != 0) {
+            return;
+        }
+    }
+    index->points[header->n_points++] = offset;
+}
+
+static void _save(const struct mp3_index_t *index, const char *src_path) {
+    char path[MP3_INDEX_PATH_LEN];
+    char tmp_path[MP3_INDEX_PATH_LEN];
+    if (!aud_sidecar_path(src_path, MP3_INDEX_EXT, path, sizeof(path)) ||
+        !aud_sidecar_path(src_path, MP3_INDEX_TMP_EXT, tmp_path, sizeof(tmp_path))) {
+        return;
+    }
+    FILE *file = storage_fopen(tmp_path, "w");
+    if (!file) {
+        ESP_LOGW(INDEX_TAG, "Failed to create index %s.", tmp_path);
+        return;
+    }
+    const struct mp3_index_header_t *header = &index->header;
+    bool ok = fwrite(header, sizeof(*header), 1, file) == 1 &&
+        fwrite(index->points, sizeof(uint32_t), header->n_points, file) == header->n_points &&
+        storage_fsync(file) == 0;
+    ok = (fclose(file) == 0) && ok;
+
+    // FAT rename does not replace an existing file.
+    storage_unlink(path);
+    if (!ok || storage_rename(tmp_path, path) != 0) {
+        ESP_LOGW(INDEX_TAG, "Failed to complete index %s.", path);
+        storage_unlink(tmp_path);
+        return;
+    }
+    ESP_LOGI(INDEX_TAG, "Wrote index %s, %u frames in %u points.", path,
+             (unsigned) header->n_frames, (unsigned) header->n_points);
+}
+
+void mp3_index_finish(struct mp3_index_t *index, const char *src_path, uint32_t n_frames) {
+    if (index->complete || index->scanned != n_frames || n_frames == 0) {
+        return;
+    }
+    index->header.n_frames = n_frames;
+    index->complete = true;
+    if (index->persist) {
+        _save(index, src_path);
+    }
+}
+
+uint32_t mp3_index_locate(const struct mp3_index_t *index, uint32_t frame, uint32_t *start_frame) {
+    const struct mp3_index_header_t *header = &index->header;
+    if (header->n_points > 0 && (index->complete || frame < index->scanned)) {
+        uint32_t point = frame / header->interval;
+        if (point >= header->n_points) {
+            point = header->n_points - 1;
+        }
+        *start_frame = point * header->interval;
+        return index->points[point];
+    }
+
+    *start_frame = frame;
+    const uint32_t data_bytes = header->data_end - header->data_start;
+    if (header->n_frames == 0) {
+        return header->data_start + frame * index->frame_bytes;
+    }
+    if (frame >= header->n_frames) {
+        return header->data_end;
+    }
+    if (!index->has_toc) {
+        return header->data_start + (uint32_t) ((uint64_t) data_bytes * frame / header->n_frames);
+    }
+    // Xing TOC entries are file positions in 1/256 at each percent.
+    const uint32_t scaled = (uint32_t) ((uint64_t) frame * 100 * 256 / header->n_frames);
+    const uint32_t percent = scaled / 256;
+    const uint32_t lower = index->toc[percent];
+    const uint32_t upper = percent < 99 ? index->toc[percent + 1] : 256;
+    const uint32_t position = lower * 256 + (upper - lower) * (scaled % 256);
+    return header->data_start + (uint32_t) ((uint64_t) data_bytes * position / (256 * 256));
+}
+
+uint32_t mp3_index_skip(const struct mp3_index_t *index) {
+    const struct mp3_index_header_t *header = &index->header;
+    if (header->enc_delay == 0 && header->enc_padding == 0) {
+        return 0;
+    }
+    return header->enc_delay + MP3_DECODER_DELAY;
+}
+
+uint64_t mp3_index_samples(const struct mp3_index_t *index, bool *exact) {
+    const struct mp3_index_header_t *header = &index->header;
+    uint64_t frames = header->n_frames;
+    if (exact) {
+        *exact = frames != 0;
+    }
+    if (frames == 0 && index->frame_bytes > 0) {
+        frames = (header->data_end - header->data_start) / index->frame_bytes;
+    }
+    const uint64_t samples = frames * header->frame_samples;
+    const uint32_t trim = header->enc_delay + header->enc_padding;
+    return samples > trim ? samples - trim : 0;
+}
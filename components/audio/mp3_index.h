@@ -0,0 +1,133 @@
+#ifndef _MP3_INDEX_H
+#define _MP3_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MP3_INDEX_EXT           "idx"
+#define MP3_INDEX_TMP_EXT       "id~"
+#define MP3_INDEX_MAGIC         0x58444941  // "AIDX"
+#define MP3_INDEX_VERSION       1
+#define MP3_INDEX_PATH_LEN      128
+#define MP3_INDEX_MAX_POINTS    1024
+#define MP3_INDEX_INTERVAL      16    // initial frames per seek point
+#define MP3_DECODER_DELAY       529   // samples the decoder lags the encoder by
+
+/**
+ * Layer III frame header fields needed to walk a stream.
+ */
+struct mp3_frame_header_t {
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t frame_samples;  // per channel
+    uint32_t frame_bytes;
+};
+
+/**
+ * Stream layout and seek table of an mp3 file, persisted beside it as a
+ * .idx sidecar once a full pass has walked every frame. Sample counts are
+ * per channel, offsets are bytes from the start of the file.
+ */
+struct mp3_index_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t interval;       // frames between seek points
+    uint32_t src_size;
+    uint32_t src_mtime;
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t frame_samples;
+    uint32_t data_start;     // first audio frame, after tags and the Xing/VBRI frame
+    uint32_t data_end;       // end of the audio frames, before an ID3v1 tag
+    uint32_t n_frames;       // 0 if unknown
+    uint16_t enc_delay;      // from the LAME tag, for gapless playback
+    uint16_t enc_padding;
+    uint32_t n_points;
+};
+
+struct mp3_index_t {
+    struct mp3_index_header_t header;
+    char path[MP3_INDEX_PATH_LEN];  // source the index belongs to
+    uint32_t frame_bytes;    // of the first frame, for estimates without a Xing header
+    bool complete;           // points cover every frame and n_frames is exact
+    bool persist;            // kept in a sidecar, false for sources outside the file system
+    bool has_toc;
+    uint8_t toc[100];        // Xing table of contents, used until the index is complete
+    uint32_t scanned;        // frames seen contiguously from the start
+    uint32_t points[MP3_INDEX_MAX_POINTS];
+};
+
+/**
+ * Parse a Layer III frame header.
+ *
+ * @return false if data does not start with a valid header.
+ */
+bool mp3_parse_header(const uint8_t *data, struct mp3_frame_header_t *header);
+
+/**
+ * Load the index sidecar of src_path, or probe the file's tags and
+ * Xing/VBRI/LAME headers when there is no valid sidecar. An index already
+ * held for the same file is kept, so seek points found while playing
+ * survive a seek or a stop.
+ *
+ * @return false if no audio frame was found.
+ */
+bool mp3_index_open(struct mp3_index_t *index, const char *src_path, FILE *file);
+
+/**
+ * As mp3_index_open for a source that is not a file, e.g. one in a flash
+ * partition read through fmemopen. The index is kept in memory only, name
+ * and src_size/src_mtime identify the source instead of a stat.
+ */
+bool mp3_index_open_memory(struct mp3_index_t *index, const char *name, uint32_t src_size, uint32_t src_mtime,
+                           FILE *file);
+
+/**
+ * As mp3_index_open for a source whose layout an earlier probe of the
+ * same size and mtime found, e.g. an audio library entry. Nothing is read
+ * from the source, only the sidecar seek points are loaded. The Xing
+ * table is not kept, so until the index is complete seeks are estimated
+ * from frame_bytes.
+ */
+void mp3_index_open_known(struct mp3_index_t *index, const char *src_path, const struct mp3_index_header_t *header,
+                          uint32_t frame_bytes);
+
+/**
+ * Record the frame at offset, called for every frame in stream order.
+ */
+void mp3_index_add(struct mp3_index_t *index, uint32_t frame, uint32_t offset);
+
+/**
+ * Mark the index complete once the stream ended after n_frames frames
+ * and write the sidecar. Does nothing unless every frame was seen.
+ */
+void mp3_index_finish(struct mp3_index_t *index, const char *src_path, uint32_t n_frames);
+
+/**
+ * Find where to start reading to reach frame. Exact for frames covered
+ * by seek points, otherwise estimated from the Xing table or the average
+ * frame size.
+ *
+ * @param uint32_t *start_frame set to the frame found at the returned offset.
+ * @return byte offset in the file.
+ */
+uint32_t mp3_index_locate(const struct mp3_index_t *index, uint32_t frame, uint32_t *start_frame);
+
+/**
+ * Samples per channel the decoder emits ahead of the first real sample,
+ * known only when the file has a LAME tag.
+ */
+uint32_t mp3_index_skip(const struct mp3_index_t *index);
+
+/**
+ * Samples per channel of playable audio, after gapless trimming. Counted
+ * from the frame count of a Xing or VBRI header or of the sidecar, else
+ * estimated from the average frame size. 0 if neither is known.
+ *
+ * @param bool *exact set to whether the frame count was known, may be NULL.
+ */
+uint64_t mp3_index_samples(const struct mp3_index_t *index, bool *exact);
+
+#endif // _MP3_INDEX_H
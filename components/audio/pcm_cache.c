@@ -0,0 +1,138 @@
+#include "pcm_cache.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+
+#include "storage.h"
+
+static const char *CACHE_TAG = "PCM Cache";
+
+bool aud_sidecar_path(const char *src_path, const char *ext, char *out, size_t size) {
+    const char *base = strrchr(src_path, '/');
+    const char *dot = strrchr(base ? base : src_path, '.');
+    size_t stem_len = dot ? (size_t) (dot - src_path) : strlen(src_path);
+
+    if (stem_len + 1 + strlen(ext) + 1 > size) {
+        return false;
+    }
+    memcpy(out, src_path, stem_len);
+    out[stem_len] = '.';
+    strcpy(out + stem_len + 1, ext);
+    return true;
+}
+
+static bool _stat_source(const char *src_path, struct pcm_cache_header_t *header) {
+    struct stat st;
+    if (storage_stat(src_path, &st) != 0) {
+        return false;
+    }
+    header->src_size = (uint32_t) st.st_size;
+    header->src_mtime = (uint32_t) st.st_mtime;
+    return true;
+}
+
+FILE *pcm_cache_open(const char *src_path, uint32_t gain_q15, struct pcm_cache_header_t *header) {
+    char path[PCM_CACHE_PATH_LEN];
+    struct pcm_cache_header_t expected;
+    if (!aud_sidecar_path(src_path, PCM_CACHE_EXT, path, sizeof(path)) ||
+        !_stat_source(src_path, &expected)) {
+        return NULL;
+    }
+
+    FILE *file = aud_open_stream(path);
+    if (!file) {
+        return NULL;
+    }
+
+    struct stat st;
+    bool valid = fread(header, sizeof(*header), 1, file) == 1 &&
+        header->magic == PCM_CACHE_MAGIC &&
+        header->version == PCM_CACHE_VERSION &&
+        header->src_size == expected.src_size &&
+        header->src_mtime == expected.src_mtime &&
+        header->gain_q15 == gain_q15 &&
+        storage_stat(path, &st) == 0 &&
+        (uint32_t) st.st_size == sizeof(*header) + header->data_bytes;
+
+    if (!valid) {
+        ESP_LOGI(CACHE_TAG, "Discarding stale pcm cache %s.", path);
+        fclose(file);
+        storage_unlink(path);
+        return NULL;
+    }
+    return file;
+}
+
+bool pcm_cache_begin(struct pcm_cache_writer_t *writer, const char *src_path, uint32_t gain_q15) {
+    memset(writer, 0, sizeof(*writer));
+    writer->failed = true;
+    if (!aud_sidecar_path(src_path, PCM_CACHE_EXT, writer->path, sizeof(writer->path)) ||
+        !aud_sidecar_path(src_path, PCM_CACHE_TMP_EXT, writer->tmp_path, sizeof(writer->tmp_path)) ||
+        !_stat_source(src_path, &writer->header)) {
+        return false;
+    }
+
+    // Left over from an interrupted stream.
+    storage_unlink(writer->tmp_path);
+
+    writer->file = storage_fopen(writer->tmp_path, "w");
+    if (!writer->file) {
+        ESP_LOGW(CACHE_TAG, "Failed to create pcm cache %s.", writer->tmp_path);
+        return false;
+    }
+    writer->header.magic = PCM_CACHE_MAGIC;
+    writer->header.version = PCM_CACHE_VERSION;
+    writer->header.gain_q15 = gain_q15;
+    writer->header.data_bytes = 0;
+    writer->failed = fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1;
+    return !writer->failed;
+}
+
+void pcm_cache_append(struct pcm_cache_writer_t *writer, const void *pcm, size_t n_bytes) {
+    if (writer->failed) {
+        return;
+    }
+    if (fwrite(pcm, 1, n_bytes, writer->file) != n_bytes) {
+        ESP_LOGW(CACHE_TAG, "Failed writing pcm cache, card may be full.");
+        writer->failed = true;
+        return;
+    }
+    writer->header.data_bytes += n_bytes;
+}
+
+void pcm_cache_finish(struct pcm_cache_writer_t *writer, uint32_t sample_rate, uint16_t channels) {
+    if (writer->failed || !writer->file) {
+        pcm_cache_abort(writer);
+        return;
+    }
+    writer->header.sample_rate = sample_rate;
+    writer->header.channels = channels;
+
+    bool ok = fseek(writer->file, 0, SEEK_SET) == 0 &&
+        fwrite(&writer->header, sizeof(writer->header), 1, writer->file) == 1 &&
+        storage_fsync(writer->file) == 0;
+    ok = (fclose(writer->file) == 0) && ok;
+    writer->file = NULL;
+
+    // FAT rename does not replace an existing file.
+    storage_unlink(writer->path);
+    if (!ok || storage_rename(writer->tmp_path, writer->path) != 0) {
+        ESP_LOGW(CACHE_TAG, "Failed to complete pcm cache %s.", writer->path);
+        storage_unlink(writer->tmp_path);
+        return;
+    }
+    ESP_LOGI(CACHE_TAG, "Wrote pcm cache %s, %u bytes.", writer->path, (unsigned) writer->header.data_bytes);
+}
+
+void pcm_cache_abort(struct pcm_cache_writer_t *writer) {
+    if (writer->file) {
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+    if (writer->tmp_path[0] != '\0') {
+        storage_unlink(writer->tmp_path);
+    }
+    writer->failed = true;
+}
@@ -0,0 +1,82 @@
+#ifndef _PCM_CACHE_H
+#define _PCM_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PCM_CACHE_EXT           "pcm"
+#define PCM_CACHE_TMP_EXT       "pc~"
+#define PCM_CACHE_MAGIC         0x4d435041  // "APCM"
+#define PCM_CACHE_VERSION       1
+#define PCM_CACHE_PATH_LEN      128
+
+/**
+ * Header at the start of a decoded pcm sidecar file. The sidecar is only
+ * valid for a source with the same size and mtime played at the same gain.
+ */
+struct pcm_cache_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t channels;
+    uint32_t sample_rate;
+    uint32_t src_size;
+    uint32_t src_mtime;
+    uint32_t gain_q15;
+    uint32_t data_bytes;
+};
+
+/**
+ * Sidecar being written while a source is decoded. The data goes to a
+ * temporary file which only replaces the sidecar once it is complete, so
+ * a stream interrupted by a stop or a power loss never leaves a partial
+ * sidecar behind.
+ */
+struct pcm_cache_writer_t {
+    FILE *file;
+    bool failed;
+    struct pcm_cache_header_t header;
+    char path[PCM_CACHE_PATH_LEN];
+    char tmp_path[PCM_CACHE_PATH_LEN];
+};
+
+/**
+ * Replace the extension of src_path with ext, e.g. /sd/alarm.mp3 -> /sd/alarm.pcm.
+ * Sidecar names stay within 8.3 so they work without FAT long file names.
+ *
+ * @return false if the result does not fit in size bytes.
+ */
+bool aud_sidecar_path(const char *src_path, const char *ext, char *out, size_t size);
+
+/**
+ * Open path for sequential reading through the audio read-ahead buffer,
+ * which is DMA capable and a whole number of sectors, so FAT fills it
+ * with multi-sector reads. There is one such buffer, close the stream
+ * before opening the next. Defined in audio.c.
+ */
+FILE *aud_open_stream(const char *path);
+
+/**
+ * Open the sidecar of src_path if it matches the source and gain.
+ * Stale or truncated sidecars are deleted.
+ *
+ * @return the sidecar positioned at its first sample, or NULL.
+ */
+FILE *pcm_cache_open(const char *src_path, uint32_t gain_q15, struct pcm_cache_header_t *header);
+
+bool pcm_cache_begin(struct pcm_cache_writer_t *writer, const char *src_path, uint32_t gain_q15);
+
+void pcm_cache_append(struct pcm_cache_writer_t *writer, const void *pcm, size_t n_bytes);
+
+/**
+ * Complete the sidecar and move it into place.
+ */
+void pcm_cache_finish(struct pcm_cache_writer_t *writer, uint32_t sample_rate, uint16_t channels);
+
+/**
+ * Drop a partially written sidecar.
+ */
+void pcm_cache_abort(struct pcm_cache_writer_t *writer);
+
+#endif // _PCM_CACHE_H
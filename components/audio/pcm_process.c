@@ -0,0 +1,126 @@
+#include "pcm_process.h"
+
+#include <stdbool.h>
+
+#define RAMP_ONE                (1u << 30)
+
+void pcm_process_init(struct pcm_process_t *state, uint32_t gain_q15, uint32_t fade_frames) {
+    pcm_process_set_gain(state, gain_q15);
+    if (fade_frames == 0) {
+        state->ramp_q30 = RAMP_ONE;
+        state->ramp_step = 0;
+    } else {
+        state->ramp_q30 = 0;
+        state->ramp_step = RAMP_ONE / fade_frames;
+        if (state->ramp_step == 0) {
+            state->ramp_step = 1;
+        }
+    }
+}
+
+void pcm_process_set_gain(struct pcm_process_t *state, uint32_t gain_q15) {
+    state->gain_q15 = gain_q15 > PCM_MAX_GAIN ? PCM_MAX_GAIN : gain_q15;
+}
+
+static inline int16_t _soft_clip(int32_t x) {
+    if (x > PCM_CLIP_KNEE) {
+        x = PCM_CLIP_KNEE + ((x - PCM_CLIP_KNEE) >> 2);
+        return x > INT16_MAX ? INT16_MAX : (int16_t) x;
+    } else if (x < -PCM_CLIP_KNEE) {
+        x = -PCM_CLIP_KNEE - ((-PCM_CLIP_KNEE - x) >> 2);
+        return x < INT16_MIN ? INT16_MIN : (int16_t) x;
+    }
+    return (int16_t) x;
+}
+
+/**
+ * Gain, then the fade when fading. Two Q15 steps rather than one combined
+ * factor, so the result is exactly that of separate gain and fade passes.
+ */
+static inline __attribute__((always_inline))
+int32_t _scale(int32_t x, int32_t gain, int32_t fade_q15, const bool fading) {
+    x = (x * gain) >> 15;
+    return fading ? (x * fade_q15) >> 15 : x;
+}
+
+static inline __attribute__((always_inline))
+void _emit(int16_t *buffer, size_t i, int32_t gain, int32_t fade_q15,
+           const int in_channels, const int out_channels, const bool fading, const bool clip) {
+    if (in_channels == 1 && out_channels == 1) {
+        const int32_t x = _scale(buffer[i], gain, fade_q15, fading);
+        buffer[i] = clip ? _soft_clip(x) : (int16_t) x;
+    } else if (in_channels == 1) {
+        const int32_t x = _scale(buffer[i], gain, fade_q15, fading);
+        const int16_t s = clip ? _soft_clip(x) : (int16_t) x;
+        buffer[2 * i] = s;
+        buffer[2 * i + 1] = s;
+    } else {
+        const int32_t l = _scale(buffer[2 * i], gain, fade_q15, fading);
+        const int32_t r = _scale(buffer[2 * i + 1], gain, fade_q15, fading);
+        buffer[2 * i] = clip ? _soft_clip(l) : (int16_t) l;
+        buffer[2 * i + 1] = clip ? _soft_clip(r) : (int16_t) r;
+    }
+}
+
+/**
+ * Single pass over the buffer, specialised at compile time for the
+ * channel layouts and whether to clip. Frames are visited last to first so
+ * mono input can be expanded in place.
+ */
+static inline __attribute__((always_inline))
+void _process(struct pcm_process_t *state, int16_t *buffer, size_t n_frames,
+              const int32_t gain, const int in_channels, const int out_channels, const bool clip) {
+    const uint32_t ramp = state->ramp_q30;
+    const uint32_t step = state->ramp_step;
+
+    size_t n_ramp = 0;
+    if (ramp < RAMP_ONE) {
+        n_ramp = (RAMP_ONE - ramp + step - 1) / step;
+        if (n_ramp > n_frames) {
+            n_ramp = n_frames;
+        }
+    }
+
+    for (size_t i = n_frames; i-- > n_ramp;) {
+        _emit(buffer, i, gain, 0, in_channels, out_channels, false, clip);
+    }
+    for (size_t i = n_ramp; i-- > 0;) {
+        // ramp + i * step stays below RAMP_ONE for every i < n_ramp.
+        const uint32_t r = ramp + (uint32_t) i * step;
+        _emit(buffer, i, gain, (int32_t) (r >> 15), in_channels, out_channels, true, clip);
+    }
+
+    if (n_ramp > 0) {
+        const uint64_t next = (uint64_t) ramp + (uint64_t) n_ramp * step;
+        state->ramp_q30 = next >= RAMP_ONE ? RAMP_ONE : (uint32_t) next;
+    }
+}
+
+size_t pcm_process_mono(struct pcm_process_t *state, int16_t *buffer, size_t n_frames) {
+    _process(state, buffer, n_frames, state->gain_q15, 1, 1, true);
+    return n_frames;
+}
+
+size_t pcm_process_mono_to_stereo(struct pcm_process_t *state, int16_t *buffer, size_t n_frames) {
+    _process(state, buffer, n_frames, state->gain_q15, 1, 2, true);
+    return 2 * n_frames;
+}
+
+size_t pcm_process_stereo(struct pcm_process_t *state, int16_t *buffer, size_t n_frames) {
+    _process(state, buffer, n_frames, state->gain_q15, 2, 2, true);
+    return 2 * n_frames;
+}
+
+void pcm_fade_stereo(struct pcm_process_t *state, int16_t *buffer, size_t n_frames) {
+    if (state->ramp_q30 >= RAMP_ONE) {
+        return;
+    }
+    _process(state, buffer, n_frames, PCM_UNITY_GAIN, 2, 2, false);
+}
+
+void pcm_fade_mono(struct pcm_process_t *state, int16_t *buffer, size_t n_frames) {
+    if (state->ramp_q30 >= RAMP_ONE) {
+        return;
+    }
+    _process(state, buffer, n_frames, PCM_UNITY_GAIN, 1, 1, false);
+}
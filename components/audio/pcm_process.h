@@ -0,0 +1,62 @@
+#ifndef _PCM_PROCESS_H
+#define _PCM_PROCESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PCM_UNITY_GAIN          32768   // Q15
+#define PCM_MAX_GAIN            65535
+#define PCM_CLIP_KNEE           24576   // soft clipping starts at 3/4 of full scale
+
+/**
+ * Post-processing state of one stream: output gain and the progress of
+ * the fade-in ramp. The ramp is Q30, 1 << 30 is full volume.
+ */
+struct pcm_process_t {
+    uint32_t gain_q15;
+    uint32_t ramp_q30;
+    uint32_t ramp_step;
+};
+
+/**
+ * @param uint32_t gain_q15 output gain, PCM_UNITY_GAIN is unity.
+ * @param uint32_t fade_frames length of the fade-in ramp, 0 for none.
+ */
+void pcm_process_init(struct pcm_process_t *state, uint32_t gain_q15, uint32_t fade_frames);
+
+void pcm_process_set_gain(struct pcm_process_t *state, uint32_t gain_q15);
+
+/**
+ * Apply gain, the fade-in ramp and soft clipping to n_frames mono samples
+ * in place.
+ *
+ * @return number of output samples.
+ */
+size_t pcm_process_mono(struct pcm_process_t *state, int16_t *buffer, size_t n_frames);
+
+/**
+ * Apply gain, the fade-in ramp and soft clipping to n_frames mono samples
+ * and expand them in place to interleaved stereo. buffer must hold
+ * 2 * n_frames samples.
+ *
+ * @return number of output samples.
+ */
+size_t pcm_process_mono_to_stereo(struct pcm_process_t *state, int16_t *buffer, size_t n_frames);
+
+/**
+ * Apply gain, the fade-in ramp and soft clipping to n_frames interleaved
+ * stereo frames in place.
+ *
+ * @return number of output samples.
+ */
+size_t pcm_process_stereo(struct pcm_process_t *state, int16_t *buffer, size_t n_frames);
+
+/**
+ * Apply only the fade-in ramp to already processed stereo frames, used
+ * for pcm that was cached before the fade.
+ */
+void pcm_fade_stereo(struct pcm_process_t *state, int16_t *buffer, size_t n_frames);
+
+void pcm_fade_mono(struct pcm_process_t *state, int16_t *buffer, size_t n_frames);
+
+#endif // _PCM_PROCESS_H
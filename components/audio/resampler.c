@@ -0,0 +1,113 @@
+#include "resampler.h"
+
+#include <math.h>
+#include <string.h>
+
+// Q14 leaves headroom for taps above unity next to the centre.
+#define COEFF_BITS              14
+#define COEFF_ONE               (1 << COEFF_BITS)
+
+static uint32_t _gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static float _sinc(float x) {
+    if (fabsf(x) < 1e-6f) {
+        return 1.0f;
+    }
+    return sinf((float) M_PI * x) / ((float) M_PI * x);
+}
+
+/**
+ * Design the prototype low pass at up * in_rate and split it into phases,
+ * each normalised to unity gain so there is no ripple between phases.
+ */
+static void _design(struct resampler_t *resampler) {
+    const uint32_t up = resampler->up;
+    const uint32_t length = up * RESAMPLE_TAPS;
+    const float centre = (float) (length - 1) / 2.0f;
+    // Cut off at the lower of the two Nyquist frequencies.
+    const float cutoff = 1.0f / (float) (up > resampler->down ? up : resampler->down);
+
+    for (uint32_t phase = 0; phase < up; phase++) {
+        float taps[RESAMPLE_TAPS];
+        float sum = 0.0f;
+        for (int k = 0; k < RESAMPLE_TAPS; k++) {
+            const float n = (float) (phase + k * up);
+            const float window = 0.54f - 0.46f * cosf(2.0f * (float) M_PI * n / (float) (length - 1));
+            taps[k] = _sinc(cutoff * (n - centre)) * window;
+            sum += taps[k];
+        }
+        int32_t total = 0;
+        for (int k = 0; k < RESAMPLE_TAPS; k++) {
+            resampler->coeffs[phase][k] = (int16_t) lrintf(taps[k] / sum * (float) COEFF_ONE);
+            total += resampler->coeffs[phase][k];
+        }
+        // Put the rounding error on a centre tap.
+        resampler->coeffs[phase][RESAMPLE_TAPS / 2] += (int16_t) (COEFF_ONE - total);
+    }
+}
+
+bool resampler_init(struct resampler_t *resampler, uint32_t in_rate, uint32_t out_rate, int channels) {
+    const uint32_t divisor = _gcd(in_rate, out_rate);
+    resampler->up = out_rate / divisor;
+    resampler->down = in_rate / divisor;
+    resampler->channels = channels;
+    resampler->pos = 0;
+    memset(resampler->history, 0, sizeof(resampler->history));
+    if (resampler->up > RESAMPLE_MAX_PHASES || channels > RESAMPLE_MAX_CHANNELS) {
+        return false;
+    }
+    _design(resampler);
+    return true;
+}
+
+size_t resampler_max_output(const struct resampler_t *resampler, size_t in_frames) {
+    return (in_frames * resampler->up) / resampler->down + 1;
+}
+
+static inline int16_t _input(const struct resampler_t *resampler, const int16_t *in, int channel, int32_t idx) {
+    if (idx >= 0) {
+        return in[idx * resampler->channels + channel];
+    }
+    return resampler->history[channel][RESAMPLE_TAPS - 1 + idx];
+}
+
+size_t resampler_process(struct resampler_t *resampler, const int16_t *in, size_t in_frames, int16_t *out) {
+    const uint32_t up = resampler->up;
+    const uint32_t down = resampler->down;
+    const int channels = resampler->channels;
+    const uint32_t end = (uint32_t) in_frames * up;
+
+    size_t n_out = 0;
+    uint32_t pos = resampler->pos;
+    while (pos < end) {
+        const int32_t base = (int32_t) (pos / up);
+        const int16_t *h = resampler->coeffs[pos % up];
+        for (int c = 0; c < channels; c++) {
+            int32_t acc = 0;
+            for (int k = 0; k < RESAMPLE_TAPS; k++) {
+                acc += (int32_t) h[k] * _input(resampler, in, c, base - k);
+            }
+            acc >>= COEFF_BITS;
+            out[n_out * channels + c] = acc > INT16_MAX ? INT16_MAX : (acc < INT16_MIN ? INT16_MIN : (int16_t) acc);
+        }
+        n_out++;
+        pos += down;
+    }
+    resampler->pos = pos - end;
+
+    // Keep the last RESAMPLE_TAPS - 1 input frames for the next block.
+    for (int c = 0; c < channels; c++) {
+        for (int k = 0; k < RESAMPLE_TAPS - 1; k++) {
+            const int32_t idx = (int32_t) in_frames - (RESAMPLE_TAPS - 1) + k;
+            resampler->history[c][k] = _input(resampler, in, c, idx);
+        }
+    }
+    return n_out;
+}
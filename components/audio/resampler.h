@@ -0,0 +1,45 @@
+#ifndef _RESAMPLER_H
+#define _RESAMPLER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESAMPLE_TAPS           8     // filter taps per phase
+#define RESAMPLE_MAX_PHASES     441   // enough for 8/16/32 kHz -> 44.1 kHz
+#define RESAMPLE_MAX_CHANNELS   2
+
+/**
+ * Fixed-point polyphase resampler converting in_rate to out_rate by the
+ * rational factor up / down. The Q14 filter bank is a windowed sinc
+ * designed once per stream, every output sample costs RESAMPLE_TAPS
+ * multiply-accumulates per channel.
+ */
+struct resampler_t {
+    uint32_t up;
+    uint32_t down;
+    int channels;
+    uint32_t pos;  // next output position in 1/up input frames from the start of the block
+    int16_t history[RESAMPLE_MAX_CHANNELS][RESAMPLE_TAPS - 1];
+    int16_t coeffs[RESAMPLE_MAX_PHASES][RESAMPLE_TAPS];
+};
+
+/**
+ * @return false if the ratio needs more than RESAMPLE_MAX_PHASES phases.
+ */
+bool resampler_init(struct resampler_t *resampler, uint32_t in_rate, uint32_t out_rate, int channels);
+
+/**
+ * Upper bound of output frames produced from in_frames input frames.
+ */
+size_t resampler_max_output(const struct resampler_t *resampler, size_t in_frames);
+
+/**
+ * Resample interleaved frames from in to out. out must hold
+ * resampler_max_output(in_frames) frames.
+ *
+ * @return number of output frames.
+ */
+size_t resampler_process(struct resampler_t *resampler, const int16_t *in, size_t in_frames, int16_t *out);
+
+#endif // _RESAMPLER_H
@@ -0,0 +1,90 @@
+#include "ring_buffer.h"
+
+#include <string.h>
+
+static uint32_t _load(const uint32_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+}
+
+static void _store(uint32_t *counter, uint32_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELEASE);
+}
+
+void rb_init(struct ring_buffer_t *rb, uint8_t *storage, uint32_t capacity, uint32_t guard) {
+    rb->data = storage;
+    rb->capacity = capacity;
+    rb->guard = guard;
+    rb_reset(rb);
+}
+
+void rb_reset(struct ring_buffer_t *rb) {
+    _store(&rb->head, 0);
+    _store(&rb->tail, 0);
+    __atomic_store_n(&rb->eof, false, __ATOMIC_RELEASE);
+    rb->min_fill = rb->capacity;
+    rb->underruns = 0;
+    rb->starved = true;
+}
+
+uint32_t rb_write_window(struct ring_buffer_t *rb, uint8_t **window) {
+    const uint32_t head = rb->head;
+    const uint32_t used = head - _load(&rb->tail);
+    const uint32_t idx = head & (rb->capacity - 1);
+    const uint32_t to_end = rb->capacity - idx;
+    const uint32_t free_bytes = rb->capacity - used;
+
+    *window = rb->data + idx;
+    return (free_bytes < to_end) ? free_bytes : to_end;
+}
+
+void rb_commit(struct ring_buffer_t *rb, uint32_t n_bytes) {
+    _store(&rb->head, rb->head + n_bytes);
+}
+
+void rb_set_eof(struct ring_buffer_t *rb) {
+    __atomic_store_n(&rb->eof, true, __ATOMIC_RELEASE);
+}
+
+uint32_t rb_fill_level(const struct ring_buffer_t *rb) {
+    return _load(&rb->head) - _load(&rb->tail);
+}
+
+bool rb_is_eof(const struct ring_buffer_t *rb) {
+    return __atomic_load_n(&rb->eof, __ATOMIC_ACQUIRE);
+}
+
+uint32_t rb_read_window(struct ring_buffer_t *rb, uint8_t **window, uint32_t wanted) {
+    // Read eof before head so a final commit is never missed.
+    const bool eof = rb_is_eof(rb);
+    const uint32_t tail = rb->tail;
+    const uint32_t readable = _load(&rb->head) - tail;
+    const uint32_t idx = tail & (rb->capacity - 1);
+    const uint32_t to_end = rb->capacity - idx;
+
+    if (readable < rb->min_fill) {
+        rb->min_fill = readable;
+    }
+    const bool starved = readable < wanted && !eof;
+    if (starved && !rb->starved) {
+        rb->underruns++;
+    }
+    rb->starved = starved;
+
+    *window = rb->data + idx;
+    if (readable <= to_end || wanted <= to_end) {
+        return (readable < to_end) ? readable : to_end;
+    }
+
+    // Data wraps and the consumer needs more than the tail end of the
+    // storage. Mirror the wrapped part into the guard region.
+    uint32_t mirrored = ((readable < wanted) ? readable : wanted) - to_end;
+    if (mirrored > rb->guard) {
+        mirrored = rb->guard;
+    }
+    memcpy(rb->data + rb->capacity, rb->data, mirrored);
+    return to_end + mirrored;
+}
+
+void rb_consume(struct ring_buffer_t *rb, uint32_t n_bytes) {
+    _store(&rb->tail, rb->tail + n_bytes);
+}
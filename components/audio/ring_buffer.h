@@ -0,0 +1,74 @@
+#ifndef _RING_BUFFER_H
+#define _RING_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Single-producer/single-consumer byte ring buffer.
+ *
+ * Only the producer moves `head` and only the consumer moves `tail`, so one
+ * writer task and one reader task can share it without a lock. Both are
+ * free running byte counters, the capacity must be a power of two.
+ *
+ * The storage is followed by `guard` spare bytes. When readable data wraps
+ * around the end of the storage the consumer copies the start of it into the
+ * guard region, so it always sees up to `guard` contiguous bytes (one whole
+ * mp3 frame) without moving the rest of the buffer.
+ */
+struct ring_buffer_t {
+    uint8_t *data;      // capacity + guard bytes
+    uint32_t capacity;
+    uint32_t guard;
+    uint32_t head;      // total bytes committed by the producer
+    uint32_t tail;      // total bytes consumed by the consumer
+    bool eof;           // producer will not commit any more data
+
+    // Fill level counters, reset with the buffer.
+    uint32_t min_fill;
+    uint32_t underruns;
+    bool starved;       // the consumer is waiting for data, not counted again
+};
+
+void rb_init(struct ring_buffer_t *rb, uint8_t *storage, uint32_t capacity, uint32_t guard);
+
+/**
+ * Empty the buffer and clear its counters. Neither side may be using it.
+ */
+void rb_reset(struct ring_buffer_t *rb);
+
+/* Producer side */
+
+/**
+ * @param uint8_t **window set to the first free byte.
+ * @return number of contiguous free bytes at window.
+ */
+uint32_t rb_write_window(struct ring_buffer_t *rb, uint8_t **window);
+
+void rb_commit(struct ring_buffer_t *rb, uint32_t n_bytes);
+
+void rb_set_eof(struct ring_buffer_t *rb);
+
+/* Consumer side */
+
+uint32_t rb_fill_level(const struct ring_buffer_t *rb);
+
+bool rb_is_eof(const struct ring_buffer_t *rb);
+
+/**
+ * Get a contiguous view of up to `wanted` readable bytes (at most `guard`
+ * bytes beyond the end of the storage). Counts an underrun when fewer than
+ * `wanted` bytes become readable while the producer has not finished.
+ * Calls that keep finding too little count once, and the wait for the
+ * first data after a reset does not count.
+ *
+ * @param uint8_t **window set to the first readable byte.
+ * @param uint32_t wanted number of contiguous bytes the consumer needs.
+ * @return number of contiguous bytes readable at window.
+ */
+uint32_t rb_read_window(struct ring_buffer_t *rb, uint8_t **window, uint32_t wanted);
+
+void rb_consume(struct ring_buffer_t *rb, uint32_t n_bytes);
+
+#endif // _RING_BUFFER_H
@@ -0,0 +1,148 @@
+#include "tone.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+#define TABLE_BITS              8
+#define TABLE_SIZE              (1 << TABLE_BITS)
+#define FRAC_BITS               16  // interpolation bits below the table index
+#define PHASE_SHIFT             (32 - TABLE_BITS)
+
+// One extra entry so interpolation never wraps.
+static int16_t SINE_TABLE[TABLE_SIZE + 1];
+static bool TABLE_READY = false;
+
+static const struct tone_step_t BEEP_CADENCE_STEPS[] = {
+    {.start_hz = 880, .end_hz = 880, .duration_ms = 150, .amplitude = TONE_DEFAULT_AMPLITUDE},
+    {.start_hz = 0,   .end_hz = 0,   .duration_ms = 100, .amplitude = 0},
+    {.start_hz = 880, .end_hz = 880, .duration_ms = 150, .amplitude = TONE_DEFAULT_AMPLITUDE},
+    {.start_hz = 0,   .end_hz = 0,   .duration_ms = 600, .amplitude = 0},
+};
+
+static const struct tone_step_t SIREN_SWEEP_STEPS[] = {
+    {.start_hz = 600,  .end_hz = 1200, .duration_ms = 500, .amplitude = TONE_DEFAULT_AMPLITUDE},
+    {.start_hz = 1200, .end_hz = 600,  .duration_ms = 500, .amplitude = TONE_DEFAULT_AMPLITUDE},
+};
+
+const struct tone_pattern_t TONE_BEEP_CADENCE = {
+    .steps = BEEP_CADENCE_STEPS,
+    .n_steps = sizeof(BEEP_CADENCE_STEPS) / sizeof(BEEP_CADENCE_STEPS[0])
+};
+
+const struct tone_pattern_t TONE_SIREN_SWEEP = {
+    .steps = SIREN_SWEEP_STEPS,
+    .n_steps = sizeof(SIREN_SWEEP_STEPS) / sizeof(SIREN_SWEEP_STEPS[0])
+};
+
+void tone_init(void) {
+    if (TABLE_READY) {
+        return;
+    }
+    for (int i = 0; i <= TABLE_SIZE; i++) {
+        SINE_TABLE[i] = (int16_t) lrintf(sinf(2.0f * (float) M_PI * (float) i / TABLE_SIZE) * 32767.0f);
+    }
+    TABLE_READY = true;
+}
+
+uint32_t tone_phase_inc(uint32_t freq, uint32_t sample_rate) {
+    return (uint32_t) (((uint64_t) freq << 32) / sample_rate);
+}
+
+static uint32_t _gcd(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+uint32_t tone_period_frames(uint32_t freq, uint32_t sample_rate, uint32_t *periods) {
+    const uint32_t divisor = _gcd(sample_rate, freq);
+    *periods = freq / divisor;
+    return sample_rate / divisor;
+}
+
+static inline int16_t _sample(uint32_t phase) {
+    const uint32_t idx = phase >> PHASE_SHIFT;
+    const int32_t frac = (phase >> (PHASE_SHIFT - FRAC_BITS)) & ((1 << FRAC_BITS) - 1);
+    const int32_t a = SINE_TABLE[idx];
+    const int32_t b = SINE_TABLE[idx + 1];
+    return (int16_t) (a + (((b - a) * frac) >> FRAC_BITS));
+}
+
+void tone_render_periodic(int16_t *out, uint32_t n_frames, uint32_t periods, uint16_t amplitude) {
+    tone_init();
+    for (uint32_t i = 0; i < n_frames; i++) {
+        // Exact phase for every frame so the last frame leads into the first.
+        const uint32_t phase = (uint32_t) ((((uint64_t) i * periods) << 32) / n_frames);
+        const int16_t s = (int16_t) ((_sample(phase) * (int32_t) amplitude) >> 15);
+        out[2 * i] = s;
+        out[2 * i + 1] = s;
+    }
+}
+
+static void _enter_step(struct tone_t *tone, uint16_t step_idx) {
+    const struct tone_step_t *step = &tone->pattern->steps[step_idx];
+    const uint32_t start_inc = tone_phase_inc(step->start_hz, tone->sample_rate);
+    const uint32_t end_inc = tone_phase_inc(step->end_hz, tone->sample_rate);
+
+    tone->step_idx = step_idx;
+    tone->amplitude = step->amplitude;
+    tone->phase_inc = start_inc;
+    tone->step_remaining = (uint32_t) ((uint64_t) step->duration_ms * tone->sample_rate / 1000);
+    tone->phase_inc_delta = 0;
+    if (tone->step_remaining > 0) {
+        tone->phase_inc_delta = ((int32_t) end_inc - (int32_t) start_inc) / (int32_t) tone->step_remaining;
+    }
+}
+
+void tone_start(struct tone_t *tone, const struct tone_pattern_t *pattern, uint32_t sample_rate) {
+    tone_init();
+    tone->pattern = pattern;
+    tone->sample_rate = sample_rate;
+    tone->phase = 0;
+    _enter_step(tone, 0);
+}
+
+void tone_render(struct tone_t *tone, int16_t *out, size_t n_frames) {
+    uint32_t phase = tone->phase;
+    uint32_t phase_inc = tone->phase_inc;
+
+    size_t i = 0;
+    while (i < n_frames) {
+        // Render up to the end of the current step in one tight loop.
+        size_t run = n_frames - i;
+        if (tone->step_remaining != 0 && tone->step_remaining < run) {
+            run = tone->step_remaining;
+        }
+
+        const int32_t amplitude = tone->amplitude;
+        const int32_t delta = tone->phase_inc_delta;
+        if (amplitude == 0) {
+            for (size_t j = 0; j < run; j++) {
+                out[2 * (i + j)] = 0;
+                out[2 * (i + j) + 1] = 0;
+            }
+        } else {
+            for (size_t j = 0; j < run; j++) {
+                const int16_t s = (int16_t) ((_sample(phase) * amplitude) >> 15);
+                out[2 * (i + j)] = s;
+                out[2 * (i + j) + 1] = s;
+                phase += phase_inc;
+                phase_inc += delta;
+            }
+        }
+        i += run;
+
+        if (tone->step_remaining != 0) {
+            tone->step_remaining -= run;
+            if (tone->step_remaining == 0) {
+                _enter_step(tone, (tone->step_idx + 1) % tone->pattern->n_steps);
+                phase_inc = tone->phase_inc;
+            }
+        }
+    }
+    tone->phase = phase;
+    tone->phase_inc = phase_inc;
+}
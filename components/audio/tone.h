@@ -0,0 +1,77 @@
+#ifndef _TONE_H
+#define _TONE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TONE_DEFAULT_AMPLITUDE  0x00ff  // Q15
+
+/**
+ * One step of an alarm pattern. A step sweeps linearly from start_hz to
+ * end_hz over duration_ms, set both to the same value for a steady tone.
+ * An amplitude of 0 is a silent gap, a duration of 0 never ends.
+ */
+struct tone_step_t {
+    uint16_t start_hz;
+    uint16_t end_hz;
+    uint16_t duration_ms;
+    uint16_t amplitude;    // Q15
+};
+
+/**
+ * Pattern of steps played in order and repeated until stopped.
+ */
+struct tone_pattern_t {
+    const struct tone_step_t *steps;
+    uint16_t n_steps;
+};
+
+/**
+ * Direct digital synthesis oscillator. A 32 bit phase accumulator indexes a
+ * Q15 sine table, the top bits select the entry and the next bits
+ * interpolate between neighbouring entries.
+ */
+struct tone_t {
+    const struct tone_pattern_t *pattern;
+    uint32_t sample_rate;
+    uint32_t phase;
+    uint32_t phase_inc;
+    int32_t phase_inc_delta;  // per sample change of phase_inc while sweeping
+    uint16_t amplitude;
+    uint16_t step_idx;
+    uint32_t step_remaining;  // samples left in the current step, 0 if endless
+};
+
+extern const struct tone_pattern_t TONE_BEEP_CADENCE;
+extern const struct tone_pattern_t TONE_SIREN_SWEEP;
+
+/**
+ * Build the sine table. Called once before rendering.
+ */
+void tone_init(void);
+
+/**
+ * Convert a frequency in Hz to a phase increment at sample_rate.
+ */
+uint32_t tone_phase_inc(uint32_t freq, uint32_t sample_rate);
+
+/**
+ * Smallest number of frames at sample_rate holding a whole number of
+ * periods of freq. Stores the number of periods in *periods.
+ */
+uint32_t tone_period_frames(uint32_t freq, uint32_t sample_rate, uint32_t *periods);
+
+/**
+ * Render n_frames interleaved stereo frames holding exactly `periods`
+ * periods, so the buffer can be played back to back without a seam.
+ */
+void tone_render_periodic(int16_t *out, uint32_t n_frames, uint32_t periods, uint16_t amplitude);
+
+void tone_start(struct tone_t *tone, const struct tone_pattern_t *pattern, uint32_t sample_rate);
+
+/**
+ * Render n_frames interleaved stereo frames.
+ */
+void tone_render(struct tone_t *tone, int16_t *out, size_t n_frames);
+
+#endif // _TONE_H
@@ -0,0 +1,238 @@
+#include "event_log.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "storage.h"
+
+#define RING_RECORDS            CONFIG_EVLOG_RING_RECORDS
+#define MAX_FILE_BYTES          (CONFIG_EVLOG_MAX_FILE_KB * 1024)
+#define FLUSH_INTERVAL_MS       (CONFIG_EVLOG_FLUSH_INTERVAL_S * 1000)
+#define RECORDS_PER_SECTOR      (EVLOG_SECTOR_SIZE / EVLOG_RECORD_SIZE)
+#define PATH_LEN                64
+#define WRITER_STACK            3072
+#define WRITER_PRIORITY         2     // below every audio and input task
+
+#define WRITER_SECTOR           (1 << 0)  // a whole sector is pending
+#define WRITER_FLUSH            (1 << 1)  // write everything, then give FLUSHED
+
+_Static_assert(sizeof(struct evlog_record_t) == EVLOG_RECORD_SIZE, "record layout");
+
+static const char *EVLOG_TAG = "Event Log";
+
+/**
+ * Records not yet written. Kept in RTC memory, so events queued while
+ * the card is unmounted survive deep sleep. head and tail are free
+ * running counts, producers only move head and the writer only tail.
+ */
+struct evlog_ring_t {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+    uint16_t boot;
+    uint16_t seq;
+    struct evlog_record_t records[RING_RECORDS];
+};
+
+RTC_DATA_ATTR static struct evlog_ring_t RING;
+
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+static bool BOOT_COUNTED = false;
+static TaskHandle_t WRITER = NULL;
+static SemaphoreHandle_t FLUSHED = NULL;
+static char PATH[PATH_LEN];
+static char OLD_PATH[PATH_LEN];
+
+// Last sector of the file as written, rewritten in place until it is full.
+static DMA_ATTR struct evlog_record_t SECTOR[RECORDS_PER_SECTOR];
+static uint32_t SECTOR_FILL = 0;
+
+static void _seal(struct evlog_record_t *record) {
+    record->crc = esp_rom_crc16_le(0, (const uint8_t *) record, offsetof(struct evlog_record_t, crc));
+}
+
+void evlog_add(uint8_t type, uint8_t arg, uint32_t value) {
+    struct evlog_record_t record = {
+        .time_ms = (uint32_t) (esp_timer_get_time() / 1000),
+        .type = type,
+        .arg = arg,
+        .value = value,
+    };
+    uint32_t pending = 0;
+    portENTER_CRITICAL(&LOCK);
+    if (!BOOT_COUNTED) {
+        BOOT_COUNTED = true;
+        RING.boot++;
+        RING.seq = 0;
+    }
+    if (RING.head - RING.tail >= RING_RECORDS) {
+        RING.dropped++;
+    } else {
+        record.boot = RING.boot;
+        record.seq = RING.seq++;
+        _seal(&record);
+        RING.records[RING.head % RING_RECORDS] = record;
+        RING.head++;
+    }
+    pending = RING.head - RING.tail;
+    portEXIT_CRITICAL(&LOCK);
+
+    if (WRITER && pending + SECTOR_FILL >= RECORDS_PER_SECTOR) {
+        xTaskNotify(WRITER, WRITER_SECTOR, eSetBits);
+    }
+}
+
+static void _rotate() {
+    struct stat st;
+    if (storage_stat(PATH, &st) != 0 || st.st_size < MAX_FILE_BYTES) {
+        return;
+    }
+    // FAT rename does not replace an existing file.
+    storage_unlink(OLD_PATH);
+    if (storage_rename(PATH, OLD_PATH) != 0) {
+        ESP_LOGW(EVLOG_TAG, "Failed to rotate %s.", PATH);
+        return;
+    }
+    SECTOR_FILL = 0;
+}
+
+/**
+ * Move records from RING into SECTOR, after a dropped count if there is
+ * one. Records stay in RING until _commit.
+ *
+ * @return number of ring records taken.
+ */
+static uint32_t _fill_sector(uint32_t *n_dropped) {
+    portENTER_CRITICAL(&LOCK);
+    uint32_t pending = RING.head - RING.tail;
+    *n_dropped = RING.dropped;
+    uint16_t boot = RING.boot;
+    portEXIT_CRITICAL(&LOCK);
+
+    uint32_t fill = SECTOR_FILL;
+    if (*n_dropped) {
+        struct evlog_record_t *record = &SECTOR[fill++];
+        *record = (struct evlog_record_t) {
+            .time_ms = (uint32_t) (esp_timer_get_time() / 1000),
+            .boot = boot,
+            .type = EVLOG_DROPPED,
+            .value = *n_dropped,
+            .seq = UINT16_MAX,
+        };
+        _seal(record);
+    }
+    uint32_t n = RECORDS_PER_SECTOR - fill;
+    if (n > pending) {
+        n = pending;
+    }
+    // Producers never touch records between tail and head.
+    for (uint32_t i = 0; i < n; i++) {
+        SECTOR[fill + i] = RING.records[(RING.tail + i) % RING_RECORDS];
+    }
+    memset(&SECTOR[fill + n], EVLOG_PAD, (RECORDS_PER_SECTOR - fill - n) * EVLOG_RECORD_SIZE);
+    return n;
+}
+
+static void _commit(uint32_t n, uint32_t n_dropped) {
+    portENTER_CRITICAL(&LOCK);
+    RING.tail += n;
+    RING.dropped -= n_dropped;
+    portEXIT_CRITICAL(&LOCK);
+    SECTOR_FILL = (SECTOR_FILL + n + (n_dropped ? 1 : 0)) % RECORDS_PER_SECTOR;
+}
+
+/**
+ * Write whole sectors while there are enough records for one, and with
+ * force the rest as a padded sector. A partial sector is rewritten in
+ * place by the next write, so padding only costs space until then.
+ */
+static void _write(bool force) {
+    _rotate();
+    FILE *file = storage_fopen(PATH, "r+");
+    if (!file) {
+        file = storage_fopen(PATH, "w");
+    }
+    if (!file) {
+        // No card yet, the records wait in RING.
+        return;
+    }
+    setvbuf(file, NULL, _IONBF, 0);
+    while (1) {
+        portENTER_CRITICAL(&LOCK);
+        uint32_t pending = RING.head - RING.tail + (RING.dropped ? 1 : 0);
+        portEXIT_CRITICAL(&LOCK);
+        if (pending == 0 || (!force && SECTOR_FILL + pending < RECORDS_PER_SECTOR)) {
+            break;
+        }
+        uint32_t n_dropped = 0;
+        uint32_t n = _fill_sector(&n_dropped);
+        bool ok = fseek(file, SECTOR_FILL ? -EVLOG_SECTOR_SIZE : 0, SEEK_END) == 0 &&
+            fwrite(SECTOR, EVLOG_SECTOR_SIZE, 1, file) == 1;
+        if (!ok) {
+            ESP_LOGW(EVLOG_TAG, "Failed to write %s.", PATH);
+            break;
+        }
+        _commit(n, n_dropped);
+    }
+    fclose(file);
+}
+
+static void _writer(void *unused) {
+    while (1) {
+        uint32_t bits = 0;
+        BaseType_t notified = xTaskNotifyWait(0, WRITER_SECTOR | WRITER_FLUSH, &bits,
+                                              pdMS_TO_TICKS(FLUSH_INTERVAL_MS));
+        // A timeout flushes the partial sector, so a power loss loses at
+        // most one interval of events.
+        _write(notified != pdTRUE || (bits & WRITER_FLUSH));
+        if (bits & WRITER_FLUSH) {
+            xSemaphoreGive(FLUSHED);
+        }
+    }
+}
+
+static bool _old_path(const char *path, char *out, size_t size) {
+    const char *dot = strrchr(path, '.');
+    const size_t stem_len = dot && !strchr(dot, '/') ? (size_t) (dot - path) : strlen(path);
+    int n = snprintf(out, size, "%.*s." EVLOG_OLD_EXT, (int) stem_len, path);
+    return n >= 0 && (size_t) n < size;
+}
+
+esp_err_t evlog_init(const char *path) {
+    if (WRITER) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    int n = snprintf(PATH, sizeof(PATH), "%s", path);
+    if (n < 0 || (size_t) n >= sizeof(PATH) || !_old_path(path, OLD_PATH, sizeof(OLD_PATH))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    FLUSHED = xSemaphoreCreateBinary();
+    if (!FLUSHED) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(_writer, "Event log", WRITER_STACK, NULL, WRITER_PRIORITY, &WRITER) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t evlog_flush(uint32_t timeout_ms) {
+    if (!WRITER) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(FLUSHED, 0);
+    xTaskNotify(WRITER, WRITER_FLUSH, eSetBits);
+    return xSemaphoreTake(FLUSHED, pdMS_TO_TICKS(timeout_ms)) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
@@ -0,0 +1,64 @@
+#ifndef _EVENT_LOG_H
+#define _EVENT_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define EVLOG_SECTOR_SIZE       512
+#define EVLOG_RECORD_SIZE       16
+#define EVLOG_OLD_EXT           "old"   // rotated file, replaces the extension of the log path
+#define EVLOG_PAD               0xff    // type of the filler records that complete a sector
+#define EVLOG_LONG_PRESS        0x100   // set in the value of a power EVLOG_BUTTON woken by a long press
+
+/**
+ * Event types. Append new types at the end, tools/event_log.py decodes
+ * them by number.
+ */
+enum {
+    EVLOG_BOOT = 1,       // value: wakeup cause
+    EVLOG_BUTTON,         // arg: 0 power, 1 audio, value: action, for power 0 off or the presses that woke it
+    EVLOG_ALARM,          // value: 0 played from SD, 1 from the flash copy
+    EVLOG_BATTERY,        // arg: battery_level_t, value: filtered mV
+    EVLOG_DECODE_ERROR,   // arg: 1 while finding a frame, value: helix error code
+    EVLOG_DROPPED,        // value: records lost to a full ring
+    EVLOG_SD,             // arg: 1 mounted, 0 failed, value: esp_err_t
+};
+
+/**
+ * One record as stored, little endian. crc is the CRC16 of the bytes
+ * before it. boot counts boots since power on, time_ms is since boot.
+ */
+struct evlog_record_t {
+    uint32_t time_ms;
+    uint16_t boot;
+    uint8_t type;
+    uint8_t arg;
+    uint32_t value;
+    uint16_t seq;
+    uint16_t crc;
+};
+
+/**
+ * Start the writer task appending to path, e.g. "/sd/events.log". Events
+ * may be added before this and while the file system is unavailable, they
+ * wait in RAM that survives deep sleep.
+ */
+esp_err_t evlog_init(const char *path);
+
+/**
+ * Queue an event. Never blocks and may be called from any task, the event
+ * is dropped if the ring is full.
+ */
+void evlog_add(uint8_t type, uint8_t arg, uint32_t value);
+
+/**
+ * Write everything queued, padding the last sector, and wait for the
+ * writer. Call before deep sleep or unmounting the card.
+ *
+ * @return ESP_ERR_TIMEOUT if the writer did not finish in time.
+ */
+esp_err_t evlog_flush(uint32_t timeout_ms);
+
+#endif // _EVENT_LOG_H
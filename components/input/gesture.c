@@ -0,0 +1,84 @@
+#include "gesture.h"
+
+#include "sdkconfig.h"
+
+#define DEBOUNCE_US             ((int64_t) CONFIG_INPUT_DEBOUNCE_MS * 1000)
+#define DOUBLE_CLICK_US         ((int64_t) CONFIG_INPUT_DOUBLE_CLICK_MS * 1000)
+#define LONG_PRESS_US           ((int64_t) CONFIG_INPUT_LONG_PRESS_MS * 1000)
+
+static void _transition(struct gesture_t *gesture, bool pressed, int64_t time_us) {
+    gesture->pressed = pressed;
+    gesture->settle_us = time_us + DEBOUNCE_US;
+    if (pressed) {
+        // A pending click is decided by this press's release.
+        gesture->long_us = time_us + LONG_PRESS_US;
+        gesture->click_us = GESTURE_NO_DEADLINE;
+        return;
+    }
+    gesture->long_us = GESTURE_NO_DEADLINE;
+    if (gesture->stale || gesture->long_sent) {
+        gesture->stale = false;
+        gesture->long_sent = false;
+        return;
+    }
+    gesture->clicks++;
+    if (gesture->clicks == 2) {
+        gesture->clicks = 0;
+        gesture->emit(INPUT_DOUBLE_CLICK, time_us, gesture->arg);
+    } else if (gesture->double_click) {
+        gesture->click_us = time_us + DOUBLE_CLICK_US;
+    } else {
+        gesture->clicks = 0;
+        gesture->emit(INPUT_CLICK, time_us, gesture->arg);
+    }
+}
+
+void gesture_init(struct gesture_t *gesture, bool pressed, bool double_click, gesture_emit_t emit, void *arg) {
+    *gesture = (struct gesture_t) {
+        .pressed = pressed,
+        .stale = pressed,
+        .double_click = double_click,
+        .settle_us = GESTURE_NO_DEADLINE,
+        .long_us = GESTURE_NO_DEADLINE,
+        .click_us = GESTURE_NO_DEADLINE,
+        .emit = emit,
+        .arg = arg,
+    };
+}
+
+bool gesture_edge(struct gesture_t *gesture, bool pressed, int64_t time_us) {
+    const bool settling = gesture->settle_us != GESTURE_NO_DEADLINE && time_us < gesture->settle_us;
+    if (settling || pressed == gesture->pressed) {
+        return false;
+    }
+    _transition(gesture, pressed, time_us);
+    return true;
+}
+
+int64_t gesture_deadlines(struct gesture_t *gesture, bool pressed, int64_t now_us) {
+    if (now_us >= gesture->settle_us) {
+        // The last bounce may have moved the level without a later edge.
+        gesture->settle_us = GESTURE_NO_DEADLINE;
+        if (pressed != gesture->pressed) {
+            _transition(gesture, pressed, now_us);
+        }
+    }
+    if (now_us >= gesture->long_us) {
+        const int64_t deadline = gesture->long_us;
+        gesture->long_us = GESTURE_NO_DEADLINE;
+        gesture->long_sent = true;
+        if (gesture->clicks) {
+            gesture->clicks = 0;
+            gesture->emit(INPUT_CLICK, deadline, gesture->arg);
+        }
+        gesture->emit(INPUT_LONG_PRESS, deadline, gesture->arg);
+    }
+    if (now_us >= gesture->click_us) {
+        const int64_t deadline = gesture->click_us;
+        gesture->click_us = GESTURE_NO_DEADLINE;
+        gesture->clicks = 0;
+        gesture->emit(INPUT_CLICK, deadline, gesture->arg);
+    }
+    const int64_t next = gesture->settle_us < gesture->long_us ? gesture->settle_us : gesture->long_us;
+    return gesture->click_us < next ? gesture->click_us : next;
+}
@@ -0,0 +1,61 @@
+#ifndef _GESTURE_H
+#define _GESTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GESTURE_NO_DEADLINE     INT64_MAX
+
+enum input_gesture_t {
+    INPUT_CLICK = 0,
+    INPUT_DOUBLE_CLICK,
+    INPUT_LONG_PRESS,         // once held for CONFIG_INPUT_LONG_PRESS_MS, its release is no click
+};
+
+#define INPUT_GESTURE(g)        (1u << (g))
+
+/**
+ * Called for each gesture as it completes, time_us is the edge or the
+ * deadline that completed it.
+ */
+typedef void (*gesture_emit_t)(enum input_gesture_t gesture, int64_t time_us, void *arg);
+
+/**
+ * Debounced state and deadlines of one button. Knows nothing of pins or
+ * tasks, the input task feeds it edges and the time.
+ */
+struct gesture_t {
+    bool pressed;
+    bool stale;               // held since gesture_init
+    bool long_sent;
+    bool double_click;        // wait after a click for a second one
+    uint32_t clicks;          // released, awaiting a second click
+    int64_t settle_us;        // edges until then are bounces, the level is read again at it
+    int64_t long_us;
+    int64_t click_us;
+    gesture_emit_t emit;
+    void *arg;
+};
+
+/**
+ * A button held at this point is ignored until released.
+ */
+void gesture_init(struct gesture_t *gesture, bool pressed, bool double_click, gesture_emit_t emit, void *arg);
+
+/**
+ * An edge at time_us, pressed is the level read right after it.
+ *
+ * @return false if it was a bounce, while settling or not changing the
+ *         level.
+ */
+bool gesture_edge(struct gesture_t *gesture, bool pressed, int64_t time_us);
+
+/**
+ * Act on the deadlines that passed by now_us. pressed is the level at
+ * now_us, only looked at once settled.
+ *
+ * @return the next deadline, GESTURE_NO_DEADLINE if none.
+ */
+int64_t gesture_deadlines(struct gesture_t *gesture, bool pressed, int64_t now_us);
+
+#endif // _GESTURE_H
@@ -0,0 +1,236 @@
+#include "input.h"
+
+#include <stddef.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *INPUT_TAG = "Input";
+
+struct input_edge_t {
+    int64_t time_us;
+    uint8_t pin;              // index into PINS
+    uint8_t level;
+};
+
+/**
+ * The gesture state is only touched by the input task once started.
+ */
+struct input_pin_t {
+    gpio_num_t gpio;
+    bool active_high;
+    uint32_t gestures;        // subscribed on this pin
+    struct gesture_t gesture;
+};
+
+struct input_subscriber_t {
+    gpio_num_t pin;
+    uint32_t gestures;
+    input_handler_t handler;
+    void *arg;
+};
+
+static struct input_pin_t PINS[INPUT_MAX_PINS];
+static size_t N_PINS = 0;
+static struct input_subscriber_t SUBSCRIBERS[INPUT_MAX_SUBSCRIBERS];
+static size_t N_SUBSCRIBERS = 0;
+static QueueHandle_t EDGES = NULL;
+static TaskHandle_t TASK = NULL;
+static volatile uint32_t DROPPED = 0;
+
+// Written by the input task, guarded for readers.
+static struct input_stats_t STATS;
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Queue the edge with the level right after it. A glitch already over
+ * reads the level it started from and is dropped as a bounce, like the
+ * short pulls GPIO36 and GPIO39 see during ADC1 conversions.
+ */
+static void _on_edge(void *arg) {
+    const size_t i = (size_t) arg;
+    const struct input_edge_t edge = {
+        .time_us = esp_timer_get_time(),
+        .pin = (uint8_t) i,
+        .level = (uint8_t) gpio_get_level(PINS[i].gpio),
+    };
+    BaseType_t woken = pdFALSE;
+    if (xQueueSendFromISR(EDGES, &edge, &woken) != pdTRUE) {
+        DROPPED++;
+    }
+    if (woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+static bool _is_pressed(const struct input_pin_t *pin, int level) {
+    return (level != 0) == pin->active_high;
+}
+
+static void _record_latency(int64_t latency_us) {
+    const uint32_t us = latency_us > 0 ? (uint32_t) latency_us : 0;
+    size_t bucket = 0;
+    for (uint32_t limit = INPUT_LATENCY_MIN_US; us >= limit && bucket < INPUT_LATENCY_BUCKETS - 1; limit <<= 1) {
+        bucket++;
+    }
+    portENTER_CRITICAL(&LOCK);
+    STATS.latency[bucket]++;
+    if (us > STATS.max_latency_us) {
+        STATS.max_latency_us = us;
+    }
+    portEXIT_CRITICAL(&LOCK);
+}
+
+static void _dispatch(enum input_gesture_t gesture, int64_t time_us, void *arg) {
+    const struct input_pin_t *pin = arg;
+    const struct input_event_t event = {
+        .pin = pin->gpio,
+        .gesture = gesture,
+        .time_us = time_us,
+    };
+    for (size_t i = 0; i < N_SUBSCRIBERS; i++) {
+        const struct input_subscriber_t *subscriber = &SUBSCRIBERS[i];
+        if (subscriber->pin == pin->gpio && (subscriber->gestures & INPUT_GESTURE(gesture))) {
+            _record_latency(esp_timer_get_time() - time_us);
+            subscriber->handler(&event, subscriber->arg);
+        }
+    }
+}
+
+static void _on_queued_edge(const struct input_edge_t *edge) {
+    struct input_pin_t *pin = &PINS[edge->pin];
+    const bool bounce = !gesture_edge(&pin->gesture, _is_pressed(pin, edge->level), edge->time_us);
+    portENTER_CRITICAL(&LOCK);
+    STATS.edges++;
+    STATS.bounces += bounce;
+    portEXIT_CRITICAL(&LOCK);
+}
+
+static void _input_task(void *unused) {
+    int64_t next_us = GESTURE_NO_DEADLINE;
+    while (1) {
+        TickType_t wait = portMAX_DELAY;
+        if (next_us != GESTURE_NO_DEADLINE) {
+            const int64_t ms = (next_us - esp_timer_get_time() + 999) / 1000;
+            wait = ms > 0 ? pdMS_TO_TICKS(ms) + 1 : 0;
+        }
+        struct input_edge_t edge;
+        if (xQueueReceive(EDGES, &edge, wait) == pdTRUE) {
+            _on_queued_edge(&edge);
+        }
+        const int64_t now_us = esp_timer_get_time();
+        next_us = GESTURE_NO_DEADLINE;
+        for (size_t i = 0; i < N_PINS; i++) {
+            struct input_pin_t *pin = &PINS[i];
+            const int64_t deadline = gesture_deadlines(&pin->gesture, _is_pressed(pin, gpio_get_level(pin->gpio)),
+                                                       now_us);
+            next_us = deadline < next_us ? deadline : next_us;
+        }
+    }
+}
+
+static struct input_pin_t *_find_pin(gpio_num_t gpio) {
+    for (size_t i = 0; i < N_PINS; i++) {
+        if (PINS[i].gpio == gpio) {
+            return &PINS[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t input_add_pin(gpio_num_t pin, bool active_high) {
+    if (TASK || _find_pin(pin)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (N_PINS == INPUT_MAX_PINS) {
+        return ESP_ERR_NO_MEM;
+    }
+    PINS[N_PINS++] = (struct input_pin_t) {
+        .gpio = pin,
+        .active_high = active_high,
+    };
+    return ESP_OK;
+}
+
+esp_err_t input_subscribe(gpio_num_t pin, uint32_t gestures, input_handler_t handler, void *arg) {
+    struct input_pin_t *input = _find_pin(pin);
+    if (TASK || !input || !handler) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (N_SUBSCRIBERS == INPUT_MAX_SUBSCRIBERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    SUBSCRIBERS[N_SUBSCRIBERS++] = (struct input_subscriber_t) {
+        .pin = pin,
+        .gestures = gestures,
+        .handler = handler,
+        .arg = arg,
+    };
+    input->gestures |= gestures;
+    return ESP_OK;
+}
+
+esp_err_t input_start() {
+    if (TASK) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    EDGES = xQueueCreate(INPUT_QUEUE_LEN, sizeof(struct input_edge_t));
+    if (!EDGES) {
+        return ESP_ERR_NO_MEM;
+    }
+    // Already installed by another driver is fine.
+    esp_err_t ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+        return ret;
+    }
+    for (size_t i = 0; i < N_PINS; i++) {
+        struct input_pin_t *pin = &PINS[i];
+        gesture_init(&pin->gesture, _is_pressed(pin, gpio_get_level(pin->gpio)),
+                     pin->gestures & INPUT_GESTURE(INPUT_DOUBLE_CLICK), _dispatch, pin);
+        ret = gpio_set_intr_type(pin->gpio, GPIO_INTR_ANYEDGE);
+        if (ret == ESP_OK) {
+            ret = gpio_isr_handler_add(pin->gpio, _on_edge, (void *) i);
+        }
+        if (ret != ESP_OK) {
+            ESP_LOGE(INPUT_TAG, "Failed to watch GPIO %d (%s).", pin->gpio, esp_err_to_name(ret));
+            return ret;
+        }
+    }
+    if (xTaskCreate(_input_task, "input", INPUT_TASK_STACK, NULL, INPUT_TASK_PRIORITY, &TASK) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void input_get_stats(struct input_stats_t *stats) {
+    portENTER_CRITICAL(&LOCK);
+    *stats = STATS;
+    portEXIT_CRITICAL(&LOCK);
+    stats->dropped = DROPPED;
+}
+
+void input_log_stats() {
+    if (!TASK) {
+        return;
+    }
+    struct input_stats_t stats;
+    input_get_stats(&stats);
+    ESP_LOGI(INPUT_TAG, "%u edges, %u bounces, %u dropped, handler latency up to %u us.",
+             (unsigned) stats.edges, (unsigned) stats.bounces, (unsigned) stats.dropped,
+             (unsigned) stats.max_latency_us);
+    uint32_t limit = INPUT_LATENCY_MIN_US;
+    for (size_t i = 0; i < INPUT_LATENCY_BUCKETS; i++, limit <<= 1) {
+        if (stats.latency[i] == 0) {
+            continue;
+        }
+        if (i == INPUT_LATENCY_BUCKETS - 1) {
+            ESP_LOGI(INPUT_TAG, "  >= %6u us: %u", (unsigned) (limit >> 1), (unsigned) stats.latency[i]);
+        } else {
+            ESP_LOGI(INPUT_TAG, "  <  %6u us: %u", (unsigned) limit, (unsigned) stats.latency[i]);
+        }
+    }
+}
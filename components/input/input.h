@@ -0,0 +1,64 @@
+#ifndef _INPUT_H
+#define _INPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/gpio.h"
+#include "esp_err.h"
+
+#include "gesture.h"
+
+#define INPUT_MAX_PINS          4
+#define INPUT_MAX_SUBSCRIBERS   8
+#define INPUT_QUEUE_LEN         16    // edges between the isr and the input task
+#define INPUT_TASK_STACK        4096  // handlers run on it
+#define INPUT_TASK_PRIORITY     20
+#define INPUT_LATENCY_BUCKETS   10
+#define INPUT_LATENCY_MIN_US    128   // upper bound of the first bucket, each next one doubles
+
+struct input_event_t {
+    gpio_num_t pin;
+    enum input_gesture_t gesture;
+    int64_t time_us;          // when the gesture was complete, the edge or the deadline
+};
+
+/**
+ * Called on the input task. Further gestures wait while it runs, hand
+ * long work to another task.
+ */
+typedef void (*input_handler_t)(const struct input_event_t *event, void *arg);
+
+/**
+ * Latency is from time_us to the call of each handler.
+ */
+struct input_stats_t {
+    uint32_t latency[INPUT_LATENCY_BUCKETS];  // calls per bucket, the last one is open ended
+    uint32_t max_latency_us;
+    uint32_t edges;
+    uint32_t bounces;         // edges while settling or not changing the level
+    uint32_t dropped;         // edges lost to a full queue
+};
+
+/**
+ * Watch pin, configured as an input beforehand. Before input_start.
+ */
+esp_err_t input_add_pin(gpio_num_t pin, bool active_high);
+
+/**
+ * Call handler for the gestures, a mask of INPUT_GESTURE bits, on pin.
+ * Before input_start.
+ */
+esp_err_t input_subscribe(gpio_num_t pin, uint32_t gestures, input_handler_t handler, void *arg);
+
+/**
+ * Enable the edge interrupts and start the input task. A button already
+ * held is ignored until released, e.g. the press that woke the chip.
+ */
+esp_err_t input_start();
+
+void input_get_stats(struct input_stats_t *stats);
+
+void input_log_stats();
+
+#endif // _INPUT_H
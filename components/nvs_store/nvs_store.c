@@ -0,0 +1,48 @@
+#include "nvs_store.h"
+
+#include "esp_log.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+static const char *STORE_TAG = "NVS Store";
+
+esp_err_t nvs_store_init(void) {
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(STORE_TAG, "NVS partition needs to be erased.");
+        ret = nvs_flash_erase();
+        if (ret == ESP_OK) {
+            ret = nvs_flash_init();
+        }
+    }
+    return ret;
+}
+
+esp_err_t nvs_store_read(const char *name_space, const char *key, void *blob, size_t size) {
+    nvs_handle_t handle;
+    esp_err_t ret = nvs_open(name_space, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    size_t stored = size;
+    ret = nvs_get_blob(handle, key, blob, &stored);
+    nvs_close(handle);
+    if (ret == ESP_OK && stored != size) {
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+    return ret;
+}
+
+esp_err_t nvs_store_write(const char *name_space, const char *key, const void *blob, size_t size) {
+    nvs_handle_t handle;
+    esp_err_t ret = nvs_open(name_space, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_blob(handle, key, blob, size);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return ret;
+}
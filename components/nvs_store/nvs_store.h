@@ -0,0 +1,31 @@
+#ifndef _NVS_STORE_H
+#define _NVS_STORE_H
+
+#include <stddef.h>
+
+#include "esp_err.h"
+
+/**
+ * Initialise the default NVS partition. A partition that is full or was
+ * written by a newer NVS version is erased and initialised again, its
+ * contents are caches that are rebuilt. Call once before any other user
+ * of NVS starts, NVS sets up its lock on the first call and concurrent
+ * first calls race.
+ */
+esp_err_t nvs_store_init(void);
+
+/**
+ * Read the blob at name_space/key into blob. After nvs_store_init.
+ *
+ * @return ESP_ERR_NVS_NOT_FOUND if there is none, ESP_ERR_INVALID_SIZE if
+ *         the stored blob is not size bytes long.
+ */
+esp_err_t nvs_store_read(const char *name_space, const char *key, void *blob, size_t size);
+
+/**
+ * Write and commit size bytes of blob at name_space/key. After
+ * nvs_store_init.
+ */
+esp_err_t nvs_store_write(const char *name_space, const char *key, const void *blob, size_t size);
+
+#endif // _NVS_STORE_H
@@ -0,0 +1,103 @@
+#ifndef _STORAGE_H
+#define _STORAGE_H
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "esp_err.h"
+
+#define MOUNT_POINT            "/sd"
+
+#define CONFIG_FILE            "/config.txt"
+
+// FAT cluster size used when formatting, also the SPI bus transfer limit.
+#define ALLOCATION_UNIT_SIZE    (16 * 1024)
+
+// storage_benchmark reads this much of the file per setting.
+#define STORAGE_BENCH_BYTES     (512 * 1024)
+#define STORAGE_BENCH_CHUNK     4096    // matches the audio reader
+
+// SPI pins for SD card
+#define PIN_NUM_MISO            19    // Master In Slave Out
+#define PIN_NUM_MOSI            15    // Master Out Slave In
+#define PIN_NUM_CLK             14    // Clock
+#define PIN_NUM_CS              13    // Child Select
+
+#define SPI_DMA_CHAN            host->slot
+
+/**
+ * Mount the SD card, does nothing if it is already mounted.
+ */
+esp_err_t set_up_storage();
+
+bool storage_is_mounted();
+
+/**
+ * Log the sequential read speed of path in KB/s for every SPI clock from
+ * the mounted one down, each through several stdio buffer sizes.
+ */
+void storage_benchmark(const char *path);
+
+void shut_down_storage();
+
+/**
+ * File access below MOUNT_POINT. Same contract as the stdio and POSIX
+ * calls they replace, the backend decides where the path really lives.
+ * Everything that touches the card goes through these, so it also runs
+ * against the host backend. As on FAT, storage_rename fails with EEXIST
+ * rather than replace an existing file, on every backend.
+ */
+FILE *storage_fopen(const char *path, const char *mode);
+int storage_stat(const char *path, struct stat *st);
+int storage_unlink(const char *path);
+int storage_rename(const char *from, const char *to);
+
+/**
+ * Flush file and commit it to the card.
+ */
+int storage_fsync(FILE *file);
+
+/**
+ * Open a directory for readdir and closedir.
+ */
+DIR *storage_opendir(const char *path);
+
+/**
+ * Read up to STORAGE_BENCH_BYTES of path in STORAGE_BENCH_CHUNK sized
+ * freads through a buffer of buffer_size bytes.
+ *
+ * @return KB/s, 0 if the file could not be read.
+ */
+uint32_t storage_read_speed(const char *path, size_t buffer_size);
+
+#ifdef STORAGE_POSIX    // defined by host builds
+/**
+ * SD timing imposed by the host backend, zero disables a limit. Reads and
+ * writes reach it in the chunks stdio buffers them in, like on the card.
+ */
+struct storage_limits_t {
+    uint32_t open_us;         // per fopen, stat, unlink, rename and opendir
+    uint32_t access_us;       // per read or write
+    uint32_t bytes_per_s;     // per read or write, on top of access_us
+};
+
+/**
+ * Directory MOUNT_POINT maps to. Defaults to $STORAGE_ROOT, else ".".
+ */
+void storage_posix_set_root(const char *root);
+
+void storage_posix_set_limits(const struct storage_limits_t *limits);
+
+/**
+ * Simulate a power cut once units more are used: a write stops part way
+ * and later writes, unlinks and renames fail. Each byte written and each
+ * unlink or rename uses one unit. A negative budget restores the power.
+ */
+void storage_posix_set_power_budget(int64_t units);
+#endif
+
+#endif
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+#include "storage.h"
+
+uint32_t storage_read_speed(const char *path, size_t buffer_size) {
+    FILE *file = storage_fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    uint8_t *buffer = heap_caps_malloc(buffer_size, MALLOC_CAP_DMA);
+    uint8_t *chunk = heap_caps_malloc(STORAGE_BENCH_CHUNK, MALLOC_CAP_DMA);
+    if (!buffer || !chunk || setvbuf(file, (char *) buffer, _IOFBF, buffer_size) != 0) {
+        fclose(file);
+        free(buffer);
+        free(chunk);
+        return 0;
+    }
+    size_t total = 0;
+    int64_t start = esp_timer_get_time();
+    while (total < STORAGE_BENCH_BYTES) {
+        size_t n = fread(chunk, 1, STORAGE_BENCH_CHUNK, file);
+        total += n;
+        if (n != STORAGE_BENCH_CHUNK) {
+            break;
+        }
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    bool failed = ferror(file);
+    fclose(file);
+    free(buffer);
+    free(chunk);
+    if (failed || elapsed <= 0) {
+        return 0;
+    }
+    return (uint32_t) ((uint64_t) total * 1000000 / 1024 / elapsed);
+}
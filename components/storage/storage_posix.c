@@ -0,0 +1,240 @@
+/**
+ * Host backend: MOUNT_POINT is a local directory and files are plain
+ * stdio streams, optionally slowed down to SD card timing or cut off by
+ * a simulated power loss. Built only into host tools, see
+ * tools/storage_bench.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "storage.h"
+
+#define PATH_LEN                256
+
+static const char *SD_TAG = "SD Posix";
+
+static const char *ROOT = NULL;
+static struct storage_limits_t LIMITS = {0};
+static bool MOUNTED = false;
+static int64_t POWER_BUDGET = -1;
+
+static void _sleep_us(uint64_t us) {
+    if (us == 0) {
+        return;
+    }
+    struct timespec ts = {
+        .tv_sec = (time_t) (us / 1000000),
+        .tv_nsec = (long) (us % 1000000) * 1000,
+    };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+static void _access(size_t bytes) {
+    uint64_t us = LIMITS.access_us;
+    if (LIMITS.bytes_per_s) {
+        us += (uint64_t) bytes * 1000000 / LIMITS.bytes_per_s;
+    }
+    _sleep_us(us);
+}
+
+/**
+ * @return how many of units are done before the power is cut.
+ */
+static size_t _spend(size_t units) {
+    if (POWER_BUDGET < 0) {
+        return units;
+    }
+    if ((int64_t) units > POWER_BUDGET) {
+        units = (size_t) POWER_BUDGET;
+    }
+    POWER_BUDGET -= units;
+    return units;
+}
+
+static const char *_root() {
+    if (!ROOT) {
+        const char *env = getenv("STORAGE_ROOT");
+        ROOT = env && env[0] ? env : ".";
+    }
+    return ROOT;
+}
+
+/**
+ * Map a path below MOUNT_POINT into the root directory, other paths are
+ * used as they are.
+ */
+static const char *_map(const char *path, char *out, size_t size) {
+    const size_t mount_len = strlen(MOUNT_POINT);
+    if (strncmp(path, MOUNT_POINT, mount_len) != 0 || (path[mount_len] != '/' && path[mount_len] != '\0')) {
+        return path;
+    }
+    int n = snprintf(out, size, "%s%s", _root(), path + mount_len);
+    if (n < 0 || (size_t) n >= size) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    _sleep_us(LIMITS.open_us);
+    return out;
+}
+
+void storage_posix_set_root(const char *root) {
+    ROOT = root;
+}
+
+void storage_posix_set_limits(const struct storage_limits_t *limits) {
+    LIMITS = *limits;
+}
+
+void storage_posix_set_power_budget(int64_t units) {
+    POWER_BUDGET = units;
+}
+
+bool storage_is_mounted() {
+    return MOUNTED;
+}
+
+esp_err_t set_up_storage() {
+    struct stat st;
+    if (MOUNTED) {
+        return ESP_OK;
+    }
+    if (stat(_root(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        ESP_LOGE(SD_TAG, "%s is not a directory.", _root());
+        return ESP_ERR_NOT_FOUND;
+    }
+    MOUNTED = true;
+    ESP_LOGI(SD_TAG, "%s mounted at " MOUNT_POINT " (%u us open, %u us access, %u B/s)", _root(),
+             (unsigned) LIMITS.open_us, (unsigned) LIMITS.access_us, (unsigned) LIMITS.bytes_per_s);
+    return ESP_OK;
+}
+
+void storage_benchmark(const char *path) {
+    static const size_t BUFFER_SIZES[] = {512, 4096, ALLOCATION_UNIT_SIZE};
+    if (!storage_is_mounted()) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(BUFFER_SIZES) / sizeof(BUFFER_SIZES[0]); i++) {
+        uint32_t kbps = storage_read_speed(path, BUFFER_SIZES[i]);
+        ESP_LOGI(SD_TAG, "Benchmark %s: %u byte buffer: %u KB/s", path,
+                 (unsigned) BUFFER_SIZES[i], (unsigned) kbps);
+    }
+}
+
+void shut_down_storage() {
+    MOUNTED = false;
+}
+
+static ssize_t _read(void *cookie, char *buf, size_t size) {
+    size_t n = fread(buf, 1, size, (FILE *) cookie);
+    _access(n);
+    return ferror((FILE *) cookie) ? -1 : (ssize_t) n;
+}
+
+static ssize_t _write(void *cookie, const char *buf, size_t size) {
+    const size_t powered = _spend(size);
+    size_t n = fwrite(buf, 1, powered, (FILE *) cookie);
+    _access(n);
+    return n == size ? (ssize_t) n : -1;
+}
+
+static int _seek(void *cookie, off64_t *offset, int whence) {
+    FILE *file = (FILE *) cookie;
+    if (fseeko(file, (off_t) *offset, whence) != 0) {
+        return -1;
+    }
+    *offset = (off64_t) ftello(file);
+    return 0;
+}
+
+static int _close(void *cookie) {
+    return fclose((FILE *) cookie);
+}
+
+FILE *storage_fopen(const char *path, const char *mode) {
+    char mapped[PATH_LEN];
+    const char *host_path = _map(path, mapped, sizeof(mapped));
+    if (!host_path) {
+        return NULL;
+    }
+    FILE *file = fopen(host_path, mode);
+    if (!file || (LIMITS.access_us == 0 && LIMITS.bytes_per_s == 0 && POWER_BUDGET < 0)) {
+        return file;
+    }
+    // The caller's stdio buffer decides the transfer sizes, as on the card.
+    setvbuf(file, NULL, _IONBF, 0);
+    static const cookie_io_functions_t IO = {
+        .read = _read,
+        .write = _write,
+        .seek = _seek,
+        .close = _close,
+    };
+    FILE *limited = fopencookie(file, mode, IO);
+    if (!limited) {
+        fclose(file);
+    }
+    return limited;
+}
+
+int storage_stat(const char *path, struct stat *st) {
+    char mapped[PATH_LEN];
+    const char *host_path = _map(path, mapped, sizeof(mapped));
+    return host_path ? stat(host_path, st) : -1;
+}
+
+static int _power_cut() {
+    errno = EIO;
+    return -1;
+}
+
+int storage_unlink(const char *path) {
+    char mapped[PATH_LEN];
+    const char *host_path = _map(path, mapped, sizeof(mapped));
+    if (!host_path) {
+        return -1;
+    }
+    return _spend(1) ? unlink(host_path) : _power_cut();
+}
+
+int storage_rename(const char *from, const char *to) {
+    char mapped_from[PATH_LEN];
+    char mapped_to[PATH_LEN];
+    const char *host_from = _map(from, mapped_from, sizeof(mapped_from));
+    const char *host_to = _map(to, mapped_to, sizeof(mapped_to));
+    if (!host_from || !host_to) {
+        return -1;
+    }
+    // FAT does not replace an existing target, unlike POSIX rename.
+    struct stat st;
+    if (lstat(host_to, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return _spend(1) ? rename(host_from, host_to) : _power_cut();
+}
+
+int storage_fsync(FILE *file) {
+    if (fflush(file) != 0) {
+        return -1;
+    }
+    // A limited stream has no descriptor, its unbuffered host stream
+    // already handed the data to the kernel.
+    int fd = fileno(file);
+    return fd < 0 ? 0 : fsync(fd);
+}
+
+DIR *storage_opendir(const char *path) {
+    char mapped[PATH_LEN];
+    const char *host_path = _map(path, mapped, sizeof(mapped));
+    return host_path ? opendir(host_path) : NULL;
+}
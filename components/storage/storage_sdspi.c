@@ -0,0 +1,188 @@
+// Logging/Error includes
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+// File system includes
+#include "esp_vfs_fat.h"
+
+// SPI interface includes
+#include "driver/sdspi_host.h"
+#include "driver/spi_common.h"
+
+// SD Card command libraries
+#include "sdmmc_cmd.h"
+#include "driver/sdmmc_host.h"
+
+// std
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/unistd.h>
+
+#include "storage.h"
+
+const char *SD_TAG = "SD Card";
+
+static sdmmc_card_t *card = NULL;
+static sdmmc_host_t *host = NULL;
+
+// Clock steps tried from the top, a step above the configured clock is skipped.
+static const uint32_t SPI_FREQS_KHZ[] = {40000, 26000, 20000, 10000, 5000};
+#define N_SPI_FREQS             (sizeof(SPI_FREQS_KHZ) / sizeof(SPI_FREQS_KHZ[0]))
+
+static size_t freq_step = 0;
+
+/**
+ * Errors of a card that answers but not reliably at the current clock.
+ */
+static bool _is_signal_error(esp_err_t err) {
+    return err == ESP_ERR_INVALID_CRC ||
+        err == ESP_ERR_TIMEOUT ||
+        err == ESP_ERR_INVALID_RESPONSE;
+}
+
+static size_t _first_freq_step() {
+    size_t step = 0;
+    while (step < N_SPI_FREQS - 1 && SPI_FREQS_KHZ[step] > CONFIG_SD_SPI_FREQ_KHZ) {
+        step++;
+    }
+    return step;
+}
+
+bool storage_is_mounted() {
+    return card != NULL;
+}
+
+esp_err_t set_up_storage() {
+    esp_err_t ret;
+    if (storage_is_mounted()) {
+        return ESP_OK;
+    }
+
+    // File system configuration
+    esp_vfs_fat_sdmmc_mount_config_t mount_config = {
+        .format_if_mount_failed = false, // Don't format card if failed
+        .max_files = 5, // max number of open files
+        .allocation_unit_size = ALLOCATION_UNIT_SIZE
+    };
+
+    ESP_LOGI(SD_TAG, "Initializing SD card");
+    
+    host = malloc(sizeof(sdmmc_host_t));
+    *host = (sdmmc_host_t) SDSPI_HOST_DEFAULT();
+
+    // SPI Interface configuration
+    spi_bus_config_t bus_cfg = {
+        .mosi_io_num = PIN_NUM_MOSI,
+        .miso_io_num = PIN_NUM_MISO,
+        .sclk_io_num = PIN_NUM_CLK,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        // Room for multi-sector reads of up to a whole allocation unit.
+        .max_transfer_sz = ALLOCATION_UNIT_SIZE,
+    };
+    ret = spi_bus_initialize(host->slot, &bus_cfg, SPI_DMA_CHAN);
+    if (ret != ESP_OK) {
+        ESP_LOGE(SD_TAG, "Failed to initialize bus.");
+        free(host);
+        host = NULL;
+        return ret;
+    }
+
+    // This initializes the slot without card detect (CD) and write protect (WP) signals.
+    // Modify slot_config.gpio_cd and slot_config.gpio_wp if your board has these signals.
+    sdspi_device_config_t slot_config = SDSPI_DEVICE_CONFIG_DEFAULT();
+    slot_config.gpio_cs = PIN_NUM_CS;
+    slot_config.host_id = host->slot;
+
+    for (freq_step = _first_freq_step(); freq_step < N_SPI_FREQS; freq_step++) {
+        host->max_freq_khz = SPI_FREQS_KHZ[freq_step];
+        ret = esp_vfs_fat_sdspi_mount(MOUNT_POINT, host, &slot_config, &mount_config, &card);
+        if (!_is_signal_error(ret) || freq_step == N_SPI_FREQS - 1) {
+            break;
+        }
+        ESP_LOGW(SD_TAG, "Card unreliable at %u kHz (%s), retrying slower.",
+                 (unsigned) host->max_freq_khz, esp_err_to_name(ret));
+    }
+
+    if (ret != ESP_OK) {
+        if (ret == ESP_FAIL) {
+            ESP_LOGE(SD_TAG, "Failed to mount filesystem. "
+                    "If you want the card to be formatted, set the EXAMPLE_FORMAT_IF_MOUNT_FAILED menuconfig option.");
+        } else {
+            ESP_LOGE(SD_TAG, "Failed to initialize the card (%s). "
+                    "Make sure SD card lines have pull-up resistors in place.", esp_err_to_name(ret));
+        }
+        card = NULL;
+        spi_bus_free(host->slot);
+        free(host);
+        host = NULL;
+        return ret;
+    }
+    ESP_LOGI(SD_TAG, "Filesystem mounted at %u kHz", (unsigned) host->max_freq_khz);
+
+    // Card has been initialized, print its properties
+    sdmmc_card_print_info(stdout, card); return ESP_OK;
+}
+
+void storage_benchmark(const char *path) {
+    static const size_t BUFFER_SIZES[] = {512, 4096, ALLOCATION_UNIT_SIZE};
+    if (!storage_is_mounted()) {
+        return;
+    }
+    const size_t mounted_step = freq_step;
+    for (size_t step = mounted_step; step < N_SPI_FREQS; step++) {
+        if (sdspi_host_set_card_clk(card->host.slot, SPI_FREQS_KHZ[step]) != ESP_OK) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(BUFFER_SIZES) / sizeof(BUFFER_SIZES[0]); i++) {
+            uint32_t kbps = storage_read_speed(path, BUFFER_SIZES[i]);
+            ESP_LOGI(SD_TAG, "Benchmark %s: %u kHz, %u byte buffer: %u KB/s", path,
+                     (unsigned) SPI_FREQS_KHZ[step], (unsigned) BUFFER_SIZES[i], (unsigned) kbps);
+        }
+    }
+    sdspi_host_set_card_clk(card->host.slot, SPI_FREQS_KHZ[mounted_step]);
+}
+
+void shut_down_storage() {
+    if (!storage_is_mounted()) {
+        return;
+    }
+    // All done, unmount partition and disable SDMMC or SPI peripheral
+    esp_vfs_fat_sdcard_unmount(MOUNT_POINT, card);
+    card = NULL;
+    ESP_LOGI(SD_TAG, "Card unmounted");
+
+    //deinitialize the bus after all devices are removed
+    spi_bus_free(host->slot);
+    free(host);
+    host = NULL;
+}
+
+// The card is mounted in the VFS, so paths are used as they are.
+
+FILE *storage_fopen(const char *path, const char *mode) {
+    return fopen(path, mode);
+}
+
+int storage_stat(const char *path, struct stat *st) {
+    return stat(path, st);
+}
+
+int storage_unlink(const char *path) {
+    return unlink(path);
+}
+
+int storage_rename(const char *from, const char *to) {
+    return rename(from, to);
+}
+
+int storage_fsync(FILE *file) {
+    return fflush(file) == 0 ? fsync(fileno(file)) : -1;
+}
+
+DIR *storage_opendir(const char *path) {
+    return opendir(path);
+}
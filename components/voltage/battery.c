@@ -0,0 +1,194 @@
+#include "battery.h"
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "voltage.h"
+
+#define LOW_MV                  CONFIG_BATTERY_LOW_MV
+#define CRITICAL_MV             CONFIG_BATTERY_CRITICAL_MV
+#define HYSTERESIS_MV           CONFIG_BATTERY_HYSTERESIS_MV
+
+static const char *BATTERY_TAG = "Battery";
+
+static const struct voltage_read_config_t *ADC = NULL;
+static esp_timer_handle_t TIMER = NULL;
+static battery_cb_t CALLBACK = NULL;
+static void *CALLBACK_ARG = NULL;
+static volatile battery_load_probe_t LOAD_PROBE = NULL;
+
+// Exponential averages in mV with 8 fractional bits.
+static uint32_t IDLE_Q8 = 0;
+static uint32_t LOADED_Q8 = 0;
+static bool HAVE_IDLE = false;
+static uint32_t N_LOADED = 0;   // consecutive loaded samples
+
+// Learned drop under load, kept over deep sleep.
+RTC_DATA_ATTR static uint32_t SAG_MV = 0;
+
+/**
+ * Written only by the sampling timer. SEQ is odd while STATE is being
+ * written, readers retry until they see the same even SEQ on both sides.
+ */
+static volatile uint32_t SEQ = 0;
+static volatile struct battery_state_t STATE;
+
+static uint32_t _median_raw() {
+    int raw[BATTERY_BURST];
+    for (int i = 0; i < BATTERY_BURST; i++) {
+        // Insertion sort while sampling, the burst is small.
+        int v = voltage_read_raw(ADC);
+        int j = i;
+        for (; j > 0 && raw[j - 1] > v; j--) {
+            raw[j] = raw[j - 1];
+        }
+        raw[j] = v;
+    }
+    return (uint32_t) raw[BATTERY_BURST / 2];
+}
+
+/**
+ * Level with hysteresis, a level is left only once the voltage is
+ * HYSTERESIS_MV past its threshold.
+ */
+static enum battery_level_t _level(enum battery_level_t current, uint32_t mv) {
+    const uint32_t critical = current >= BATTERY_CRITICAL ? CRITICAL_MV + HYSTERESIS_MV : CRITICAL_MV;
+    const uint32_t low = current >= BATTERY_LOW ? LOW_MV + HYSTERESIS_MV : LOW_MV;
+    if (mv < critical) {
+        return BATTERY_CRITICAL;
+    }
+    return mv < low ? BATTERY_LOW : BATTERY_OK;
+}
+
+/**
+ * @return the average in whole mV.
+ */
+static uint32_t _ema(uint32_t *ema_q8, uint32_t mv, bool first) {
+    if (first) {
+        *ema_q8 = mv << 8;
+    } else {
+        *ema_q8 = *ema_q8 + (mv << 8) / (1 << BATTERY_EMA_SHIFT) - *ema_q8 / (1 << BATTERY_EMA_SHIFT);
+    }
+    return (*ema_q8 + 128) >> 8;
+}
+
+/**
+ * Average mv with the samples of the same load and return the resting
+ * voltage. The resting average is left as it was before the load, so
+ * once the loaded average settles their difference is the sag.
+ */
+static uint32_t _rest_mv(uint32_t mv, bool loaded) {
+    if (!loaded) {
+        N_LOADED = 0;
+        const uint32_t idle = _ema(&IDLE_Q8, mv, !HAVE_IDLE);
+        HAVE_IDLE = true;
+        return idle;
+    }
+    const uint32_t loaded_mv = _ema(&LOADED_Q8, mv, N_LOADED == 0);
+    N_LOADED++;
+    const uint32_t idle_mv = (IDLE_Q8 + 128) >> 8;
+    if (HAVE_IDLE && N_LOADED >= BATTERY_SAG_SETTLE && idle_mv > loaded_mv) {
+        const uint32_t sag = idle_mv - loaded_mv;
+        SAG_MV = SAG_MV ? SAG_MV + sag / (1 << BATTERY_EMA_SHIFT) - SAG_MV / (1 << BATTERY_EMA_SHIFT) : sag;
+    }
+    return loaded_mv + SAG_MV;
+}
+
+static void _publish(uint32_t mv, bool loaded) {
+    const uint32_t rest = _rest_mv(mv, loaded);
+    const enum battery_level_t previous = STATE.level;
+    const enum battery_level_t level = _level(STATE.seq == 0 ? BATTERY_OK : previous, rest);
+
+    SEQ++;
+    STATE.mv = rest;
+    STATE.last_mv = mv;
+    STATE.sag_mv = SAG_MV;
+    STATE.loaded = loaded;
+    STATE.level = level;
+    STATE.seq++;
+    SEQ++;
+
+    if (level != previous && CALLBACK) {
+        CALLBACK(level, rest, CALLBACK_ARG);
+    }
+}
+
+static void _sample(void *unused) {
+    const battery_load_probe_t probe = LOAD_PROBE;
+    const bool loaded = probe && probe();
+    _publish(voltage_from_raw(ADC, _median_raw()), loaded);
+}
+
+esp_err_t battery_start(const struct voltage_read_config_t *config, const struct voltage_history_t *history,
+                        battery_cb_t cb, void *arg) {
+    if (TIMER) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    ADC = config;
+    CALLBACK = cb;
+    CALLBACK_ARG = arg;
+    const esp_timer_create_args_t timer_args = {
+        .callback = _sample,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "battery",
+    };
+    esp_err_t ret = esp_timer_create(&timer_args, &TIMER);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (history && history->n_samples > 0) {
+        // Taken at rest, the average seeds the resting average.
+        uint32_t min_mv;
+        const uint32_t mv = voltage_history_mv(ADC, history, &min_mv);
+        STATE.sleep_min_mv = min_mv;
+        _publish(mv, false);
+    } else {
+        _sample(NULL);
+    }
+    ret = esp_timer_start_periodic(TIMER, (uint64_t) CONFIG_BATTERY_PERIOD_MS * 1000);
+    if (ret == ESP_OK) {
+        ESP_LOGI(BATTERY_TAG, "Sampling every %d ms, %u mV.", CONFIG_BATTERY_PERIOD_MS, (unsigned) STATE.mv);
+    }
+    return ret;
+}
+
+void battery_set_load_probe(battery_load_probe_t probe) {
+    LOAD_PROBE = probe;
+}
+
+void battery_stop() {
+    if (TIMER) {
+        esp_timer_stop(TIMER);
+    }
+}
+
+void battery_get(struct battery_state_t *state) {
+    uint32_t seq;
+    do {
+        seq = SEQ;
+        state->mv = STATE.mv;
+        state->last_mv = STATE.last_mv;
+        state->sag_mv = STATE.sag_mv;
+        state->sleep_min_mv = STATE.sleep_min_mv;
+        state->seq = STATE.seq;
+        state->loaded = STATE.loaded;
+        state->level = STATE.level;
+    } while ((seq & 1) || seq != SEQ);
+}
+
+uint32_t battery_mv() {
+    return STATE.mv;
+}
+
+uint32_t battery_wake_mv() {
+    switch (STATE.level) {
+        case BATTERY_OK:
+            return LOW_MV;
+        case BATTERY_LOW:
+            return CRITICAL_MV;
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef _BATTERY_H
+#define _BATTERY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "voltage_types.h"
+
+#define BATTERY_BURST           9     // conversions per sample, the median is kept
+#define BATTERY_EMA_SHIFT       2     // each sample moves the average by 1/4
+#define BATTERY_SAG_SETTLE      4     // loaded samples before the sag is measured
+
+enum battery_level_t {
+    BATTERY_OK = 0,
+    BATTERY_LOW,
+    BATTERY_CRITICAL,
+};
+
+/**
+ * Filtered battery state. seq counts samples since battery_start.
+ * Samples under load and at rest are averaged apart, mv is the resting
+ * voltage either way: the loaded average plus the sag learned from the
+ * resting average before the load.
+ */
+struct battery_state_t {
+    uint32_t mv;              // resting mV, median of each burst, then an exponential average
+    uint32_t last_mv;         // median of the last burst alone, as measured
+    uint32_t sag_mv;          // drop under load, 0 until measured
+    uint32_t sleep_min_mv;    // lowest ULP sample of the last deep sleep, 0 if none
+    uint32_t seq;
+    bool loaded;              // the last sample was taken under load
+    enum battery_level_t level;
+};
+
+/**
+ * Tells a sample taken under load, e.g. while audio plays.
+ */
+typedef bool (*battery_load_probe_t)(void);
+
+/**
+ * Called from the sampling timer when the level changes. Keep it short,
+ * it runs in the esp_timer task.
+ */
+typedef void (*battery_cb_t)(enum battery_level_t level, uint32_t mv, void *arg);
+
+/**
+ * Sample the battery every CONFIG_BATTERY_PERIOD_MS in the background.
+ * The first state comes from history, the samples the ULP took in deep
+ * sleep, or without one from a sample taken before returning, so
+ * battery_get is valid straight away. adc_config must have been called
+ * for config, which must stay valid.
+ */
+esp_err_t battery_start(const struct voltage_read_config_t *config, const struct voltage_history_t *history,
+                        battery_cb_t cb, void *arg);
+
+void battery_stop();
+
+/**
+ * Probe asked before every sample, NULL treats every sample as resting.
+ */
+void battery_set_load_probe(battery_load_probe_t probe);
+
+/**
+ * Copy the latest state. Never blocks, a sample taken meanwhile makes
+ * it retry.
+ */
+void battery_get(struct battery_state_t *state);
+
+/**
+ * @return filtered resting mV, 0 before battery_start.
+ */
+uint32_t battery_mv();
+
+/**
+ * @return the threshold of the next level down, to be woken at while
+ *         asleep, 0 at BATTERY_CRITICAL.
+ */
+uint32_t battery_wake_mv();
+
+#endif // _BATTERY_H
@@ -0,0 +1,169 @@
+#include "charge.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "freertos/FreeRTOS.h"
+
+#include "battery.h"
+#include "nvs_store.h"
+
+static const char *CHARGE_TAG = "Charge";
+
+/**
+ * Open circuit discharge curve of the cell, highest voltage first. The
+ * charge is interpolated linearly between points.
+ */
+static const struct {
+    uint16_t mv;
+    uint16_t permille;
+} CURVE[] = {
+    {4200, 1000}, {4150, 950}, {4110, 900}, {4080, 850}, {4020, 800},
+    {3980, 750},  {3950, 700}, {3910, 650}, {3870, 600}, {3850, 550},
+    {3840, 500},  {3820, 450}, {3800, 400}, {3790, 350}, {3770, 300},
+    {3750, 250},  {3730, 200}, {3710, 150}, {3690, 100}, {3610, 50},
+    {3300, 0},
+};
+#define N_CURVE                 (sizeof(CURVE) / sizeof(CURVE[0]))
+
+RTC_DATA_ATTR static struct charge_history_t HISTORY;
+
+// Guards HISTORY between charge_end_wake and readers.
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+
+uint32_t charge_from_mv(uint32_t rest_mv) {
+    if (rest_mv >= CURVE[0].mv) {
+        return CURVE[0].permille * CHARGE_ONE;
+    }
+    for (size_t i = 1; i < N_CURVE; i++) {
+        if (rest_mv >= CURVE[i].mv) {
+            const uint32_t span_mv = CURVE[i - 1].mv - CURVE[i].mv;
+            const uint32_t span_q16 = (CURVE[i - 1].permille - CURVE[i].permille) * CHARGE_ONE;
+            return CURVE[i].permille * CHARGE_ONE +
+                (uint32_t) ((uint64_t) span_q16 * (rest_mv - CURVE[i].mv) / span_mv);
+        }
+    }
+    return 0;
+}
+
+static uint32_t _crc(const struct charge_history_t *history) {
+    return esp_rom_crc32_le(0, (const uint8_t *) history, offsetof(struct charge_history_t, crc));
+}
+
+static bool _valid(const struct charge_history_t *history) {
+    return history->magic == CHARGE_MAGIC &&
+        history->version == CHARGE_VERSION &&
+        history->size == sizeof(*history) &&
+        history->crc == _crc(history);
+}
+
+static esp_err_t _nvs_read(struct charge_history_t *history) {
+    esp_err_t ret = nvs_store_read(CHARGE_NAMESPACE, CHARGE_KEY, history, sizeof(*history));
+    if (ret == ESP_OK && !_valid(history)) {
+        ret = ESP_ERR_INVALID_CRC;
+    }
+    return ret;
+}
+
+esp_err_t charge_init() {
+    if (_valid(&HISTORY)) {
+        return ESP_OK;
+    }
+    struct charge_history_t history;
+    if (_nvs_read(&history) == ESP_OK) {
+        // Wakes since the last NVS write are lost, so the charge saved
+        // then is no baseline for the next wake.
+        history.last_q16 = 0;
+        ESP_LOGI(CHARGE_TAG, "Restored history of %u wakes from NVS.", (unsigned) history.wakes);
+    } else {
+        memset(&history, 0, sizeof(history));
+        history.magic = CHARGE_MAGIC;
+        history.version = CHARGE_VERSION;
+        history.size = sizeof(history);
+    }
+    history.crc = _crc(&history);
+    portENTER_CRITICAL(&LOCK);
+    memcpy(&HISTORY, &history, sizeof(history));
+    portEXIT_CRITICAL(&LOCK);
+    return ESP_OK;
+}
+
+static int32_t _ema(int32_t average, int32_t value, uint16_t n) {
+    if (n == 0) {
+        return value;
+    }
+    return average + (value - average) / (1 << CHARGE_EMA_SHIFT);
+}
+
+void charge_get(struct charge_estimate_t *estimate) {
+    const uint32_t rest_mv = battery_mv();
+    const uint32_t charge = charge_from_mv(rest_mv);
+    portENTER_CRITICAL(&LOCK);
+    const int32_t per_wake = HISTORY.per_wake_q16;
+    const int32_t per_play_s = HISTORY.per_play_s_q16;
+    const uint32_t play_ms = HISTORY.play_ms;
+    const bool known = HISTORY.n_quiet > 0;
+    const bool play_known = HISTORY.n_played > 0;
+    portEXIT_CRITICAL(&LOCK);
+
+    estimate->rest_mv = rest_mv;
+    estimate->permille = charge / CHARGE_ONE;
+    const int64_t wake_use = known ?
+        per_wake + (play_known ? (int64_t) per_play_s * play_ms / 1000 : 0) : 0;
+    estimate->wakes_left = wake_use > 0 ? (uint32_t) (charge / wake_use) : 0;
+    estimate->play_s_left = play_known && per_play_s > 0 ? charge / (uint32_t) per_play_s : 0;
+}
+
+void charge_get_history(struct charge_history_t *history) {
+    portENTER_CRITICAL(&LOCK);
+    memcpy(history, &HISTORY, sizeof(*history));
+    portEXIT_CRITICAL(&LOCK);
+}
+
+esp_err_t charge_end_wake(uint32_t played_ms) {
+    const uint32_t now = charge_from_mv(battery_mv());
+    struct charge_history_t history;
+    portENTER_CRITICAL(&LOCK);
+    memcpy(&history, &HISTORY, sizeof(history));
+    portEXIT_CRITICAL(&LOCK);
+    if (!_valid(&history)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (history.last_q16 != 0 && now < history.last_q16 + CHARGE_RECHARGED) {
+        // Signed, a cell recovering from load may read a little higher.
+        const int32_t used = (int32_t) (history.last_q16 - now);
+        if (played_ms < 1000) {
+            history.per_wake_q16 = _ema(history.per_wake_q16, used, history.n_quiet);
+            history.n_quiet += history.n_quiet < UINT16_MAX;
+        } else if (history.n_quiet > 0) {
+            const int32_t extra = (int32_t) ((int64_t) (used - history.per_wake_q16) * 1000 / played_ms);
+            history.per_play_s_q16 = _ema(history.per_play_s_q16, extra, history.n_played);
+            history.n_played += history.n_played < UINT16_MAX;
+        }
+    } else if (history.last_q16 != 0) {
+        ESP_LOGI(CHARGE_TAG, "Battery was charged.");
+    }
+    history.play_ms = (uint32_t) _ema((int32_t) history.play_ms, (int32_t) played_ms, history.wakes > 0);
+    history.last_q16 = now;
+    history.wakes++;
+    history.crc = _crc(&history);
+    portENTER_CRITICAL(&LOCK);
+    memcpy(&HISTORY, &history, sizeof(history));
+    portEXIT_CRITICAL(&LOCK);
+
+    // RTC memory survives deep sleep, NVS only needs the occasional copy.
+    if (played_ms >= 1000 || history.wakes % CHARGE_NVS_WAKES == 0) {
+        esp_err_t ret = nvs_store_write(CHARGE_NAMESPACE, CHARGE_KEY, &history, sizeof(history));
+        if (ret != ESP_OK) {
+            ESP_LOGW(CHARGE_TAG, "Failed to store history in NVS (%s).", esp_err_to_name(ret));
+            return ret;
+        }
+    }
+    return ESP_OK;
+}
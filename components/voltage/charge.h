@@ -0,0 +1,71 @@
+#ifndef _CHARGE_H
+#define _CHARGE_H
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define CHARGE_MAGIC            0x47484341  // "ACHG"
+#define CHARGE_VERSION          1
+#define CHARGE_NAMESPACE        "battery"
+#define CHARGE_KEY              "history"
+#define CHARGE_NVS_WAKES        16    // wakes between NVS writes without playback
+#define CHARGE_EMA_SHIFT        3     // each wake moves the averages by 1/8
+#define CHARGE_ONE              (1u << 16)  // one permille in the Q16 charge values
+#define CHARGE_RECHARGED        (20 * CHARGE_ONE)  // a rise this large means the cell was charged
+
+/**
+ * Consumption learnt over past wakes, in RTC memory and NVS. A wake's
+ * use includes the sleep before it. Charges are permille in Q16.
+ */
+struct charge_history_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+    uint32_t wakes;
+    uint32_t last_q16;        // when the last wake ended, 0 if not known
+    int32_t per_wake_q16;     // used by a wake without playback
+    int32_t per_play_s_q16;   // used on top of that per second of playback
+    uint32_t play_ms;         // average playback per wake
+    uint16_t n_quiet;         // wakes averaged into per_wake_q16, saturating
+    uint16_t n_played;        // wakes averaged into per_play_s_q16, saturating
+    uint32_t crc;
+};
+
+struct charge_estimate_t {
+    uint32_t permille;
+    uint32_t rest_mv;
+    uint32_t wakes_left;      // at the average playback per wake, 0 if not known yet
+    uint32_t play_s_left;     // seconds of playback, 0 if not known yet
+};
+
+/**
+ * Charge of the cell at rest_mv from its discharge curve.
+ *
+ * @return permille in Q16.
+ */
+uint32_t charge_from_mv(uint32_t rest_mv);
+
+/**
+ * Restore the history from RTC memory, or from NVS after a power loss.
+ */
+esp_err_t charge_init();
+
+/**
+ * Estimate from the latest battery_mv and the history. Constant time,
+ * safe from any task.
+ */
+void charge_get(struct charge_estimate_t *estimate);
+
+/**
+ * Copy of the history as learnt so far, for logs and tests.
+ */
+void charge_get_history(struct charge_history_t *history);
+
+/**
+ * Learn from the wake about to end, played_ms of it with audio playing.
+ * Call once before deep sleep.
+ */
+esp_err_t charge_end_wake(uint32_t played_ms);
+
+#endif // _CHARGE_H
@@ -1,3 +1,5 @@
+#include <stdbool.h>
+
 #include "driver/adc_common.h"
 #include "hal/adc_types.h"
 #include "driver/adc.h"
@@ -8,6 +10,21 @@
 
 const char *VOLT_TAG = "VOLTAGE";
 
+// Characterised once per config, not per read.
+static esp_adc_cal_characteristics_t ADC_CHARS;
+static bool CHARACTERISED = false;
+
+static const esp_adc_cal_characteristics_t *_characteristics(const struct voltage_read_config_t *config) {
+    if (!CHARACTERISED ||
+        ADC_CHARS.adc_num != config->unit ||
+        ADC_CHARS.atten != config->atten ||
+        ADC_CHARS.bit_width != config->width) {
+        esp_adc_cal_characterize(config->unit, config->atten, config->width, config->default_vref, &ADC_CHARS);
+        CHARACTERISED = true;
+    }
+    return &ADC_CHARS;
+}
+
 esp_err_t adc_config(const struct voltage_read_config_t *config) {
     esp_err_t ret;
     if (config->unit == ADC_UNIT_1) {
@@ -19,6 +36,9 @@ esp_err_t adc_config(const struct voltage_read_config_t *config) {
     } else {
         ret = adc2_config_channel_atten((adc2_channel_t)config->channel, config->atten);
     }
+    if (ret == ESP_OK) {
+        _characteristics(config);
+    }
     return ret;
 }
 
@@ -26,35 +46,58 @@ void apply_coef(const struct divider_coef_t *coef, uint32_t *out) {
     *out = *out * coef->numerator / coef->denominator;
 }
 
+int voltage_read_raw(const struct voltage_read_config_t *config) {
+    if (config->unit == ADC_UNIT_1) {
+        return adc1_get_raw((adc1_channel_t)config->channel);
+    }
+    int raw = 0;
+    adc2_get_raw((adc2_channel_t)config->channel, config->width, &raw);
+    return raw;
+}
+
+uint32_t voltage_from_raw(const struct voltage_read_config_t *config, uint32_t raw) {
+    uint32_t voltage = esp_adc_cal_raw_to_voltage(raw, _characteristics(config));
+    apply_coef(&config->div_coef, &voltage);
+    return voltage;
+}
+
+uint32_t voltage_to_raw(const struct voltage_read_config_t *config, uint32_t mv) {
+    // The conversion is monotonic, bisect the raw range.
+    uint32_t low = 0;
+    uint32_t high = (1u << (9 + config->width)) - 1;
+    while (low < high) {
+        const uint32_t mid = (low + high) / 2;
+        if (voltage_from_raw(config, mid) < mv) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+uint32_t voltage_history_mv(const struct voltage_read_config_t *config,
+                            const struct voltage_history_t *history, uint32_t *min_mv) {
+    if (min_mv) {
+        *min_mv = voltage_from_raw(config, history->min_raw);
+    }
+    // Truncated as the ULP compares it, so a history that woke the CPU for
+    // a threshold never converts to a voltage at or above it.
+    return voltage_from_raw(config, history->avg_raw_q4 >> 4);
+}
+
 uint32_t read_voltage(const struct voltage_read_config_t *config, uint32_t *voltage) {
     if (!config) {
         return ERR_VOLTAGE_NO_CONFIG;
     }
 
-    //Continuously sample ADC1
-    esp_adc_cal_characteristics_t *adc_chars = calloc(1, sizeof(esp_adc_cal_characteristics_t));
-    esp_adc_cal_value_t val_type = esp_adc_cal_characterize(
-            config->unit, 
-            config->atten, 
-            config->width, 
-            config->default_vref, 
-            adc_chars
-    );
-
     uint32_t adc_reading = 0;
     // Multisampling
     for (int i = 0; i < config->n_samples; i++) {
-        if (config->unit == ADC_UNIT_1) {
-            adc_reading += adc1_get_raw((adc1_channel_t)config->channel);
-        } else {
-            int raw = 0;
-            adc2_get_raw((adc2_channel_t)config->channel, config->width, &raw);
-            adc_reading += raw;
-        }
+        adc_reading += voltage_read_raw(config);
     }
     adc_reading /= config->n_samples;
     // Convert adc_reading to voltage in mV
-    *voltage = esp_adc_cal_raw_to_voltage(adc_reading, adc_chars);
-    apply_coef(&config->div_coef, voltage);
+    *voltage = voltage_from_raw(config, adc_reading);
     return ERR_VOLTAGE_NONE;
 }
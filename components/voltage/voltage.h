@@ -4,7 +4,37 @@
 #include "esp_err.h"
 #include "voltage_types.h"
 
+/**
+ * Configure the channel and characterise the ADC, once for all reads.
+ */
 esp_err_t adc_config(const struct voltage_read_config_t *config);
+
+/**
+ * Average config->n_samples blocking conversions, in mV after the divider.
+ */
 uint32_t read_voltage(const struct voltage_read_config_t *config, uint32_t *voltage);
 
+/**
+ * One conversion of config's channel.
+ */
+int voltage_read_raw(const struct voltage_read_config_t *config);
+
+/**
+ * Convert a raw reading to mV after the divider.
+ */
+uint32_t voltage_from_raw(const struct voltage_read_config_t *config, uint32_t raw);
+
+/**
+ * The lowest raw reading at or above mv after the divider, to compare
+ * with raw readings where converting them is too expensive (the ULP).
+ */
+uint32_t voltage_to_raw(const struct voltage_read_config_t *config, uint32_t mv);
+
+/**
+ * Convert a history taken with config's channel to its average in mV,
+ * and optionally its minimum.
+ */
+uint32_t voltage_history_mv(const struct voltage_read_config_t *config,
+                            const struct voltage_history_t *history, uint32_t *min_mv);
+
 #endif // _BATTERY_VOLTAGE_H
@@ -18,6 +18,16 @@ struct voltage_read_config_t {
     uint32_t n_samples;
 };
 
+/**
+ * Raw conversions taken by the ULP while the CPU slept.
+ */
+struct voltage_history_t {
+    uint32_t n_samples;
+    uint32_t min_raw;
+    uint32_t avg_raw_q4;      // exponential average with 4 fractional bits
+    uint32_t last_raw;
+};
+
 enum {
     ERR_VOLTAGE_NONE = 0,
     ERR_VOLTAGE_NO_CONFIG = -1,
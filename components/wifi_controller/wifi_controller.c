@@ -263,7 +263,6 @@ static void connect_handler(void* arg, esp_event_base_t event_base,
 void wc_start_webserver(const char* ssid, const char* password) {
     static httpd_handle_t server = NULL;
 
-    ESP_ERROR_CHECK(nvs_flash_init());
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
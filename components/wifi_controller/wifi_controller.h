@@ -1,6 +1,10 @@
 #ifndef _WIFI_CONTROLLER_H_
 #define _WIFI_CONTROLLER_H_
 
+/**
+ * NVS must be initialised beforehand, the wifi driver keeps its
+ * calibration there.
+ */
 void wc_start_webserver(const char* ssid, const char* password);
 
 #endif
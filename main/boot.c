@@ -0,0 +1,76 @@
+#include "boot.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "freertos/task.h"
+
+static const char *BOOT_TAG = "Boot";
+
+struct boot_times_t {
+    int64_t created_us;
+    int64_t start_us;
+    int64_t end_us;
+};
+
+static const struct boot_stage_t *STAGES = NULL;
+static size_t N_STAGES = 0;
+static struct boot_times_t TIMES[BOOT_MAX_STAGES];
+static EventGroupHandle_t READY = NULL;
+
+static void _run_stage(void *arg) {
+    const size_t i = (size_t) arg;
+    const struct boot_stage_t *stage = &STAGES[i];
+    if (stage->needs) {
+        xEventGroupWaitBits(READY, stage->needs, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    TIMES[i].start_us = esp_timer_get_time();
+    stage->run();
+    TIMES[i].end_us = esp_timer_get_time();
+    ESP_LOGI(BOOT_TAG, "Stage %s ready at %d us, ran %d us.", stage->name,
+             (int) TIMES[i].end_us, (int) (TIMES[i].end_us - TIMES[i].start_us));
+    xEventGroupSetBits(READY, stage->done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t boot_start(const struct boot_stage_t *stages, size_t n_stages) {
+    if (n_stages > BOOT_MAX_STAGES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    READY = xEventGroupCreate();
+    if (!READY) {
+        return ESP_ERR_NO_MEM;
+    }
+    STAGES = stages;
+    N_STAGES = n_stages;
+    for (size_t i = 0; i < n_stages; i++) {
+        TIMES[i].created_us = esp_timer_get_time();
+        if (xTaskCreatePinnedToCore(_run_stage, stages[i].name, stages[i].stack, (void *) i,
+                                    stages[i].priority, NULL, stages[i].core) != pdPASS) {
+            ESP_LOGE(BOOT_TAG, "Failed to start stage %s.", stages[i].name);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+void boot_signal(EventBits_t bits) {
+    xEventGroupSetBits(READY, bits);
+}
+
+bool boot_wait(EventBits_t bits, TickType_t timeout) {
+    EventBits_t set = xEventGroupWaitBits(READY, bits, pdFALSE, pdTRUE, timeout);
+    return (set & bits) == bits;
+}
+
+void boot_log_timeline(void) {
+    for (size_t i = 0; i < N_STAGES; i++) {
+        if (TIMES[i].end_us == 0) {
+            ESP_LOGI(BOOT_TAG, "%-8s still running", STAGES[i].name);
+            continue;
+        }
+        ESP_LOGI(BOOT_TAG, "%-8s waited %7d us, ran %7d us, done at %7d us", STAGES[i].name,
+                 (int) (TIMES[i].start_us - TIMES[i].created_us),
+                 (int) (TIMES[i].end_us - TIMES[i].start_us), (int) TIMES[i].end_us);
+    }
+}
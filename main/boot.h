@@ -0,0 +1,52 @@
+#ifndef _BOOT_H
+#define _BOOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#define BOOT_MAX_STAGES         8
+
+/**
+ * One init step of app_main. Every stage runs in its own task once all
+ * stages in needs have set their bits, and sets done when it returns.
+ * A stage may also set further bits itself with boot_signal, e.g. once
+ * part of its result is usable by others. core pins the task, for stages
+ * that set up an interrupt allocated on the calling core, else
+ * tskNO_AFFINITY.
+ */
+struct boot_stage_t {
+    const char *name;
+    void (*run)(void);
+    EventBits_t needs;
+    EventBits_t done;
+    uint32_t stack;
+    UBaseType_t priority;
+    BaseType_t core;
+};
+
+/**
+ * Start every stage. stages must stay valid until they have all run.
+ */
+esp_err_t boot_start(const struct boot_stage_t *stages, size_t n_stages);
+
+void boot_signal(EventBits_t bits);
+
+/**
+ * Wait until all of bits are set.
+ *
+ * @return false on timeout.
+ */
+bool boot_wait(EventBits_t bits, TickType_t timeout);
+
+/**
+ * Log when each stage waited, started and finished, in us since boot.
+ */
+void boot_log_timeline(void);
+
+#endif // _BOOT_H
@@ -0,0 +1,452 @@
+#include "config.h"
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+
+#include "storage.h"
+
+static const char *CFG_TAG = "Config";
+
+// Last line of every file cfg_write writes, a comment to cfg_parse.
+#define END_LINE                "# end\n"
+
+enum {
+    CFG_SECTION_NONE = 0,
+    CFG_SECTION_WIFI,
+    CFG_SECTION_AUDIO,
+    CFG_SECTION_ALARM,
+};
+
+enum {
+    CFG_STRING,
+    CFG_PATH,
+    CFG_UINT,
+    CFG_ALARM,
+};
+
+/**
+ * One known key. The value is stored at offset in alarm_config_t,
+ * size bounds strings and max bounds numbers.
+ */
+struct cfg_key_t {
+    uint8_t section;
+    const char *name;
+    uint8_t type;
+    size_t offset;
+    size_t size;
+    uint32_t max;
+};
+
+static const char *SECTIONS[] = {
+    [CFG_SECTION_WIFI] = "WiFi AP Credentials",
+    [CFG_SECTION_AUDIO] = "Audio",
+    [CFG_SECTION_ALARM] = "Alarm",
+};
+
+#define FIELD(f)                offsetof(struct alarm_config_t, f), sizeof(((struct alarm_config_t *) 0)->f)
+
+static const struct cfg_key_t KEYS[] = {
+    {CFG_SECTION_WIFI,  "ssid",     CFG_STRING, FIELD(ssid),       0},
+    {CFG_SECTION_WIFI,  "password", CFG_STRING, FIELD(password),   0},
+    {CFG_SECTION_AUDIO, "file",     CFG_PATH,   FIELD(audio_file), 0},
+    {CFG_SECTION_AUDIO, "volume",   CFG_UINT,   FIELD(volume),     200},
+    {CFG_SECTION_AUDIO, "fade_in",  CFG_UINT,   FIELD(fade_in_s),  600},
+    {CFG_SECTION_ALARM, "time",     CFG_ALARM,  FIELD(alarms),     0},
+};
+
+static const char *DAYS[] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
+
+void cfg_defaults(struct alarm_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    config->volume = CFG_DEFAULT_VOLUME;
+}
+
+static char *_trim(char *s) {
+    while (isspace((unsigned char) *s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return s;
+}
+
+/**
+ * Strip a comment and surrounding quotes from a value in place.
+ *
+ * @return false for an unterminated quote.
+ */
+static bool _unquote(char **value) {
+    char *v = *value;
+    if (*v == '"') {
+        char *close = strchr(v + 1, '"');
+        if (!close) {
+            return false;
+        }
+        *close = '\0';
+        *value = v + 1;
+        return true;
+    }
+    char *comment = strpbrk(v, "#;");
+    if (comment) {
+        *comment = '\0';
+    }
+    *value = _trim(v);
+    return true;
+}
+
+/**
+ * A value too long for dst leaves dst as it was rather than truncated.
+ */
+static bool _copy(char *dst, size_t size, const char *prefix, const char *value) {
+    const size_t prefix_len = strlen(prefix);
+    const size_t value_len = strlen(value);
+    if (prefix_len + value_len >= size) {
+        return false;
+    }
+    memcpy(dst, prefix, prefix_len);
+    memcpy(dst + prefix_len, value, value_len + 1);
+    return true;
+}
+
+static bool _parse_uint(const char *value, uint32_t max, uint32_t *out) {
+    char *end = NULL;
+    unsigned long v = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || v > max) {
+        return false;
+    }
+    *out = (uint32_t) v;
+    return true;
+}
+
+static int _day(const char *s) {
+    for (int i = 0; i < 7; i++) {
+        if (strncmp(s, DAYS[i], 3) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * "HH:MM" optionally followed by days, e.g. "07:30 Mon-Fri" or
+ * "09:00 Sat,Sun". No days means every day.
+ */
+static bool _parse_alarm(char *value, struct alarm_time_t *alarm) {
+    unsigned hour = 0;
+    unsigned minute = 0;
+    int used = 0;
+    if (sscanf(value, "%2u:%2u%n", &hour, &minute, &used) != 2 || hour > 23 || minute > 59) {
+        return false;
+    }
+    alarm->hour = (uint8_t) hour;
+    alarm->minute = (uint8_t) minute;
+
+    char *days = _trim(value + used);
+    if (*days == '\0') {
+        alarm->days = CFG_EVERY_DAY;
+        return true;
+    }
+    alarm->days = 0;
+    char *save = NULL;
+    for (char *token = strtok_r(days, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        token = _trim(token);
+        int first = _day(token);
+        int last = first;
+        if (strlen(token) == 7 && token[3] == '-') {
+            last = _day(token + 4);
+        } else if (strlen(token) != 3) {
+            return false;
+        }
+        if (first < 0 || last < 0) {
+            return false;
+        }
+        // Ranges may wrap, e.g. Sat-Mon.
+        for (int d = first;; d = (d + 1) % 7) {
+            alarm->days |= CFG_DAY(d);
+            if (d == last) {
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+static const struct cfg_key_t *_find_key(int section, const char *name) {
+    for (size_t i = 0; i < sizeof(KEYS) / sizeof(KEYS[0]); i++) {
+        if (KEYS[i].section == section && strcmp(KEYS[i].name, name) == 0) {
+            return &KEYS[i];
+        }
+    }
+    return NULL;
+}
+
+static int _find_section(const char *name) {
+    for (size_t i = 0; i < sizeof(SECTIONS) / sizeof(SECTIONS[0]); i++) {
+        if (SECTIONS[i] && strcmp(SECTIONS[i], name) == 0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+static bool _store(const struct cfg_key_t *key, char *value, const char *base_dir,
+                   struct alarm_config_t *config) {
+    void *field = (uint8_t *) config + key->offset;
+    switch (key->type) {
+        case CFG_STRING:
+            return _copy(field, key->size, "", value);
+        case CFG_PATH:
+            return *value != '\0' && _copy(field, key->size, value[0] == '/' ? "" : base_dir, value);
+        case CFG_UINT:
+            return _parse_uint(value, key->max, field);
+        case CFG_ALARM:
+            if (config->n_alarms == CFG_MAX_ALARMS) {
+                return false;
+            }
+            if (!_parse_alarm(value, &config->alarms[config->n_alarms])) {
+                return false;
+            }
+            config->n_alarms++;
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @return false if the line is malformed.
+ */
+static bool _parse_line(char *line, int *section, bool first, const char *base_dir,
+                        struct alarm_config_t *config) {
+    line = _trim(line);
+    if (*line == '\0' || *line == '#' || *line == ';') {
+        return true;
+    }
+    if (*line == '[') {
+        char *close = strchr(line, ']');
+        if (!close) {
+            return false;
+        }
+        *close = '\0';
+        *section = _find_section(_trim(line + 1));
+        return *section >= 0;
+    }
+    char *eq = strchr(line, '=');
+    if (!eq) {
+        // The original format: the audio file name alone on the first line.
+        return first && _unquote(&line) && _copy(config->audio_file, sizeof(config->audio_file), base_dir, line);
+    }
+    if (*section < 0) {
+        // Keys of an unknown section are skipped, the section was reported.
+        return true;
+    }
+    *eq = '\0';
+    char *value = _trim(eq + 1);
+    const struct cfg_key_t *key = _find_key(*section, _trim(line));
+    return key && _unquote(&value) && _store(key, value, base_dir, config);
+}
+
+void cfg_parse(FILE *file, const char *base_dir, struct alarm_config_t *config) {
+    char line[CFG_LINE_LEN];
+    int section = CFG_SECTION_NONE;
+    int line_no = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+        size_t len = strlen(line);
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n' && !feof(file)) {
+            // Skip the rest of an overlong line.
+            int c;
+            while ((c = fgetc(file)) != EOF && c != '\n') {
+            }
+            ESP_LOGW(CFG_TAG, "Line %d is too long, skipped.", line_no);
+            config->errors++;
+            continue;
+        }
+        if (!_parse_line(line, &section, line_no == 1, base_dir, config)) {
+            ESP_LOGW(CFG_TAG, "Line %d is malformed, skipped.", line_no);
+            config->errors++;
+        }
+    }
+}
+
+static bool _tmp_path(const char *path, char *out, size_t size) {
+    const size_t len = strlen(path);
+    if (len == 0 || len >= size) {
+        return false;
+    }
+    memcpy(out, path, len + 1);
+    out[len - 1] = CFG_TMP_MARK;
+    return true;
+}
+
+/**
+ * @return true if the file at path ends with END_LINE.
+ */
+static bool _complete(const char *path) {
+    const size_t len = strlen(END_LINE);
+    char tail[sizeof(END_LINE)];
+    FILE *file = storage_fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    const bool complete = fseek(file, -(long) len, SEEK_END) == 0 && fread(tail, 1, len, file) == len &&
+                          memcmp(tail, END_LINE, len) == 0;
+    fclose(file);
+    return complete;
+}
+
+/**
+ * Without path, a temporary file that got as far as END_LINE was synced
+ * before path was removed and is taken. Any other is what a power loss
+ * left of a first save and is dropped.
+ */
+static void _recover(const char *path) {
+    char tmp_path[CFG_PATH_LEN];
+    struct stat st;
+    if (!_tmp_path(path, tmp_path, sizeof(tmp_path)) ||
+        storage_stat(path, &st) == 0 || storage_stat(tmp_path, &st) != 0) {
+        return;
+    }
+    if (!_complete(tmp_path)) {
+        if (storage_unlink(tmp_path) == 0) {
+            ESP_LOGW(CFG_TAG, "Dropped an incomplete save of %s.", path);
+        }
+    } else if (storage_rename(tmp_path, path) == 0) {
+        ESP_LOGW(CFG_TAG, "Completed an interrupted save of %s.", path);
+    }
+}
+
+esp_err_t cfg_load(const char *path, const char *base_dir, struct alarm_config_t *config) {
+    cfg_defaults(config);
+    _recover(path);
+    FILE *file = storage_fopen(path, "r");
+    if (!file) {
+        ESP_LOGE(CFG_TAG, "Failed to open %s.", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+    cfg_parse(file, base_dir, config);
+    fclose(file);
+    ESP_LOGI(CFG_TAG, "Read %s: audio %s, %u alarm(s), %u bad line(s).", path, config->audio_file,
+             (unsigned) config->n_alarms, (unsigned) config->errors);
+    return ESP_OK;
+}
+
+static bool _quotable(const char *value) {
+    return strpbrk(value, "\"\r\n") == NULL;
+}
+
+static bool _write_alarm(FILE *file, const char *name, const struct alarm_time_t *alarm) {
+    if (fprintf(file, "%s = %02u:%02u", name, alarm->hour, alarm->minute) < 0) {
+        return false;
+    }
+    if (alarm->days != CFG_EVERY_DAY) {
+        const char *separator = " ";
+        for (int d = 0; d < 7; d++) {
+            if (alarm->days & CFG_DAY(d)) {
+                fprintf(file, "%s%s", separator, DAYS[d]);
+                separator = ",";
+            }
+        }
+    }
+    return fputc('\n', file) != EOF;
+}
+
+static esp_err_t _write_key(FILE *file, const struct cfg_key_t *key, const char *base_dir,
+                            const struct alarm_config_t *config) {
+    const void *field = (const uint8_t *) config + key->offset;
+    const size_t base_len = strlen(base_dir);
+    const char *value = field;
+    switch (key->type) {
+        case CFG_PATH:
+            if (strncmp(value, base_dir, base_len) == 0) {
+                value += base_len;
+            }
+            // fall through
+        case CFG_STRING:
+            if (*value == '\0') {
+                return ESP_OK;
+            }
+            if (!_quotable(value)) {
+                ESP_LOGE(CFG_TAG, "%s can not be written.", key->name);
+                return ESP_ERR_INVALID_ARG;
+            }
+            return fprintf(file, "%s = \"%s\"\n", key->name, value) < 0 ? ESP_FAIL : ESP_OK;
+        case CFG_UINT:
+            return fprintf(file, "%s = %u\n", key->name, (unsigned) *(const uint32_t *) field) < 0 ? ESP_FAIL : ESP_OK;
+        case CFG_ALARM:
+            for (uint32_t i = 0; i < config->n_alarms && i < CFG_MAX_ALARMS; i++) {
+                if (!_write_alarm(file, key->name, &config->alarms[i])) {
+                    return ESP_FAIL;
+                }
+            }
+            return ESP_OK;
+    }
+    return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t cfg_write(FILE *file, const char *base_dir, const struct alarm_config_t *config) {
+    for (size_t s = 0; s < sizeof(SECTIONS) / sizeof(SECTIONS[0]); s++) {
+        if (!SECTIONS[s]) {
+            continue;
+        }
+        if (fprintf(file, "[%s]\n", SECTIONS[s]) < 0) {
+            return ESP_FAIL;
+        }
+        for (size_t i = 0; i < sizeof(KEYS) / sizeof(KEYS[0]); i++) {
+            if (KEYS[i].section != s) {
+                continue;
+            }
+            esp_err_t ret = _write_key(file, &KEYS[i], base_dir, config);
+            if (ret != ESP_OK) {
+                return ret;
+            }
+        }
+    }
+    if (fputs(END_LINE, file) == EOF) {
+        return ESP_FAIL;
+    }
+    return ferror(file) ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t cfg_save(const char *path, const char *base_dir, const struct alarm_config_t *config) {
+    char tmp_path[CFG_PATH_LEN];
+    if (!_tmp_path(path, tmp_path, sizeof(tmp_path))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Finish an earlier interrupted save, so removing path below never
+    // drops the only complete copy.
+    _recover(path);
+    FILE *file = storage_fopen(tmp_path, "w");
+    if (!file) {
+        ESP_LOGE(CFG_TAG, "Failed to create %s.", tmp_path);
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t ret = cfg_write(file, base_dir, config);
+    if (ret == ESP_OK && storage_fsync(file) != 0) {
+        ret = ESP_FAIL;
+    }
+    if (fclose(file) != 0 && ret == ESP_OK) {
+        ret = ESP_FAIL;
+    }
+    if (ret != ESP_OK) {
+        storage_unlink(tmp_path);
+        ESP_LOGE(CFG_TAG, "Failed to write %s.", tmp_path);
+        return ret;
+    }
+
+    // FAT rename does not replace an existing file.
+    storage_unlink(path);
+    if (storage_rename(tmp_path, path) != 0) {
+        ESP_LOGE(CFG_TAG, "Failed to replace %s.", path);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(CFG_TAG, "Saved %s.", path);
+    return ESP_OK;
+}
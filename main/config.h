@@ -0,0 +1,94 @@
+#ifndef _ALARM_CONFIG_H
+#define _ALARM_CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "esp_err.h"
+
+#define CFG_LINE_LEN            160   // longer lines are skipped as malformed
+#define CFG_PATH_LEN            64
+#define CFG_SSID_LEN            33    // 32 characters and the terminator
+#define CFG_PASSWORD_LEN        65
+#define CFG_MAX_ALARMS          4
+#define CFG_DEFAULT_VOLUME      50    // percent, matches the audio default gain
+#define CFG_TMP_MARK            '~'   // replaces the last character of the path while saving
+
+// Day bits of alarm_time_t.days, Monday first.
+#define CFG_DAY(d)              (1u << (d))
+#define CFG_EVERY_DAY           0x7f
+
+struct alarm_time_t {
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t days;
+};
+
+/**
+ * Settings read from config.txt. Missing keys keep the defaults from
+ * cfg_defaults, so the parser never leaves a field undefined.
+ */
+struct alarm_config_t {
+    char audio_file[CFG_PATH_LEN];   // absolute, under the mount point
+    char ssid[CFG_SSID_LEN];         // empty if not configured
+    char password[CFG_PASSWORD_LEN];
+    uint32_t volume;                 // percent of unity gain, 0 - 200
+    uint32_t fade_in_s;
+    struct alarm_time_t alarms[CFG_MAX_ALARMS];
+    uint32_t n_alarms;
+    uint32_t errors;                 // malformed or unknown lines
+};
+
+void cfg_defaults(struct alarm_config_t *config);
+
+/**
+ * Fill config from a config.txt stream in one pass. The file has an
+ * optional bare audio file name on its first line and then sections:
+ *
+ *     alarm.mp3
+ *     [WiFi AP Credentials]
+ *     ssid = "network"
+ *     password = "secret"
+ *     [Audio]
+ *     volume = 80
+ *     fade_in = 30
+ *     [Alarm]
+ *     time = 07:30 Mon-Fri
+ *
+ * Values may be quoted, # and ; start comments. Bad lines are logged,
+ * counted in config->errors and skipped.
+ */
+void cfg_parse(FILE *file, const char *base_dir, struct alarm_config_t *config);
+
+/**
+ * cfg_defaults then cfg_parse of the file at path. A cfg_save interrupted
+ * between removing path and renaming its temporary file is completed
+ * first, one interrupted before its temporary file was complete is
+ * dropped.
+ *
+ * @return ESP_ERR_NOT_FOUND if the file can not be opened, config then
+ *         holds the defaults.
+ */
+esp_err_t cfg_load(const char *path, const char *base_dir, struct alarm_config_t *config);
+
+/**
+ * Write config in the sectioned format cfg_parse reads. Paths under
+ * base_dir are written relative to it, empty strings are left out. Ends
+ * with a comment line that tells cfg_load a complete file.
+ *
+ * @return ESP_ERR_INVALID_ARG for a value that can not be quoted.
+ */
+esp_err_t cfg_write(FILE *file, const char *base_dir, const struct alarm_config_t *config);
+
+/**
+ * Replace the file at path with config. The new file is written and
+ * synced under a temporary name (path ending in CFG_TMP_MARK) and then
+ * renamed over path, so a power loss leaves either the old or the new
+ * file. FAT rename does not replace, path is removed just before the
+ * rename and cfg_load recovers the temporary file if the power fails
+ * in between. A temporary file cut short is dropped instead.
+ */
+esp_err_t cfg_save(const char *path, const char *base_dir, const struct alarm_config_t *config);
+
+#endif // _ALARM_CONFIG_H
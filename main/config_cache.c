@@ -0,0 +1,139 @@
+#include "config_cache.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "freertos/FreeRTOS.h"
+
+#include "nvs_store.h"
+#include "storage.h"
+
+static const char *CACHE_TAG = "Config Cache";
+
+// Survives deep sleep, lost on power loss or reset.
+RTC_DATA_ATTR static struct cfg_snapshot_t RTC_SNAPSHOT;
+
+// Guards RTC_SNAPSHOT, readers never see a half written copy.
+static portMUX_TYPE LOCK = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t _crc(const struct cfg_snapshot_t *snapshot) {
+    return esp_rom_crc32_le(0, (const uint8_t *) snapshot, offsetof(struct cfg_snapshot_t, crc));
+}
+
+static bool _valid(const struct cfg_snapshot_t *snapshot) {
+    return snapshot->magic == CFG_CACHE_MAGIC &&
+        snapshot->version == CFG_CACHE_VERSION &&
+        snapshot->size == sizeof(*snapshot) &&
+        snapshot->crc == _crc(snapshot);
+}
+
+static esp_err_t _nvs_read(struct cfg_snapshot_t *snapshot) {
+    esp_err_t ret = nvs_store_read(CFG_CACHE_NAMESPACE, CFG_CACHE_KEY, snapshot, sizeof(*snapshot));
+    if (ret == ESP_OK && !_valid(snapshot)) {
+        ret = ESP_ERR_INVALID_CRC;
+    }
+    return ret;
+}
+
+esp_err_t cfg_cache_load(struct alarm_config_t *config) {
+    if (cfg_cache_get(config) != 0) {
+        ESP_LOGI(CACHE_TAG, "Using config from RTC memory.");
+        return ESP_OK;
+    }
+    struct cfg_snapshot_t snapshot;
+    esp_err_t ret = _nvs_read(&snapshot);
+    if (ret != ESP_OK) {
+        if (ret != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGW(CACHE_TAG, "No usable config in NVS (%s).", esp_err_to_name(ret));
+        }
+        return ESP_ERR_NOT_FOUND;
+    }
+    portENTER_CRITICAL(&LOCK);
+    memcpy(&RTC_SNAPSHOT, &snapshot, sizeof(snapshot));
+    portEXIT_CRITICAL(&LOCK);
+    *config = snapshot.config;
+    ESP_LOGI(CACHE_TAG, "Using config from NVS.");
+    return ESP_OK;
+}
+
+esp_err_t cfg_cache_store(const struct alarm_config_t *config, const char *src_path) {
+    struct stat st;
+    if (storage_stat(src_path, &st) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    struct cfg_snapshot_t snapshot;
+    // Zero the padding too, it is part of the crc and of the NVS compare.
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.magic = CFG_CACHE_MAGIC;
+    snapshot.version = CFG_CACHE_VERSION;
+    snapshot.size = sizeof(snapshot);
+    snapshot.src_size = (uint32_t) st.st_size;
+    snapshot.src_mtime = (uint32_t) st.st_mtime;
+    memcpy(&snapshot.config, config, sizeof(*config));
+
+    struct cfg_snapshot_t stored;
+    const bool have_stored = _nvs_read(&stored) == ESP_OK;
+    portENTER_CRITICAL(&LOCK);
+    const struct cfg_snapshot_t *previous = _valid(&RTC_SNAPSHOT) ? &RTC_SNAPSHOT : have_stored ? &stored : NULL;
+    snapshot.generation = !previous ? 1 :
+        previous->generation + (memcmp(&previous->config, &snapshot.config, sizeof(snapshot.config)) != 0);
+    snapshot.crc = _crc(&snapshot);
+    memcpy(&RTC_SNAPSHOT, &snapshot, sizeof(snapshot));
+    portEXIT_CRITICAL(&LOCK);
+
+    // Flash wears, only write when the stored copy is out of date.
+    if (have_stored && memcmp(&stored, &snapshot, sizeof(snapshot)) == 0) {
+        return ESP_OK;
+    }
+    esp_err_t ret = nvs_store_write(CFG_CACHE_NAMESPACE, CFG_CACHE_KEY, &snapshot, sizeof(snapshot));
+    if (ret != ESP_OK) {
+        ESP_LOGW(CACHE_TAG, "Failed to store config in NVS (%s).", esp_err_to_name(ret));
+    } else {
+        ESP_LOGI(CACHE_TAG, "Stored config in NVS.");
+    }
+    return ret;
+}
+
+bool cfg_cache_is_current(const char *src_path) {
+    struct stat st;
+    if (storage_stat(src_path, &st) != 0) {
+        return false;
+    }
+    portENTER_CRITICAL(&LOCK);
+    bool current = _valid(&RTC_SNAPSHOT) &&
+        RTC_SNAPSHOT.src_size == (uint32_t) st.st_size &&
+        RTC_SNAPSHOT.src_mtime == (uint32_t) st.st_mtime;
+    portEXIT_CRITICAL(&LOCK);
+    return current;
+}
+
+esp_err_t cfg_cache_update(const struct alarm_config_t *config, const char *path, const char *base_dir) {
+    esp_err_t ret = cfg_save(path, base_dir, config);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    return cfg_cache_store(config, path);
+}
+
+uint32_t cfg_cache_get(struct alarm_config_t *config) {
+    uint32_t generation = 0;
+    portENTER_CRITICAL(&LOCK);
+    if (_valid(&RTC_SNAPSHOT)) {
+        memcpy(config, &RTC_SNAPSHOT.config, sizeof(*config));
+        generation = RTC_SNAPSHOT.generation;
+    }
+    portEXIT_CRITICAL(&LOCK);
+    return generation;
+}
+
+uint32_t cfg_cache_generation(void) {
+    portENTER_CRITICAL(&LOCK);
+    uint32_t generation = _valid(&RTC_SNAPSHOT) ? RTC_SNAPSHOT.generation : 0;
+    portEXIT_CRITICAL(&LOCK);
+    return generation;
+}
@@ -0,0 +1,76 @@
+#ifndef _CONFIG_CACHE_H
+#define _CONFIG_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "config.h"
+
+#define CFG_CACHE_MAGIC         0x47464341  // "ACFG"
+#define CFG_CACHE_VERSION       2
+#define CFG_CACHE_NAMESPACE     "alarm_cfg"
+#define CFG_CACHE_KEY           "snapshot"
+
+/**
+ * Parsed config as stored in RTC slow memory and NVS. src_size and
+ * src_mtime identify the config.txt it was parsed from, generation counts
+ * the changes of config, crc covers every field before it.
+ */
+struct cfg_snapshot_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+    uint32_t src_size;
+    uint32_t src_mtime;
+    uint32_t generation;
+    struct alarm_config_t config;
+    uint32_t crc;
+};
+
+/**
+ * Restore the last stored config, from RTC memory if it survived deep
+ * sleep and from NVS otherwise. Neither needs the SD card.
+ *
+ * @return ESP_ERR_NOT_FOUND if there is no valid snapshot, config is then
+ *         left unchanged.
+ */
+esp_err_t cfg_cache_load(struct alarm_config_t *config);
+
+/**
+ * Store config as parsed from the file at src_path in RTC memory and, if
+ * it differs from the stored copy, in NVS. The generation moves on when
+ * config changed.
+ */
+esp_err_t cfg_cache_store(const struct alarm_config_t *config, const char *src_path);
+
+/**
+ * Save config to path with cfg_save, then store it. Nothing is stored if
+ * the file could not be written, so the snapshot never runs ahead of the
+ * card.
+ */
+esp_err_t cfg_cache_update(const struct alarm_config_t *config, const char *path, const char *base_dir);
+
+/**
+ * Copy the stored config, safe against a concurrent store.
+ *
+ * @return its generation, 0 if there is no snapshot and config is left
+ *         unchanged.
+ */
+uint32_t cfg_cache_get(struct alarm_config_t *config);
+
+/**
+ * @return the generation of the stored config, 0 if there is none. A
+ *         reader that kept the last value knows the config changed
+ *         without reading it again.
+ */
+uint32_t cfg_cache_generation(void);
+
+/**
+ * @return true if the snapshot was parsed from the current src_path, i.e.
+ *         its size and mtime did not change.
+ */
+bool cfg_cache_is_current(const char *src_path);
+
+#endif // _CONFIG_CACHE_H
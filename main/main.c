@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <sys/unistd.h>
@@ -8,14 +9,17 @@
 #include "esp_err.h"
 #include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 // SD card includes
 #include "freertos/portmacro.h"
 #include "freertos/FreeRTOSConfig.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
 #include "freertos/projdefs.h"
 #include "sdkconfig.h"
+#include "esp_attr.h"
 #include "esp_sleep.h"
 #include "hal/adc_types.h"
 #include "driver/adc.h"
@@ -25,6 +29,8 @@
 
 #include "voltage_types.h"
 #include "voltage.h"
+#include "battery.h"
+#include "charge.h"
 
 #include "wifi_controller.h"
 
@@ -36,7 +42,7 @@ static const struct aud_i2s_config_t audio_conf = {
 };
 
 static const struct voltage_read_config_t voltage_conf = {
-    .channel = ADC_CHANNEL_6,
+    .channel = ADC_CHANNEL_6,  // also sampled by the ULP in deep sleep, see ULP_BATTERY_CHANNEL
     .width = ADC_WIDTH_BIT_12,
     .atten = ADC_ATTEN_DB_12,
     .unit = ADC_UNIT_1,
@@ -49,6 +55,15 @@ static const struct voltage_read_config_t voltage_conf = {
 
 #include "ulp_controller.h"
 #include "audio.h"
+#include "audio_library.h"
+#include "boot.h"
+#include "config.h"
+#include "config_cache.h"
+#include "event_log.h"
+#include "flash_alarm.h"
+#include "input.h"
+#include "nvs_store.h"
+#include "pcm_process.h"
 #include "storage.h"
 
 #define GPIO_AUDIO_CONTROL   39
@@ -58,91 +73,282 @@ static const struct voltage_read_config_t voltage_conf = {
 #define GPIO_PERIPHERAL_POWER  18
 #define GPIO_OUTPUT_PIN_SEL (1ULL << GPIO_PERIPHERAL_POWER)
 
+// Boot stage bits, see boot.h.
+#define BOOT_BATTERY         (1 << 0)
+#define BOOT_AUDIO           (1 << 1)
+#define BOOT_CREDENTIALS     (1 << 2)  // ap_ssid and ap_password are final
+#define BOOT_CONFIG          (1 << 3)
+#define BOOT_WIFI            (1 << 4)
+#define BOOT_FALLBACK        (1 << 5)
+#define BOOT_ALL             (BOOT_BATTERY | BOOT_AUDIO | BOOT_CREDENTIALS | BOOT_CONFIG | BOOT_WIFI | BOOT_FALLBACK)
+#define EVENT_LOG_FILE       "/events.log"
+
+#define BOOT_STAGE_STACK     4096
+#define BOOT_STAGE_PRIORITY  5
+#define BOOT_TIMEOUT_MS      10000
+
+#define DEMO_STEPS           7
+#define DEMO_QUEUE_LEN       4
+#define DEMO_STACK           4096
+#define DEMO_PRIORITY        5
+
 const char* MAIN_TAG = "MAIN";
 
-static bool has_sd_card           = true;
 static bool alarm_played          = false;
-static TaskHandle_t *audio_handle = NULL;
+static struct alarm_config_t config;
+static bool config_checked        = false;
+static esp_sleep_wakeup_cause_t wakeup_cause;
+static QueueHandle_t demo_steps   = NULL;
 
-enum {
-    PLAYING = 0,
-    PAUSED,
-    NOT_PLAYING,
-    UNKNOWN
-};
+// Copied out of config for the wifi stage, config may still be reparsed.
+static char ap_ssid[CFG_SSID_LEN];
+static char ap_password[CFG_PASSWORD_LEN];
 
-void monitor_audio_toggle(void* filename) {
-    uint32_t current_lvl = 0;
-    uint32_t prev_lvl = 0;
-    uint32_t audio_state = UNKNOWN;
+// Time the last cold boot spent mounting the card and reading the config.
+RTC_DATA_ATTR static int32_t storage_boot_us = 0;
 
-    uint32_t count = 0;
-    while (1) {
-        current_lvl = gpio_get_level(GPIO_AUDIO_CONTROL);
-        if ((prev_lvl == 1) && (current_lvl == 0)) {
-            switch (count % 7) {
-                case 0:
-                    aud_play_sine(1);
-                    break;
-                case 1:
-                    aud_pause();
-                    break;
-                case 2:
-                    aud_resume();
-                    break;
-                case 3:
-                    aud_play_mp3(filename);
-                    break;
-                case 4:
-                    aud_pause();
-                    break;
-                case 5:
-                    aud_resume();
-                    break;
-                case 6:
-                    aud_stop();
-                    break;
+static uint32_t _min_u32(uint32_t x, uint32_t y) {
+    return x < y ? x : y;
+}
+
+static void _apply_config(void) {
+    aud_set_gain(_min_u32(config.volume * PCM_UNITY_GAIN / 100, PCM_MAX_GAIN));
+    aud_set_fade_in(config.fade_in_s * 1000);
+}
+
+/**
+ * Mount the SD card on first use. The first time the card is mounted the
+ * config snapshot is checked against config.txt, which is only parsed if
+ * it changed since the snapshot was taken.
+ */
+static bool _ensure_storage(void) {
+    if (!storage_is_mounted()) {
+        esp_err_t ret = set_up_storage();
+        evlog_add(EVLOG_SD, ret == ESP_OK, (uint32_t) ret);
+        if (ret != ESP_OK) {
+            return false;
+        }
+    }
+    if (!config_checked) {
+        config_checked = true;
+        if (!cfg_cache_is_current(MOUNT_POINT CONFIG_FILE)) {
+            if (cfg_load(MOUNT_POINT CONFIG_FILE, MOUNT_POINT "/", &config) != ESP_OK) {
+                ESP_LOGE(MAIN_TAG, "Failed to read config file, using defaults.");
+            } else {
+                cfg_cache_store(&config, MOUNT_POINT CONFIG_FILE);
             }
-            count++;
+            // WiFi credentials only take effect on the next boot.
+            _apply_config();
         }
-        prev_lvl = current_lvl;
-        vTaskDelay(10);
     }
-    free(audio_handle);
-    audio_handle = NULL;
+    return true;
 }
 
-bool check_mp3_suffix(char* filename) {
-    int counter = 0;
-    while (*filename != '\0') {
-        if (counter == 128) {
-            return false;
-        }
-        filename++;
-        counter++;
+static void _on_battery_level(enum battery_level_t level, uint32_t mv, void *unused) {
+    ESP_LOGW(MAIN_TAG, "Battery level %d at %u mV.", level, (unsigned) mv);
+    evlog_add(EVLOG_BATTERY, level, mv);
+}
+
+static void _boot_battery(void) {
+    esp_err_t ret = adc_config(&voltage_conf);
+    if (ret != ESP_OK) {
+        ESP_LOGE(MAIN_TAG, "Unable to configure battery voltage readings. Invalid configuration arguements.");
+        return;
+    }
+    // Samples taken while audio plays are corrected for the sag.
+    battery_set_load_probe(aud_is_playing);
+    struct voltage_history_t history;
+    const bool slept = read_ulp_battery(&history);
+    ret = battery_start(&voltage_conf, slept ? &history : NULL, _on_battery_level, NULL);
+    if (ret != ESP_OK) {
+        ESP_LOGE(MAIN_TAG, "Failed to start battery sampling (%s).", esp_err_to_name(ret));
+    }
+    charge_init();
+    struct charge_estimate_t estimate;
+    charge_get(&estimate);
+    ESP_LOGI(MAIN_TAG, "Battery %u.%u%% at %u mV, about %u wakes or %u s of playback left (0 while learning).",
+             (unsigned) estimate.permille / 10, (unsigned) estimate.permille % 10, (unsigned) estimate.rest_mv,
+             (unsigned) estimate.wakes_left, (unsigned) estimate.play_s_left);
+    // Levels other than OK were already logged by the callback.
+    struct battery_state_t battery;
+    battery_get(&battery);
+    if (slept) {
+        ESP_LOGI(MAIN_TAG, "%u battery samples in deep sleep, lowest %u mV.",
+                 (unsigned) history.n_samples, (unsigned) battery.sleep_min_mv);
+    }
+    if (battery.level == BATTERY_OK) {
+        evlog_add(EVLOG_BATTERY, BATTERY_OK, battery.mv);
+    }
+}
+
+static void _boot_audio(void) {
+    aud_err_t aud_err = aud_init(&audio_conf);
+    if (aud_err != AUD_OKAY) {
+        ESP_LOGW(MAIN_TAG, "Failed to setup audio interface.");
     }
-    return *(filename - 4) == '.' &&
-        *(filename - 3) == 'm' &&
-        *(filename - 2) == 'p' &&
-        *(filename - 1) == '3';
 }
 
-void check_button_input(void* unused) {
-    uint32_t current_lvl = 0;
-    uint32_t prev_lvl = 0;
+static void _publish_credentials(void) {
+    strcpy(ap_ssid, config.ssid);
+    strcpy(ap_password, config.password);
+    boot_signal(BOOT_CREDENTIALS);
+}
+
+/**
+ * After a deep sleep wake the card is only mounted once audio needs it,
+ * a cold boot checks it straight away as the card may have been edited.
+ * Cached credentials are released to the wifi stage before the card is
+ * touched.
+ */
+static void _boot_config(void) {
+    cfg_defaults(&config);
+    bool cached = cfg_cache_load(&config) == ESP_OK;
+    if (cached) {
+        _publish_credentials();
+    }
+    if (cached && wakeup_cause != ESP_SLEEP_WAKEUP_UNDEFINED) {
+        ESP_LOGI(MAIN_TAG, "Using config snapshot, SD card mount deferred (took %d us on cold boot).",
+                 storage_boot_us);
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    if (!_ensure_storage()) {
+        ESP_LOGW(MAIN_TAG, "Failed to mount storage device. Continuing without storage...");
+    }
+    storage_boot_us = (int32_t) (esp_timer_get_time() - start);
+    if (!cached) {
+        _publish_credentials();
+    }
+}
+
+/**
+ * Refresh the flash copy of the alarm, played when the card is missing,
+ * and the library of sounds on the card. Only runs when config already
+ * mounted the card, a wake that deferred the mount keeps the previous
+ * copy and probes the alarm when it plays. The scan goes through the
+ * audio component, which keeps playback from probing at the same time.
+ */
+static void _boot_fallback(void) {
+    if (!storage_is_mounted()) {
+        return;
+    }
+    if (config.audio_file[0] != '\0') {
+        flash_alarm_update(config.audio_file);
+    }
+    if (aud_scan_library(MOUNT_POINT) == AUD_OKAY && config.audio_file[0] != '\0' &&
+        !aud_lib_find(config.audio_file)) {
+        ESP_LOGW(MAIN_TAG, "%s is not a playable sound.", config.audio_file);
+    }
+}
+
+static void _boot_wifi(void) {
+    if (ap_ssid[0] != '\0') {
+        wc_start_webserver(ap_ssid, ap_password);
+    } else {
+        ESP_LOGW(MAIN_TAG, "No AP credentials configured.");
+    }
+}
+
+/**
+ * One step of a demo of the audio api.
+ */
+static void _audio_demo_step(uint32_t step, char *filename) {
+    switch (step) {
+        case 0:
+            aud_play_sine(441);
+            break;
+        case 1:
+            aud_pause();
+            break;
+        case 2:
+            aud_resume();
+            break;
+        case 3:
+            // The library and the config are settled once the fallback
+            // stage is done, the card is only mounted after that.
+            boot_wait(BOOT_FALLBACK, portMAX_DELAY);
+            if (_ensure_storage()) {
+                evlog_add(EVLOG_ALARM, 0, 0);
+                aud_play_mp3(filename);
+            } else {
+                ESP_LOGW(MAIN_TAG, "No storage, playing the alarm from flash.");
+                evlog_add(EVLOG_ALARM, 0, 1);
+                aud_play_flash_alarm();
+            }
+            break;
+        case 4:
+            aud_pause();
+            break;
+        case 5:
+            aud_resume();
+            break;
+        case 6:
+            aud_stop();
+            break;
+    }
+}
+
+/**
+ * Runs the steps queued by the audio button. Playing from the card may
+ * mount it and read the config first, which would hold up the power
+ * button on the input task.
+ */
+static void _audio_demo_task(void *filename) {
+    uint32_t step;
     while (1) {
-        current_lvl = gpio_get_level(GPIO_RTC_SWITCH);
-        if ((prev_lvl == 1) && (current_lvl == 0)) {
-            free(audio_handle);
-            esp_sleep_enable_ext0_wakeup(GPIO_RTC_SWITCH, 1);
-            shut_down_storage();
-            esp_deep_sleep_start();
+        if (xQueueReceive(demo_steps, &step, portMAX_DELAY) == pdTRUE) {
+            _audio_demo_step(step, filename);
         }
-        prev_lvl = current_lvl;
-        vTaskDelay(10);
     }
 }
 
+/**
+ * Each click of the audio button queues the next step of the demo.
+ */
+static void _on_audio_button(const struct input_event_t *event, void *unused) {
+    static uint32_t count = 0;
+    const uint32_t step = count % DEMO_STEPS;
+    evlog_add(EVLOG_BUTTON, 1, step);
+    if (xQueueSend(demo_steps, &step, 0) != pdTRUE) {
+        ESP_LOGW(MAIN_TAG, "Audio demo busy, click ignored.");
+        return;
+    }
+    count++;
+}
+
+/**
+ * Flush what is kept of this wake, hand the button and the battery to
+ * the ULP and sleep until a gesture or the next battery level. Without
+ * count_wake the wake is left out of the charge history, its use counts
+ * towards the next one.
+ */
+static void _deep_sleep(bool count_wake) {
+    // Unwritten events stay in RTC memory if the card is not mounted.
+    if (storage_is_mounted()) {
+        evlog_flush(1000);
+    }
+    shut_down_storage();
+    input_log_stats();
+    if (count_wake) {
+        struct aud_cpu_stats_t audio_stats;
+        aud_get_cpu_stats(&audio_stats);
+        charge_end_wake((uint32_t) (audio_stats.active_us / 1000));
+    }
+    battery_stop();
+    const uint32_t wake_mv = battery_wake_mv();
+    arm_ulp_battery(wake_mv ? voltage_to_raw(&voltage_conf, wake_mv) : 0);
+    if (init_ulp() != ESP_OK) {
+        ESP_LOGW(MAIN_TAG, "ULP not running, waking on any press.");
+        esp_sleep_enable_ext0_wakeup(GPIO_RTC_SWITCH, 1);
+    }
+    esp_deep_sleep_start();
+}
+
+static void _on_power_button(const struct input_event_t *event, void *unused) {
+    evlog_add(EVLOG_BUTTON, 0, 0);
+    _deep_sleep(true);
+}
+
 void app_main(void)
 {
     ESP_LOGI(MAIN_TAG, "Configuring power button.");
@@ -164,84 +370,86 @@ void app_main(void)
     peripheral_io_conf.pull_up_en    = 0;
 
     esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
-    if (cause != ESP_SLEEP_WAKEUP_ULP) {
-        ESP_LOGI(MAIN_TAG, "Not ULP wakeup, initializing ULP");
-//        init_ulp();
-    } 
+    pause_ulp();
+    // Once, before the charge history, the config cache and wifi use it
+    // from their boot stages.
+    esp_err_t ret = nvs_store_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(MAIN_TAG, "Failed to initialise NVS (%s), nothing is cached.", esp_err_to_name(ret));
+    }
+    if (cause == ESP_SLEEP_WAKEUP_ULP && ulp_woke_for_battery()) {
+        // Only the battery level changed, log it and sleep again without
+        // powering the peripherals. Not a wake the charge history learns
+        // from, it would read as a quiet wake using next to nothing.
+        evlog_add(EVLOG_BOOT, 0, cause);
+        _boot_battery();
+        _deep_sleep(false);
+    }
+    struct ulp_button_t wake_button;
+    if (cause == ESP_SLEEP_WAKEUP_ULP && read_ulp_button(&wake_button)) {
+        ESP_LOGI(MAIN_TAG, "Woken by %u presses%s.", (unsigned) wake_button.presses,
+                 wake_button.long_press ? " and a long press" : "");
+        evlog_add(EVLOG_BUTTON, 0, wake_button.presses | (wake_button.long_press ? EVLOG_LONG_PRESS : 0));
+    }
 
     gpio_config(&power_io_conf);
     gpio_config(&peripheral_io_conf);
     gpio_set_level(GPIO_PERIPHERAL_POWER, 1);
 
-    esp_err_t ret;
-
-    ret = adc_config(&voltage_conf);
-    if (ret != ESP_OK) {
-        ESP_LOGE(MAIN_TAG, "Unable to configure battery voltage readings. Invalid configuration arguements.");
+    wakeup_cause = cause;
+    evlog_add(EVLOG_BOOT, 0, cause);
+    evlog_init(MOUNT_POINT EVENT_LOG_FILE);
+    // Audio on PRO_CPU, where the output task waits on the i2s interrupt
+    // that aud_init allocates on its own core.
+    static const struct boot_stage_t stages[] = {
+        {"battery", _boot_battery, 0, BOOT_BATTERY, BOOT_STAGE_STACK, BOOT_STAGE_PRIORITY, tskNO_AFFINITY},
+        {"audio", _boot_audio, 0, BOOT_AUDIO, BOOT_STAGE_STACK, BOOT_STAGE_PRIORITY, PRO_CPU_NUM},
+        {"config", _boot_config, 0, BOOT_CONFIG, BOOT_STAGE_STACK, BOOT_STAGE_PRIORITY, tskNO_AFFINITY},
+        {"wifi", _boot_wifi, BOOT_CREDENTIALS, BOOT_WIFI, BOOT_STAGE_STACK, BOOT_STAGE_PRIORITY, tskNO_AFFINITY},
+        {"fallback", _boot_fallback, BOOT_AUDIO | BOOT_CONFIG, BOOT_FALLBACK, BOOT_STAGE_STACK, BOOT_STAGE_PRIORITY,
+         tskNO_AFFINITY},
+    };
+    ESP_ERROR_CHECK(boot_start(stages, sizeof(stages) / sizeof(stages[0])));
+
+    // The alarm can sound as soon as audio and its settings are in place,
+    // wifi keeps associating in the background.
+    boot_wait(BOOT_AUDIO | BOOT_CONFIG, portMAX_DELAY);
+    _apply_config();
+    ESP_LOGI(MAIN_TAG, "Audio ready at %d us.", (int) esp_timer_get_time());
+
+#if CONFIG_SD_BENCHMARK
+    if (_ensure_storage()) {
+        storage_benchmark(config.audio_file);
     }
-    uint32_t voltage = 0;
-    read_voltage(&voltage_conf, &voltage);
-    printf("voltage: %d\n", voltage);
-
-    ret = set_up_storage();
-    if (ret != ESP_OK) {
-        ESP_LOGW(MAIN_TAG, "Failed to mount storage device. Continuing without storage...");
-        has_sd_card = false;
+#endif
+
+    // A click of the power button powers off. Not a long press, the ULP
+    // would take the button still held for the next one. The press that
+    // woke us is ignored until released.
+    ESP_LOGI(MAIN_TAG, "Starting button input.");
+    input_add_pin(GPIO_RTC_SWITCH, true);
+    input_add_pin(GPIO_AUDIO_CONTROL, true);
+    input_subscribe(GPIO_RTC_SWITCH, INPUT_GESTURE(INPUT_CLICK), _on_power_button, NULL);
+    demo_steps = xQueueCreate(DEMO_QUEUE_LEN, sizeof(uint32_t));
+    if (demo_steps && xTaskCreate(_audio_demo_task, "audio_demo", DEMO_STACK, config.audio_file, DEMO_PRIORITY,
+                                  NULL) == pdPASS) {
+        input_subscribe(GPIO_AUDIO_CONTROL, INPUT_GESTURE(INPUT_CLICK), _on_audio_button, NULL);
+    } else {
+        ESP_LOGE(MAIN_TAG, "Failed to start the audio demo, audio button disabled.");
     }
-
-    aud_err_t aud_err = aud_init(&audio_conf);
-    if (aud_err != AUD_OKAY) {
-        ESP_LOGW(MAIN_TAG, "Failed to setup audio interface.");
+    ESP_ERROR_CHECK(input_start());
+    if (!boot_wait(BOOT_ALL, pdMS_TO_TICKS(BOOT_TIMEOUT_MS))) {
+        ESP_LOGW(MAIN_TAG, "Boot stages still running after %d ms.", BOOT_TIMEOUT_MS);
     }
-    int err = 0;
-    char* audio_filename = (char*) calloc(32, sizeof(char));
-    strcpy(audio_filename, MOUNT_POINT"/");
-
-    char *ssid = NULL;
-    char *password = NULL;
-
-    if (has_sd_card) {
-        FILE *config_file = fopen(MOUNT_POINT CONFIG_FILE, "r");
-        if (config_file == NULL) {
-            ESP_LOGE(MAIN_TAG, "Failed to config file for reading");
-        }
-        fgets(audio_filename + strlen(audio_filename), 32, config_file);
-        fclose(config_file);
-        
-        esp_err_t err = get_ap_credentials(MOUNT_POINT CONFIG_FILE, &ssid, &password);
-
-        if (!err == ESP_OK) {
-            ESP_LOGE(MAIN_TAG, "Failed to extract AP credentials.");
-            free(ssid);
-            free(password);
-        };
-        ESP_LOGI(MAIN_TAG, "Config File Read.");
-        ESP_LOG_BUFFER_CHAR(MAIN_TAG, audio_filename, 32);
-    }
-
-    wc_start_webserver(ssid, password);
-    audio_handle = malloc(sizeof(TaskHandle_t));
-
-    ESP_LOGI(MAIN_TAG, "Starting deep sleep button listener.");
-    TaskHandle_t button_handle = NULL; 
-    err = xTaskCreate(
-            check_button_input,
-            "Button checker",
-            2048,
-            &err,
-            24,
-            &button_handle
-            );
-    ESP_LOGI(MAIN_TAG, "Starting audio button listener.");
-    TaskHandle_t audio_toggle = NULL; 
-    err = xTaskCreate(
-            monitor_audio_toggle,
-            "Audio Toggle checker",
-            2048,
-            audio_filename,
-            24,
-            &audio_toggle
-            );
+    boot_log_timeline();
+#if CONFIG_AUDIO_SWAP_STRESS
+    // Debug builds only, a leak in any source shows as a shrinking heap.
+    // Wifi and its server allocate while they start, so only once up.
+    boot_wait(BOOT_WIFI, portMAX_DELAY);
+    if (aud_swap_stress(config.audio_file, CONFIG_AUDIO_SWAP_STRESS) != AUD_OKAY) {
+        ESP_LOGE(MAIN_TAG, "Swap stress failed, an audio source may leak.");
+    }
+#endif
     while (1) {
         vTaskDelay(1000 / portTICK_RATE_MS);
     }
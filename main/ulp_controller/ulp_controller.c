@@ -8,8 +8,12 @@
 #include "soc/rtc_cntl_reg.h"
 #include "soc/sens_reg.h"
 #include "soc/rtc_periph.h"
+#include "driver/adc.h"
 #include "driver/gpio.h"
 #include "driver/rtc_io.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
 
 #include "esp32/ulp.h"
 #include "ulp_main.h"
@@ -19,36 +23,107 @@
 extern const uint8_t ulp_main_bin_start[] asm("_binary_ulp_main_bin_start");
 extern const uint8_t ulp_main_bin_end[]   asm("_binary_ulp_main_bin_end");
 
-void init_ulp() {
+#define BATTERY_DIVIDER     (CONFIG_ULP_BATTERY_PERIOD_S * 1000000 / ULP_PERIOD_US)
+
+static const char *ULP_TAG = "ULP";
+
+// RTC slow memory holds no program after a cold boot.
+RTC_DATA_ATTR static bool LOADED = false;
+
+static esp_err_t _load(void) {
+    if (LOADED) {
+        return ESP_OK;
+    }
     esp_err_t err = ulp_load_binary(0, ulp_main_bin_start,
             (ulp_main_bin_end - ulp_main_bin_start) / sizeof(uint32_t));
-    ESP_ERROR_CHECK(err);
+    LOADED = err == ESP_OK;
+    return err;
+}
+
+esp_err_t init_ulp(void) {
+    esp_err_t err = _load();
+    if (err != ESP_OK) {
+        ESP_LOGE(ULP_TAG, "Failed to load the ULP program (%s).", esp_err_to_name(err));
+        return err;
+    }
 
-    /* GPIO used for pulse counting. */
     gpio_num_t gpio_num = GPIO_RTC_SWITCH;
     int rtcio_num = rtc_io_number_get(GPIO_RTC_SWITCH);
 
     ulp_io_switch_number = rtcio_num; /* map from GPIO# to RTC_IO# */
-    ulp_io_switch_state = 0;
+    ulp_button_level = 0;
+    ulp_button_debounce = 0;
+    ulp_button_presses = 0;
+    ulp_button_long = 0;
+    ulp_button_woke = 0;
+    ulp_button_long_runs = CONFIG_ULP_BUTTON_LONG_MS * 1000 / ULP_PERIOD_US;
+    ulp_button_gap_runs = CONFIG_ULP_BUTTON_GAP_MS * 1000 / ULP_PERIOD_US;
+    ulp_button_wake_presses = CONFIG_ULP_BUTTON_WAKE_PRESSES;
 
-    printf("ULP Wake Up GPIO: %d, RTC_IO: %d\n", gpio_num, rtcio_num);
+    ESP_LOGI(ULP_TAG, "Wake up GPIO: %d, RTC_IO: %d", gpio_num, rtcio_num);
 
     /* Initialize selected GPIO as RTC IO, enable input, disable pullup and pulldown */
     rtc_gpio_init(gpio_num);
     rtc_gpio_set_direction(gpio_num, RTC_GPIO_MODE_INPUT_ONLY);
     rtc_gpio_pulldown_dis(gpio_num);
     rtc_gpio_pullup_dis(gpio_num);
-    rtc_gpio_hold_en(gpio_num);
-    rtc_gpio_isolate(gpio_num);
 
     rtc_gpio_isolate(GPIO_NUM_12);
     rtc_gpio_isolate(GPIO_NUM_15);
 
     esp_deep_sleep_disable_rom_logging(); // suppress boot messages
 
-    ulp_set_wakeup_period(0, 20000);
+    ulp_set_wakeup_period(0, ULP_PERIOD_US);
+    err = esp_sleep_enable_ulp_wakeup();
+    if (err != ESP_OK) {
+        return err;
+    }
 
     /* Start the program */
-    err = ulp_run(&ulp_entry - RTC_SLOW_MEM);
-    ESP_ERROR_CHECK(err);
+    return ulp_run(&ulp_entry - RTC_SLOW_MEM);
+}
+
+void pause_ulp(void) {
+    CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_ULP_CP_SLP_TIMER_EN);
+}
+
+bool read_ulp_battery(struct voltage_history_t *history) {
+    if (!LOADED) {
+        return false;
+    }
+    // Only the low 16 bits of each word are written by the ULP.
+    history->n_samples = ulp_battery_count & UINT16_MAX;
+    history->min_raw = ulp_battery_min & UINT16_MAX;
+    history->avg_raw_q4 = ulp_battery_avg & UINT16_MAX;
+    history->last_raw = ulp_battery_last & UINT16_MAX;
+    ulp_battery_count = 0;
+    ulp_battery_woke = 0;
+    return history->n_samples > 0;
+}
+
+bool ulp_woke_for_battery(void) {
+    return LOADED && (ulp_battery_woke & UINT16_MAX) != 0;
+}
+
+bool read_ulp_button(struct ulp_button_t *button) {
+    if (!LOADED || (ulp_button_woke & UINT16_MAX) == 0) {
+        return false;
+    }
+    button->presses = ulp_button_presses & UINT16_MAX;
+    button->long_press = (ulp_button_long & UINT16_MAX) != 0;
+    ulp_button_woke = 0;
+    return true;
+}
+
+esp_err_t arm_ulp_battery(uint32_t wake_raw) {
+    esp_err_t err = _load();
+    if (err != ESP_OK) {
+        return err;
+    }
+    ulp_battery_divider = BATTERY_DIVIDER;
+    // The first sample a period in, once the cell recovered from the load.
+    ulp_battery_countdown = BATTERY_DIVIDER;
+    ulp_battery_wake_raw = wake_raw;
+    adc1_ulp_enable();
+    return ESP_OK;
 }
@@ -1,8 +1,72 @@
 #ifndef _ULP_H
 #define _ULP_H
 
+// Also included by ulp_controller.S, keep C below __ASSEMBLER__.
+
 #define GPIO_RTC_SWITCH 35
 
-void init_ulp(void);
+#define ULP_PERIOD_US                   20000  // between runs of the ULP program in deep sleep
+#define ULP_BATTERY_CHANNEL             6      // ADC1 channel of the battery divider
+#define ULP_BATTERY_OVERSAMPLE          4      // conversions averaged per sample
+#define ULP_BATTERY_OVERSAMPLE_SHIFT    2
+#define ULP_BUTTON_DEBOUNCE             2      // runs a new switch level must hold
+
+#ifndef __ASSEMBLER__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "voltage_types.h"
+
+/**
+ * Wake gesture on the switch, debounced by the ULP.
+ */
+struct ulp_button_t {
+    uint32_t presses;         // short presses before the gesture ended
+    bool long_press;          // held for CONFIG_ULP_BUTTON_LONG_MS, still held at wake
+};
+
+/**
+ * Hand the switch to the ULP and start the program, which then wakes the
+ * CPU for button gestures and for the battery (see arm_ulp_battery).
+ * Call last before deep sleep.
+ */
+esp_err_t init_ulp(void);
+
+/**
+ * Stop the ULP timer while the CPU is awake, the ULP and the battery
+ * sampler share ADC1. Call early at boot.
+ */
+void pause_ulp(void);
+
+/**
+ * Take the battery samples the ULP collected in the last deep sleep and
+ * clear them for the next one.
+ *
+ * @return false if there are none, e.g. after a cold boot.
+ */
+bool read_ulp_battery(struct voltage_history_t *history);
+
+/**
+ * @return true if the ULP woke the CPU because the battery fell below
+ *         the threshold given to arm_ulp_battery.
+ */
+bool ulp_woke_for_battery(void);
+
+/**
+ * @return true if a gesture woke the CPU, button then holds it. Cleared
+ *         by the read.
+ */
+bool read_ulp_button(struct ulp_button_t *button);
+
+/**
+ * Sample the battery every CONFIG_ULP_BATTERY_PERIOD_S in deep sleep and
+ * wake the CPU once the average reads below wake_raw, 0 to never wake.
+ * Hands ADC1 to the ULP, call just before init_ulp.
+ */
+esp_err_t arm_ulp_battery(uint32_t wake_raw);
+
+#endif // __ASSEMBLER__
 
 #endif
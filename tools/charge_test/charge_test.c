@@ -0,0 +1,231 @@
+/**
+ * Replays a battery trace through the charge estimator of
+ * components/voltage on Linux, one resting voltage and playback time per
+ * wake, and checks the discharge curve and what was learnt.
+ *
+ * Build from the repository root, or with make -C tools check:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -o charge_test -Itools/storage_bench/host \
+ *       -Icomponents/voltage -Icomponents/nvs_store \
+ *       tools/charge_test/charge_test.c components/voltage/charge.c
+ *
+ * Run on a trace, tools/charge_test/discharge.txt by default:
+ *
+ *   ./charge_test [-v] [trace]
+ *
+ * Each trace line is a command, # starts a comment:
+ *
+ *   curve <mv> <permille>              check charge_from_mv to 0.1 permille
+ *   wake <rest_mv> <played_ms>         end a wake with charge_end_wake
+ *   expect per_wake <permille> <%>     learnt use of a wake without playback
+ *   expect per_play_s <permille> <%>   learnt use per second of playback
+ *   expect wakes_left <n> <%>          estimate of charge_get
+ *   expect quiet <n>                   wakes averaged into per_wake
+ *   expect played <n>                  wakes averaged into per_play_s
+ *   expect nvs_writes <n>              history copies written to NVS
+ *
+ * Prints the estimate after each wake with -v. The exit status is the
+ * number of failed checks.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "battery.h"
+#include "charge.h"
+#include "nvs_store.h"
+
+#define DEFAULT_TRACE           "tools/charge_test/discharge.txt"
+#define LINE_LEN                128
+
+static const char *TEST_TAG = "Charge";
+
+static uint32_t BATTERY_MV = 0;
+
+// The NVS partition, one blob is all charge.c keeps there.
+static uint8_t NVS_BLOB[sizeof(struct charge_history_t)];
+static size_t NVS_SIZE = 0;
+static uint32_t NVS_WRITES = 0;
+
+uint32_t battery_mv() {
+    return BATTERY_MV;
+}
+
+esp_err_t nvs_store_read(const char *name_space, const char *key, void *blob, size_t size) {
+    if (NVS_SIZE == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (NVS_SIZE != size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(blob, NVS_BLOB, size);
+    return ESP_OK;
+}
+
+esp_err_t nvs_store_write(const char *name_space, const char *key, const void *blob, size_t size) {
+    if (size > sizeof(NVS_BLOB)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(NVS_BLOB, blob, size);
+    NVS_SIZE = size;
+    NVS_WRITES++;
+    return ESP_OK;
+}
+
+static double _permille(int64_t q16) {
+    return (double) q16 / CHARGE_ONE;
+}
+
+/**
+ * @return true if got is within percent of expected.
+ */
+static bool _within(const char *what, double got, double expected, double percent, int line_no) {
+    const double error = 100.0 * (got - expected) / expected;
+    if (error > percent || error < -percent) {
+        ESP_LOGE(TEST_TAG, "Line %d: %s %.4f, expected %.4f within %.0f%%.", line_no, what, got, expected,
+                 percent);
+        return false;
+    }
+    return true;
+}
+
+static bool _equal(const char *what, uint32_t got, uint32_t expected, int line_no) {
+    if (got != expected) {
+        ESP_LOGE(TEST_TAG, "Line %d: %s %u, expected %u.", line_no, what, (unsigned) got, (unsigned) expected);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The curve spans 0 to 1000 permille and never falls as the voltage
+ * rises.
+ */
+static int _check_curve() {
+    int failed = 0;
+    uint32_t previous = charge_from_mv(0);
+    failed += !_equal("charge at 0 mV", previous, 0, 0);
+    for (uint32_t mv = 1; mv <= 5000; mv++) {
+        const uint32_t charge = charge_from_mv(mv);
+        if (charge < previous) {
+            ESP_LOGE(TEST_TAG, "Charge falls from %.3f to %.3f permille at %u mV.", _permille(previous),
+                     _permille(charge), (unsigned) mv);
+            failed++;
+        }
+        previous = charge;
+    }
+    failed += !_equal("charge at 5000 mV", previous, 1000 * CHARGE_ONE, 0);
+    return failed;
+}
+
+static bool _expect(const char *what, double value, double tolerance, int line_no) {
+    struct charge_history_t history;
+    charge_get_history(&history);
+    struct charge_estimate_t estimate;
+    charge_get(&estimate);
+    if (strcmp(what, "per_wake") == 0) {
+        return _within(what, _permille(history.per_wake_q16), value, tolerance, line_no);
+    } else if (strcmp(what, "per_play_s") == 0) {
+        return _within(what, _permille(history.per_play_s_q16), value, tolerance, line_no);
+    } else if (strcmp(what, "wakes_left") == 0) {
+        return _within(what, estimate.wakes_left, value, tolerance, line_no);
+    } else if (strcmp(what, "quiet") == 0) {
+        return _equal(what, history.n_quiet, (uint32_t) value, line_no);
+    } else if (strcmp(what, "played") == 0) {
+        return _equal(what, history.n_played, (uint32_t) value, line_no);
+    } else if (strcmp(what, "nvs_writes") == 0) {
+        return _equal(what, NVS_WRITES, (uint32_t) value, line_no);
+    }
+    ESP_LOGE(TEST_TAG, "Line %d: nothing called %s to expect.", line_no, what);
+    return false;
+}
+
+/**
+ * @return the number of failed checks, or -1 if the trace is malformed.
+ */
+static int _replay(FILE *trace, bool verbose) {
+    char line[LINE_LEN];
+    int line_no = 0;
+    int failed = 0;
+    uint32_t wakes = 0;
+    while (fgets(line, sizeof(line), trace)) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char command[16];
+        char what[16];
+        unsigned a;
+        unsigned b;
+        double value;
+        double tolerance = 0.0;
+        if (sscanf(line, "%15s", command) != 1) {
+            continue;
+        }
+        if (strcmp(command, "curve") == 0 && sscanf(line, "%*s %u %lf", &a, &value) == 2) {
+            const double got = _permille(charge_from_mv(a));
+            if (got - value > 0.1 || value - got > 0.1) {
+                ESP_LOGE(TEST_TAG, "Line %d: %u mV is %.3f permille, expected %.1f.", line_no, a, got, value);
+                failed++;
+            }
+        } else if (strcmp(command, "wake") == 0 && sscanf(line, "%*s %u %u", &a, &b) == 2) {
+            BATTERY_MV = a;
+            if (charge_end_wake(b) != ESP_OK) {
+                ESP_LOGE(TEST_TAG, "Line %d: charge_end_wake failed.", line_no);
+                failed++;
+            }
+            wakes++;
+            if (verbose) {
+                struct charge_history_t history;
+                charge_get_history(&history);
+                struct charge_estimate_t estimate;
+                charge_get(&estimate);
+                printf("%5u %4u mV %5u ms: %5.1f permille, per wake %.3f, per play s %.4f, %u wakes left\n",
+                       (unsigned) wakes, a, b, _permille(charge_from_mv(a)), _permille(history.per_wake_q16),
+                       _permille(history.per_play_s_q16), (unsigned) estimate.wakes_left);
+            }
+        } else if (strcmp(command, "expect") == 0 &&
+                   sscanf(line, "%*s %15s %lf %lf", what, &value, &tolerance) >= 2) {
+            failed += !_expect(what, value, tolerance, line_no);
+        } else {
+            ESP_LOGE(TEST_TAG, "Line %d: malformed.", line_no);
+            return -1;
+        }
+    }
+    ESP_LOGI(TEST_TAG, "%u wakes replayed, %u NVS writes.", (unsigned) wakes, (unsigned) NVS_WRITES);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt != 'v') {
+            fprintf(stderr, "usage: %s [-v] [trace]\n", argv[0]);
+            return 2;
+        }
+        verbose = true;
+    }
+    const char *path = optind < argc ? argv[optind] : DEFAULT_TRACE;
+    FILE *trace = fopen(path, "r");
+    if (!trace) {
+        perror(path);
+        return 2;
+    }
+    charge_init();
+    int failed = _check_curve();
+    const int replayed = _replay(trace, verbose);
+    fclose(trace);
+    if (replayed < 0) {
+        return 2;
+    }
+    failed += replayed;
+    ESP_LOGI(TEST_TAG, "%d failed.", failed);
+    return failed;
+}
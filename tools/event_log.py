@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""Convert event logs written by components/event_log to CSV.
+
+    python tools/event_log.py /path/to/EVENTS.OLD /path/to/EVENTS.LOG > events.csv
+
+Files are read in the order given, so pass the rotated .old file first.
+Padding records are skipped, records failing their CRC are reported on
+stderr and skipped.
+"""
+
+import argparse
+import csv
+import struct
+import sys
+
+RECORD = struct.Struct("<IHBBIHH")  # struct evlog_record_t
+PAD = 0xFF
+
+# enum in event_log.h, by number.
+TYPES = {
+    1: "boot",
+    2: "button",
+    3: "alarm",
+    4: "battery",
+    5: "decode_error",
+    6: "dropped",
+    7: "sd",
+}
+
+
+def crc16_le(data):
+    """esp_rom_crc16_le(0, ...): CRC-16/X-25, reflected 0x1021, init and xorout 0xffff."""
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc ^ 0xFFFF
+
+
+def records(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        raw = data[offset:offset + RECORD.size]
+        time_ms, boot, type_, arg, value, seq, crc = RECORD.unpack(raw)
+        if type_ == PAD:
+            continue
+        if crc16_le(raw[:-2]) != crc:
+            print(f"{path}: bad record at offset {offset}", file=sys.stderr)
+            continue
+        yield boot, seq, time_ms, TYPES.get(type_, str(type_)), arg, value
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("logs", nargs="+", help="event log files, oldest first")
+    args = parser.parse_args()
+
+    writer = csv.writer(sys.stdout)
+    writer.writerow(["boot", "seq", "time_ms", "type", "arg", "value"])
+    for path in args.logs:
+        writer.writerows(records(path))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,143 @@
+/**
+ * Plays scripted button edges through the gesture logic of
+ * components/input on Linux and checks the debounce and the gestures
+ * that come out, on a clock stepped from deadline to deadline as the
+ * input task waits for them.
+ *
+ * Build from the repository root, or with make -C tools check:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -o input_test -Itools/storage_bench/host \
+ *       -Icomponents/input tools/input_test/input_test.c \
+ *       components/input/gesture.c
+ *
+ * Timing is that of tools/storage_bench/host/sdkconfig.h, the Kconfig
+ * defaults: 30 ms debounce, 300 ms double click, 1000 ms long press.
+ *
+ * The exit status is the number of failed scripts.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "gesture.h"
+
+#define EVENTS_LEN              256
+#define SCRIPT_END_MS           5000  // past every deadline a script leaves
+
+static const char *TEST_TAG = "Gesture";
+
+/**
+ * Each script edge is p<ms> or r<ms>, an edge at ms that leaves the
+ * button pressed or released. The level stays until the next edge, so
+ * an edge that bounced is still the level read once settled. Expected
+ * gestures are C, D and L for click, double click and long press, each
+ * @ the ms it completed at.
+ */
+struct script_t {
+    const char *name;
+    bool double_click;        // a double click subscriber on the pin
+    bool held;                // pressed at gesture_init
+    const char *edges;
+    const char *gestures;
+    uint32_t bounces;
+};
+
+static const struct script_t SCRIPTS[] = {
+    {"click", false, false, "p0 r100", "C@100", 0},
+    {"bouncing click", false, false, "p0 r2 p4 r100 p103 r105", "C@100", 4},
+    {"glitches", false, false, "r50 r60 p100 r200 r300", "C@200", 3},
+    {"bounce moves the level", false, false, "p0 r10", "C@30", 1},
+    {"release within debounce", false, false, "p0 r20 p25 r29", "C@30", 3},
+    {"click waits for a double", true, false, "p0 r100", "C@400", 0},
+    {"double click", true, false, "p0 r100 p200 r300", "D@300", 0},
+    {"slow second click", true, false, "p0 r100 p450 r550", "C@400 C@850", 0},
+    {"triple click", true, false, "p0 r100 p200 r300 p400 r500", "D@300 C@800", 0},
+    {"long press", false, false, "p0 r1500", "L@1000", 0},
+    {"long press after a click", true, false, "p0 r100 p200 r1500", "C@1200 L@1200", 0},
+    {"click after a long press", false, false, "p0 r1500 p1600 r1700", "L@1000 C@1700", 0},
+    {"held at start", false, true, "r500 p600 r700", "C@700", 0},
+    {"held at start for long", false, true, "r2500", "", 0},
+    {"bounce on the stale release", false, true, "r500 p510 r520", "", 2},
+};
+
+static char EVENTS[EVENTS_LEN];
+
+static void _emit(enum input_gesture_t gesture, int64_t time_us, void *arg) {
+    static const char NAMES[] = {
+        [INPUT_CLICK] = 'C',
+        [INPUT_DOUBLE_CLICK] = 'D',
+        [INPUT_LONG_PRESS] = 'L',
+    };
+    const size_t len = strlen(EVENTS);
+    snprintf(EVENTS + len, sizeof(EVENTS) - len, "%s%c@%lld", len ? " " : "", NAMES[gesture],
+             (long long) (time_us / 1000));
+}
+
+/**
+ * Step the clock to each deadline up to until_us, reading the level at
+ * it as the input task does.
+ *
+ * @return the next deadline.
+ */
+static int64_t _advance(struct gesture_t *gesture, bool pressed, int64_t next_us, int64_t until_us) {
+    while (next_us <= until_us) {
+        next_us = gesture_deadlines(gesture, pressed, next_us);
+    }
+    return next_us;
+}
+
+static bool _run(const struct script_t *script) {
+    struct gesture_t gesture;
+    gesture_init(&gesture, script->held, script->double_click, _emit, NULL);
+    EVENTS[0] = '\0';
+    bool pressed = script->held;
+    int64_t next_us = GESTURE_NO_DEADLINE;
+    uint32_t bounces = 0;
+    const char *edge = script->edges;
+    while (*edge) {
+        char *end;
+        const char level = *edge;
+        const long ms = strtol(edge + 1, &end, 10);
+        if ((level != 'p' && level != 'r') || end == edge + 1) {
+            ESP_LOGE(TEST_TAG, "%s: malformed edge at \"%s\".", script->name, edge);
+            return false;
+        }
+        const int64_t time_us = (int64_t) ms * 1000;
+        next_us = _advance(&gesture, pressed, next_us, time_us);
+        pressed = level == 'p';
+        bounces += !gesture_edge(&gesture, pressed, time_us);
+        next_us = gesture_deadlines(&gesture, pressed, time_us);
+        edge = end + strspn(end, " ");
+    }
+    next_us = _advance(&gesture, pressed, next_us, (int64_t) SCRIPT_END_MS * 1000);
+
+    bool ok = true;
+    if (strcmp(EVENTS, script->gestures) != 0) {
+        ESP_LOGE(TEST_TAG, "%s: gestures \"%s\", expected \"%s\".", script->name, EVENTS, script->gestures);
+        ok = false;
+    }
+    if (bounces != script->bounces) {
+        ESP_LOGE(TEST_TAG, "%s: %u bounces, expected %u.", script->name, (unsigned) bounces,
+                 (unsigned) script->bounces);
+        ok = false;
+    }
+    if (next_us != GESTURE_NO_DEADLINE) {
+        ESP_LOGE(TEST_TAG, "%s: a deadline is left at %lld us.", script->name, (long long) next_us);
+        ok = false;
+    }
+    return ok;
+}
+
+int main() {
+    int failed = 0;
+    const size_t n_scripts = sizeof(SCRIPTS) / sizeof(SCRIPTS[0]);
+    for (size_t i = 0; i < n_scripts; i++) {
+        failed += !_run(&SCRIPTS[i]);
+    }
+    ESP_LOGI(TEST_TAG, "%u scripts, %d failed.", (unsigned) n_scripts, failed);
+    return failed;
+}
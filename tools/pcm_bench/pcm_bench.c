@@ -0,0 +1,291 @@
+/**
+ * Checks the fused pcm kernel of components/audio/pcm_process.c sample
+ * by sample against the separate passes it replaced, gain, mono to
+ * stereo, fade-in and soft clip, and times both.
+ *
+ * Build from the repository root, or with make -C tools check:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -o pcm_bench -Itools/storage_bench/host \
+ *       -Icomponents/audio tools/pcm_bench/pcm_bench.c \
+ *       components/audio/pcm_process.c
+ *
+ * Run with the number of frames to time, 10000 by default. The exit
+ * status is the number of failed checks.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "pcm_process.h"
+
+#define FRAME_SAMPLES           1152  // per channel in one mp3 frame
+#define CALLS                   8     // frames per case, the ramp spans calls
+#define RAMP_ONE                (1u << 30)
+#define DEFAULT_BENCH_FRAMES    10000
+
+static const char *BENCH_TAG = "PCM";
+
+static int16_t INPUT[2 * FRAME_SAMPLES * CALLS];
+static int16_t FUSED[2 * FRAME_SAMPLES];
+static int16_t REFERENCE[2 * FRAME_SAMPLES];
+static int32_t WIDE[2 * FRAME_SAMPLES];
+
+// Keeps the compiler from dropping the processed samples.
+static volatile int32_t SINK;
+
+/* The separate passes, one buffer walk each. */
+
+static void _ref_gain(int32_t *out, const int16_t *in, size_t n_samples, uint32_t gain_q15) {
+    for (size_t i = 0; i < n_samples; i++) {
+        out[i] = ((int32_t) in[i] * (int32_t) gain_q15) >> 15;
+    }
+}
+
+static void _ref_mono_to_stereo(int32_t *out, size_t n_frames) {
+    for (size_t i = n_frames; i-- > 0;) {
+        out[2 * i] = out[i];
+        out[2 * i + 1] = out[i];
+    }
+}
+
+/**
+ * Ramp from silence, frame is the position of out[0] in the stream.
+ */
+static void _ref_fade(int32_t *out, size_t n_frames, int channels, uint32_t fade_frames, uint32_t frame) {
+    if (fade_frames == 0) {
+        return;
+    }
+    const uint32_t step = RAMP_ONE / fade_frames ? RAMP_ONE / fade_frames : 1;
+    for (size_t i = 0; i < n_frames; i++) {
+        const uint64_t ramp = (uint64_t) (frame + i) * step;
+        if (ramp >= RAMP_ONE) {
+            return;
+        }
+        for (int c = 0; c < channels; c++) {
+            out[channels * i + c] = (out[channels * i + c] * (int32_t) (ramp >> 15)) >> 15;
+        }
+    }
+}
+
+static void _ref_clip(int16_t *out, const int32_t *in, size_t n_samples) {
+    for (size_t i = 0; i < n_samples; i++) {
+        int32_t x = in[i];
+        if (x > PCM_CLIP_KNEE) {
+            x = PCM_CLIP_KNEE + ((x - PCM_CLIP_KNEE) >> 2);
+        } else if (x < -PCM_CLIP_KNEE) {
+            x = -PCM_CLIP_KNEE - ((-PCM_CLIP_KNEE - x) >> 2);
+        }
+        out[i] = (int16_t) (x > INT16_MAX ? INT16_MAX : x < INT16_MIN ? INT16_MIN : x);
+    }
+}
+
+static void _ref_truncate(int16_t *out, const int32_t *in, size_t n_samples) {
+    for (size_t i = 0; i < n_samples; i++) {
+        out[i] = (int16_t) in[i];
+    }
+}
+
+/* The code the kernel replaced in play_mp3, at its fixed half gain. */
+
+static void _lower_volume(short *out, int n_samples) {
+    for (int i = 0; i < n_samples; i++) {
+        out[i] = out[i] / 2;
+    }
+}
+
+static void _mono_to_stereo(short *out, int n_samples) {
+    for (int i = n_samples - 1; i >= 0; i--) {
+        out[2 * i] = out[i];
+        out[2 * i + 1] = out[i];
+    }
+}
+
+enum layout_t {
+    MONO,
+    MONO_TO_STEREO,
+    STEREO,
+    FADE_MONO,                // pcm_fade_mono, no gain or clip
+    FADE_STEREO,
+};
+
+static const char *LAYOUT_NAMES[] = {"mono", "mono to stereo", "stereo", "fade mono", "fade stereo"};
+
+static void _fill_input() {
+    uint32_t seed = 1;
+    for (size_t i = 0; i < sizeof(INPUT) / sizeof(INPUT[0]); i++) {
+        seed = seed * 1664525 + 1013904223;
+        INPUT[i] = (int16_t) (seed >> 16);
+    }
+    // The extremes, where rounding and clipping differ most.
+    INPUT[0] = INT16_MIN;
+    INPUT[1] = INT16_MAX;
+    INPUT[2] = -1;
+    INPUT[3] = 1;
+}
+
+/**
+ * Run CALLS frames through the kernel and the separate passes.
+ *
+ * @return the number of samples that differ.
+ */
+static size_t _compare(enum layout_t layout, uint32_t gain_q15, uint32_t fade_frames) {
+    const int in_channels = layout == STEREO || layout == FADE_STEREO ? 2 : 1;
+    const int out_channels = layout == MONO || layout == FADE_MONO ? 1 : 2;
+    const bool fade_only = layout == FADE_MONO || layout == FADE_STEREO;
+    struct pcm_process_t state;
+    pcm_process_init(&state, fade_only ? PCM_UNITY_GAIN : gain_q15, fade_frames);
+
+    size_t differences = 0;
+    for (uint32_t call = 0; call < CALLS; call++) {
+        const int16_t *in = INPUT + call * FRAME_SAMPLES * in_channels;
+        const size_t n_in = FRAME_SAMPLES * in_channels;
+        memcpy(FUSED, in, n_in * sizeof(int16_t));
+        size_t n_out = FRAME_SAMPLES * out_channels;
+        switch (layout) {
+            case MONO: pcm_process_mono(&state, FUSED, FRAME_SAMPLES); break;
+            case MONO_TO_STEREO: pcm_process_mono_to_stereo(&state, FUSED, FRAME_SAMPLES); break;
+            case STEREO: pcm_process_stereo(&state, FUSED, FRAME_SAMPLES); break;
+            case FADE_MONO: pcm_fade_mono(&state, FUSED, FRAME_SAMPLES); break;
+            case FADE_STEREO: pcm_fade_stereo(&state, FUSED, FRAME_SAMPLES); break;
+        }
+
+        _ref_gain(WIDE, in, n_in, fade_only ? PCM_UNITY_GAIN : gain_q15);
+        if (in_channels != out_channels) {
+            _ref_mono_to_stereo(WIDE, FRAME_SAMPLES);
+        }
+        _ref_fade(WIDE, FRAME_SAMPLES, out_channels, fade_frames, call * FRAME_SAMPLES);
+        if (fade_only) {
+            _ref_truncate(REFERENCE, WIDE, n_out);
+        } else {
+            _ref_clip(REFERENCE, WIDE, n_out);
+        }
+
+        for (size_t i = 0; i < n_out; i++) {
+            differences += FUSED[i] != REFERENCE[i];
+        }
+    }
+    return differences;
+}
+
+/**
+ * The kernel at the default half gain against lower_volume and
+ * mono_to_stereo. Q15 gain rounds down where the division rounded
+ * towards zero, so negative odd samples may be one lower.
+ *
+ * @return false if any sample is further off.
+ */
+static bool _compare_old(size_t *off_by_one) {
+    struct pcm_process_t state;
+    pcm_process_init(&state, 0x4000, 0);
+    *off_by_one = 0;
+    for (uint32_t call = 0; call < CALLS; call++) {
+        const int16_t *in = INPUT + call * FRAME_SAMPLES;
+        memcpy(FUSED, in, FRAME_SAMPLES * sizeof(int16_t));
+        memcpy(REFERENCE, in, FRAME_SAMPLES * sizeof(int16_t));
+        pcm_process_mono_to_stereo(&state, FUSED, FRAME_SAMPLES);
+        _mono_to_stereo(REFERENCE, FRAME_SAMPLES);
+        _lower_volume(REFERENCE, 2 * FRAME_SAMPLES);
+        for (size_t i = 0; i < 2 * FRAME_SAMPLES; i++) {
+            const int diff = REFERENCE[i] - FUSED[i];
+            if (diff < 0 || diff > 1 || (diff == 1 && (in[i / 2] >= 0 || in[i / 2] % 2 == 0))) {
+                return false;
+            }
+            *off_by_one += diff;
+        }
+    }
+    return true;
+}
+
+static void _report(const char *name, int64_t us, uint32_t frames) {
+    ESP_LOGI(BENCH_TAG, "%-28s %8.2f ns per frame", name, us * 1000.0 / frames);
+}
+
+static void _bench(uint32_t frames) {
+    const uint32_t calls = (frames + FRAME_SAMPLES - 1) / FRAME_SAMPLES;
+    frames = calls * FRAME_SAMPLES;
+    struct pcm_process_t state;
+
+    pcm_process_init(&state, 0x4000, 0);
+    int64_t start = esp_timer_get_time();
+    for (uint32_t call = 0; call < calls; call++) {
+        memcpy(FUSED, INPUT, FRAME_SAMPLES * sizeof(int16_t));
+        pcm_process_mono_to_stereo(&state, FUSED, FRAME_SAMPLES);
+        SINK += FUSED[call % FRAME_SAMPLES];
+    }
+    _report("fused mono to stereo", esp_timer_get_time() - start, frames);
+
+    start = esp_timer_get_time();
+    for (uint32_t call = 0; call < calls; call++) {
+        memcpy(REFERENCE, INPUT, FRAME_SAMPLES * sizeof(int16_t));
+        _mono_to_stereo(REFERENCE, FRAME_SAMPLES);
+        _lower_volume(REFERENCE, 2 * FRAME_SAMPLES);
+        SINK += REFERENCE[call % FRAME_SAMPLES];
+    }
+    _report("old halve and expand", esp_timer_get_time() - start, frames);
+
+    start = esp_timer_get_time();
+    for (uint32_t call = 0; call < calls; call++) {
+        _ref_gain(WIDE, INPUT, FRAME_SAMPLES, 0x4000);
+        _ref_mono_to_stereo(WIDE, FRAME_SAMPLES);
+        _ref_fade(WIDE, FRAME_SAMPLES, 2, FRAME_SAMPLES * calls, call * FRAME_SAMPLES);
+        _ref_clip(REFERENCE, WIDE, 2 * FRAME_SAMPLES);
+        SINK += REFERENCE[call % FRAME_SAMPLES];
+    }
+    _report("separate passes with fade", esp_timer_get_time() - start, frames);
+
+    pcm_process_init(&state, 0x4000, FRAME_SAMPLES * calls);
+    start = esp_timer_get_time();
+    for (uint32_t call = 0; call < calls; call++) {
+        memcpy(FUSED, INPUT, FRAME_SAMPLES * sizeof(int16_t));
+        pcm_process_mono_to_stereo(&state, FUSED, FRAME_SAMPLES);
+        SINK += FUSED[call % FRAME_SAMPLES];
+    }
+    _report("fused with fade", esp_timer_get_time() - start, frames);
+}
+
+int main(int argc, char **argv) {
+    const int frames = argc > 1 ? atoi(argv[1]) : DEFAULT_BENCH_FRAMES;
+    if (frames < 1) {
+        fprintf(stderr, "usage: %s [frames]\n", argv[0]);
+        return 2;
+    }
+    _fill_input();
+
+    static const uint32_t GAINS[] = {0, 1, 0x4000, PCM_UNITY_GAIN, 0xc000, PCM_MAX_GAIN};
+    // None, within one call, across calls, and shorter than a step.
+    static const uint32_t FADES[] = {0, 500, 3 * FRAME_SAMPLES + 17, 1};
+    int failed = 0;
+    int cases = 0;
+    for (int layout = MONO; layout <= FADE_STEREO; layout++) {
+        for (size_t g = 0; g < sizeof(GAINS) / sizeof(GAINS[0]); g++) {
+            for (size_t f = 0; f < sizeof(FADES) / sizeof(FADES[0]); f++) {
+                const size_t differences = _compare((enum layout_t) layout, GAINS[g], FADES[f]);
+                cases++;
+                if (differences) {
+                    ESP_LOGE(BENCH_TAG, "%s, gain %u, fade %u frames: %u samples differ.",
+                             LAYOUT_NAMES[layout], (unsigned) GAINS[g], (unsigned) FADES[f],
+                             (unsigned) differences);
+                    failed++;
+                }
+            }
+        }
+    }
+    ESP_LOGI(BENCH_TAG, "%d cases of %d frames compared with the separate passes.", cases, CALLS * FRAME_SAMPLES);
+
+    size_t off_by_one;
+    if (!_compare_old(&off_by_one)) {
+        ESP_LOGE(BENCH_TAG, "Half gain differs from lower_volume by more than its rounding.");
+        failed++;
+    } else {
+        ESP_LOGI(BENCH_TAG, "Half gain matches lower_volume, %u negative odd samples round down.",
+                 (unsigned) off_by_one);
+    }
+
+    _bench((uint32_t) frames);
+    return failed;
+}
@@ -0,0 +1,153 @@
+/**
+ * Runs generated tones at the mp3 sample rates through the resampler of
+ * components/audio on Linux and checks the length, pitch and level of
+ * what comes out at the i2s rate, mono and stereo.
+ *
+ * Build from the repository root, or with make -C tools check:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -o resample_test -Itools/storage_bench/host \
+ *       -Icomponents/audio tools/resample_test/resample_test.c \
+ *       components/audio/resampler.c -lm
+ *
+ * The exit status is the number of failed runs.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+
+#include "resampler.h"
+
+// Same as the audio component.
+#define SAMPLE_RATE             44100
+#define RESAMPLE_BUFFER_FRAMES  3200
+
+#define SECONDS                 2
+#define LEFT_HZ                 440.0
+#define RIGHT_HZ                1000.0
+#define AMPLITUDE               16000.0
+#define MAX_PITCH_ERROR         0.001   // relative
+#define MAX_LEVEL_ERROR         0.05    // relative, the filter rolls off near Nyquist
+#define SETTLE_FRAMES           64      // output ignored while the filter fills
+
+static const char *TEST_TAG = "Resample";
+
+struct rate_t {
+    uint32_t rate;
+    uint32_t frame_samples;   // per channel in one mp3 frame at this rate
+};
+
+// MPEG 1, 2 and 2.5 rates with the frame sizes the decoder hands over.
+static const struct rate_t RATES[] = {
+    {8000, 576}, {11025, 576}, {12000, 576}, {16000, 576}, {22050, 576},
+    {24000, 576}, {32000, 1152}, {44100, 1152}, {48000, 1152},
+};
+
+static int16_t IN[2 * 1152];
+static int16_t OUT[2 * RESAMPLE_BUFFER_FRAMES];
+static int16_t RESULT[2 * SAMPLE_RATE * (SECONDS + 1)];
+static struct resampler_t RESAMPLER;
+
+/**
+ * Frequency from the upward zero crossings of one channel, interpolated
+ * between samples.
+ */
+static double _pitch(const int16_t *pcm, size_t n_frames, int channels, int channel) {
+    double first = -1.0;
+    double last = -1.0;
+    size_t crossings = 0;
+    for (size_t i = SETTLE_FRAMES + 1; i < n_frames; i++) {
+        const int a = pcm[channels * (i - 1) + channel];
+        const int b = pcm[channels * i + channel];
+        if (a < 0 && b >= 0) {
+            const double t = (double) (i - 1) + (double) -a / (double) (b - a);
+            first = first < 0.0 ? t : first;
+            last = t;
+            crossings++;
+        }
+    }
+    return crossings < 2 ? 0.0 : (double) (crossings - 1) * SAMPLE_RATE / (last - first);
+}
+
+static double _rms(const int16_t *pcm, size_t n_frames, int channels, int channel) {
+    double sum = 0.0;
+    for (size_t i = SETTLE_FRAMES; i < n_frames; i++) {
+        const double x = pcm[channels * i + channel];
+        sum += x * x;
+    }
+    return sqrt(sum / (double) (n_frames - SETTLE_FRAMES));
+}
+
+static bool _check(const char *what, double got, double expected, double tolerance, uint32_t rate) {
+    const double error = fabs(got - expected) / expected;
+    if (error > tolerance) {
+        ESP_LOGE(TEST_TAG, "%u Hz: %s %.3f, expected %.3f.", (unsigned) rate, what, got, expected);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Resample SECONDS of a 440 Hz left and 1 kHz right tone at rate, fed
+ * one mp3 frame at a time as the decode task does. Mono streams get the
+ * left tone alone.
+ */
+static bool _run(const struct rate_t *rate, int channels) {
+    static const double PITCHES[] = {LEFT_HZ, RIGHT_HZ};
+    if (!resampler_init(&RESAMPLER, rate->rate, SAMPLE_RATE, channels)) {
+        ESP_LOGE(TEST_TAG, "%u Hz: no resampler for this rate.", (unsigned) rate->rate);
+        return false;
+    }
+    if (resampler_max_output(&RESAMPLER, rate->frame_samples) > RESAMPLE_BUFFER_FRAMES) {
+        ESP_LOGE(TEST_TAG, "%u Hz: one frame resamples to more than RESAMPLE_BUFFER_FRAMES.",
+                 (unsigned) rate->rate);
+        return false;
+    }
+
+    const size_t in_frames = (size_t) rate->rate * SECONDS;
+    size_t n_out = 0;
+    for (size_t done = 0; done < in_frames; done += rate->frame_samples) {
+        for (size_t i = 0; i < rate->frame_samples; i++) {
+            const double t = (double) (done + i) / rate->rate;
+            for (int c = 0; c < channels; c++) {
+                IN[channels * i + c] = (int16_t) lrint(AMPLITUDE * sin(2.0 * M_PI * PITCHES[c] * t));
+            }
+        }
+        const size_t frames = resampler_process(&RESAMPLER, IN, rate->frame_samples, OUT);
+        for (size_t i = 0; i < channels * frames; i++) {
+            RESULT[channels * n_out + i] = OUT[i];
+        }
+        n_out += frames;
+    }
+
+    const size_t fed = (in_frames + rate->frame_samples - 1) / rate->frame_samples * rate->frame_samples;
+    const double expected_frames = (double) fed * SAMPLE_RATE / rate->rate;
+    bool ok = fabs((double) n_out - expected_frames) <= 1.0;
+    if (!ok) {
+        ESP_LOGE(TEST_TAG, "%u Hz: %u frames out, expected %.1f.", (unsigned) rate->rate, (unsigned) n_out,
+                 expected_frames);
+    }
+    double pitches[2];
+    for (int c = 0; c < channels; c++) {
+        pitches[c] = _pitch(RESULT, n_out, channels, c);
+        ok &= _check("pitch", pitches[c], PITCHES[c], MAX_PITCH_ERROR, rate->rate);
+        ok &= _check("level", _rms(RESULT, n_out, channels, c), AMPLITUDE / sqrt(2.0), MAX_LEVEL_ERROR,
+                     rate->rate);
+    }
+    ESP_LOGI(TEST_TAG, "%5u Hz, %d channel(s): %u/%u phases, %6u frames out, left at %.2f Hz.",
+             (unsigned) rate->rate, channels, (unsigned) RESAMPLER.up, (unsigned) RESAMPLER.down,
+             (unsigned) n_out, pitches[0]);
+    return ok;
+}
+
+int main() {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(RATES) / sizeof(RATES[0]); i++) {
+        failed += !_run(&RATES[i], 2);
+        failed += !_run(&RATES[i], 1);
+    }
+    return failed;
+}
@@ -0,0 +1,160 @@
+/**
+ * Times the firmware's config and audio file paths on Linux against a
+ * directory standing in for the SD card, with SD timing injected by the
+ * host storage backend.
+ *
+ * Build from the repository root:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -DSTORAGE_POSIX -o storage_bench \
+ *       -Itools/storage_bench/host -Icomponents/storage -Icomponents/audio -Imain \
+ *       tools/storage_bench/bench.c components/storage/storage_posix.c \
+ *       components/storage/storage_bench.c main/config.c \
+ *       components/audio/audio_library.c components/audio/mp3_index.c \
+ *       components/audio/pcm_cache.c
+ *
+ * Run with a copy of the card's files:
+ *
+ *   ./storage_bench [-o open_us] [-a access_us] [-r KB/s] [-n runs] card_dir
+ *
+ * The defaults approximate a class 10 card on the 20 MHz SPI bus, -r 0
+ * -a 0 -o 0 measures the host alone.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "audio_library.h"
+#include "config.h"
+#include "mp3_index.h"
+#include "pcm_cache.h"
+#include "storage.h"
+
+#define DEFAULT_OPEN_US         2000
+#define DEFAULT_ACCESS_US       400
+#define DEFAULT_KBPS            1200
+#define DEFAULT_RUNS            5
+
+static const char *BENCH_TAG = "Bench";
+
+// Same read-ahead as the audio reader on the device.
+static char READ_AHEAD[CONFIG_AUDIO_READ_AHEAD_SIZE];
+
+FILE *aud_open_stream(const char *path) {
+    FILE *file = storage_fopen(path, "r");
+    if (file && setvbuf(file, READ_AHEAD, _IOFBF, sizeof(READ_AHEAD)) != 0) {
+        ESP_LOGW(BENCH_TAG, "No read-ahead buffer for %s.", path);
+    }
+    return file;
+}
+
+static void _report(const char *name, const int64_t *us, int runs) {
+    int64_t min = us[0];
+    int64_t total = 0;
+    for (int i = 0; i < runs; i++) {
+        min = us[i] < min ? us[i] : min;
+        total += us[i];
+    }
+    ESP_LOGI(BENCH_TAG, "%-12s min %7d us, mean %7d us", name, (int) min, (int) (total / runs));
+}
+
+static bool _bench_config(struct alarm_config_t *config, int runs) {
+    int64_t us[runs];
+    for (int i = 0; i < runs; i++) {
+        int64_t start = esp_timer_get_time();
+        if (cfg_load(MOUNT_POINT CONFIG_FILE, MOUNT_POINT "/", config) != ESP_OK) {
+            ESP_LOGE(BENCH_TAG, "Failed to load " MOUNT_POINT CONFIG_FILE ".");
+            return false;
+        }
+        us[i] = esp_timer_get_time() - start;
+    }
+    _report("config", us, runs);
+    return true;
+}
+
+static void _bench_index(const char *path, int runs) {
+    static struct mp3_index_t index;
+    int64_t us[runs];
+    for (int i = 0; i < runs; i++) {
+        // A cleared index forces the sidecar load or the header probe.
+        memset(&index, 0, sizeof(index));
+        int64_t start = esp_timer_get_time();
+        FILE *file = aud_open_stream(path);
+        bool found = file && mp3_index_open(&index, path, file);
+        if (file) {
+            fclose(file);
+        }
+        us[i] = esp_timer_get_time() - start;
+        if (!found) {
+            ESP_LOGW(BENCH_TAG, "No audio frame in %s.", path);
+            return;
+        }
+    }
+    _report(index.complete ? "index (idx)" : "index probe", us, runs);
+}
+
+/**
+ * The library scans once per run, run the tool twice to time the scan
+ * with and without its library file.
+ */
+static void _bench_library() {
+    int64_t start = esp_timer_get_time();
+    if (aud_lib_scan(MOUNT_POINT) != ESP_OK) {
+        ESP_LOGW(BENCH_TAG, "Failed to scan " MOUNT_POINT ".");
+        return;
+    }
+    int64_t us = esp_timer_get_time() - start;
+    _report("library", &us, 1);
+}
+
+static void _usage(const char *name) {
+    fprintf(stderr, "usage: %s [-o open_us] [-a access_us] [-r KB/s] [-n runs] card_dir\n", name);
+}
+
+int main(int argc, char **argv) {
+    struct storage_limits_t limits = {
+        .open_us = DEFAULT_OPEN_US,
+        .access_us = DEFAULT_ACCESS_US,
+        .bytes_per_s = DEFAULT_KBPS * 1024,
+    };
+    int runs = DEFAULT_RUNS;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:a:r:n:")) != -1) {
+        switch (opt) {
+            case 'o': limits.open_us = (uint32_t) atoi(optarg); break;
+            case 'a': limits.access_us = (uint32_t) atoi(optarg); break;
+            case 'r': limits.bytes_per_s = (uint32_t) atoi(optarg) * 1024; break;
+            case 'n': runs = atoi(optarg); break;
+            default: _usage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc - 1 || runs < 1) {
+        _usage(argv[0]);
+        return 2;
+    }
+    storage_posix_set_root(argv[optind]);
+    storage_posix_set_limits(&limits);
+    if (set_up_storage() != ESP_OK) {
+        return 1;
+    }
+
+    static struct alarm_config_t config;
+    if (!_bench_config(&config, runs)) {
+        return 1;
+    }
+    _bench_library();
+    if (config.audio_file[0] == '\0') {
+        ESP_LOGW(BENCH_TAG, "No audio file configured.");
+        return 0;
+    }
+    _bench_index(config.audio_file, runs);
+    ESP_LOGI(BENCH_TAG, "%-12s %u KB/s", "audio read",
+             (unsigned) storage_read_speed(config.audio_file, sizeof(READ_AHEAD)));
+    storage_benchmark(config.audio_file);
+    shut_down_storage();
+    return 0;
+}
@@ -0,0 +1,379 @@
+/**
+ * Checks the config.txt parser of main/config.c on Linux against
+ * malformed, overlong and legacy files and times it on a large one. Then
+ * cuts the power at every write, unlink and rename of cfg_save in turn
+ * and checks that cfg_load finds either the old or the new settings, or
+ * on a first save the new settings or none.
+ *
+ * Build from the repository root, or with make -C tools check:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -DSTORAGE_POSIX -o config_test \
+ *       -Itools/storage_bench/host -Icomponents/storage -Imain \
+ *       tools/storage_bench/config_test.c main/config.c \
+ *       components/storage/storage_posix.c components/storage/storage_bench.c
+ *
+ * Run with the number of parses to time, 100 by default. The exit status
+ * is the number of failed cases.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "config.h"
+#include "storage.h"
+
+#define BASE_DIR                MOUNT_POINT "/"
+#define CONFIG_PATH             MOUNT_POINT CONFIG_FILE
+#define DEFAULT_PARSES          100
+#define LARGE_LINES             4000
+#define MAX_POWER_UNITS         4096  // far more than one save uses
+
+static const char *TEST_TAG = "ConfigTest";
+
+static int FAILED = 0;
+
+#define EXPECT(name, cond)                                                     \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            ESP_LOGE(TEST_TAG, "%s: %s does not hold.", name, #cond);          \
+            FAILED++;                                                          \
+        }                                                                      \
+    } while (0)
+
+static void _parse(const char *text, struct alarm_config_t *config) {
+    cfg_defaults(config);
+    FILE *file = fmemopen((void *) text, strlen(text), "r");
+    cfg_parse(file, BASE_DIR, config);
+    fclose(file);
+}
+
+static void _test_legacy() {
+    struct alarm_config_t config;
+    _parse("alarm.mp3\n", &config);
+    EXPECT("legacy", strcmp(config.audio_file, BASE_DIR "alarm.mp3") == 0);
+    EXPECT("legacy", config.errors == 0);
+
+    // Edited on Windows, quoted for the space.
+    _parse("\"wake up.mp3\"\r\n[Audio]\r\nvolume = 80\r\n", &config);
+    EXPECT("legacy crlf", strcmp(config.audio_file, BASE_DIR "wake up.mp3") == 0);
+    EXPECT("legacy crlf", config.volume == 80);
+    EXPECT("legacy crlf", config.errors == 0);
+
+    // Only the first line may be a bare name.
+    _parse("# alarm\nalarm.mp3\n", &config);
+    EXPECT("legacy late", config.audio_file[0] == '\0');
+    EXPECT("legacy late", config.errors == 1);
+}
+
+static void _test_quoting() {
+    struct alarm_config_t config;
+    _parse("[WiFi AP Credentials]\n"
+           "ssid = \"my net # 2\"\n"
+           "password = \"a=b;c\" # trailing comment\n"
+           "[Audio]\n"
+           "file = songs/alarm.mp3 ; relative\n"
+           "volume = 120 # loud\n", &config);
+    EXPECT("quoting", strcmp(config.ssid, "my net # 2") == 0);
+    EXPECT("quoting", strcmp(config.password, "a=b;c") == 0);
+    EXPECT("quoting", strcmp(config.audio_file, BASE_DIR "songs/alarm.mp3") == 0);
+    EXPECT("quoting", config.volume == 120);
+    EXPECT("quoting", config.errors == 0);
+
+    _parse("[WiFi AP Credentials]\nssid = \"open\nssid = \"\"\n", &config);
+    EXPECT("unterminated quote", config.ssid[0] == '\0');
+    EXPECT("unterminated quote", config.errors == 1);
+
+    _parse("[Audio]\nfile = /other/alarm.mp3\n", &config);
+    EXPECT("absolute path", strcmp(config.audio_file, "/other/alarm.mp3") == 0);
+}
+
+static void _test_malformed() {
+    struct alarm_config_t config;
+    _parse("[Audio\n"                   // unclosed section
+           "[Audio]\n"
+           "volume\n"                   // no value
+           "volume = 201\n"             // out of range
+           "volume = 8x\n"              // not a number
+           "fade_in = 30\n"
+           "colour = red\n"             // unknown key
+           "file =\n"                   // empty path
+           "[Bluetooth]\n"              // unknown section, reported once
+           "name = clock\n"
+           "volume = 10\n"
+           "[Alarm]\n"
+           "time = 24:00\n"
+           "time = 07:60\n"
+           "time = 07:30 Funday\n"
+           "time = 07:30 Mon-\n"
+           "time = 07:30\n", &config);
+    EXPECT("malformed", config.errors == 11);
+    EXPECT("malformed", config.volume == CFG_DEFAULT_VOLUME);
+    EXPECT("malformed", config.fade_in_s == 30);
+    EXPECT("malformed", config.audio_file[0] == '\0');
+    EXPECT("malformed", config.n_alarms == 1);
+    EXPECT("malformed", config.alarms[0].hour == 7 && config.alarms[0].minute == 30);
+    EXPECT("malformed", config.alarms[0].days == CFG_EVERY_DAY);
+
+    _parse("[Alarm]\ntime = 01:00\ntime = 02:00\ntime = 03:00\ntime = 04:00\ntime = 05:00\n", &config);
+    EXPECT("too many alarms", config.n_alarms == CFG_MAX_ALARMS);
+    EXPECT("too many alarms", config.alarms[CFG_MAX_ALARMS - 1].hour == 4);
+    EXPECT("too many alarms", config.errors == 1);
+}
+
+static void _test_overlong() {
+    char text[4 * CFG_LINE_LEN];
+    struct alarm_config_t config;
+
+    // The longest line that fits is kept.
+    int n = snprintf(text, sizeof(text), "[WiFi AP Credentials]\nssid = \"");
+    memset(text + n, 'x', CFG_SSID_LEN - 1);
+    n += CFG_SSID_LEN - 1;
+    n += snprintf(text + n, sizeof(text) - n, "\"\npassword = \"");
+    const int fill = CFG_LINE_LEN - 2 - (int) strlen("password = \"\"");
+    memset(text + n, 'p', fill);
+    n += fill;
+    snprintf(text + n, sizeof(text) - n, "\"\n");
+    _parse(text, &config);
+    EXPECT("longest line", strlen(config.ssid) == CFG_SSID_LEN - 1);
+    EXPECT("longest line", config.errors == 1);   // the password does not fit its field
+
+    // One character more and the line is skipped whole, the next is read.
+    n = snprintf(text, sizeof(text), "[Audio]\nfile = ");
+    memset(text + n, 'a', 2 * CFG_LINE_LEN);
+    n += 2 * CFG_LINE_LEN;
+    snprintf(text + n, sizeof(text) - n, ".mp3\nvolume = 70\n");
+    _parse(text, &config);
+    EXPECT("overlong", config.audio_file[0] == '\0');
+    EXPECT("overlong", config.volume == 70);
+    EXPECT("overlong", config.errors == 1);
+
+    // A value too long for its field is malformed, not truncated.
+    _parse("[WiFi AP Credentials]\nssid = 0123456789012345678901234567890123\n", &config);
+    EXPECT("long value", config.ssid[0] == '\0');
+    EXPECT("long value", config.errors == 1);
+}
+
+static void _test_days() {
+    static const struct {
+        const char *time;
+        uint8_t days;
+    } CASES[] = {
+        {"time = 22:00 Sat-Mon", CFG_DAY(5) | CFG_DAY(6) | CFG_DAY(0)},
+        {"time = 22:00 Sun-Sun", CFG_DAY(6)},
+        {"time = 22:00 Mon-Fri", 0x1f},
+        {"time = 22:00 Tue-Mon", CFG_EVERY_DAY},
+        {"time = 22:00 Sat, Sun", CFG_DAY(5) | CFG_DAY(6)},
+        {"time = 22:00 Fri-Sun,Mon", CFG_DAY(4) | CFG_DAY(5) | CFG_DAY(6) | CFG_DAY(0)},
+        {"time = 22:00", CFG_EVERY_DAY},
+    };
+    char text[64];
+    struct alarm_config_t config;
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        snprintf(text, sizeof(text), "[Alarm]\n%s\n", CASES[i].time);
+        _parse(text, &config);
+        if (config.n_alarms != 1 || config.errors != 0 || config.alarms[0].days != CASES[i].days) {
+            ESP_LOGE(TEST_TAG, "%s: days 0x%02x, expected 0x%02x.", CASES[i].time,
+                     config.n_alarms ? config.alarms[0].days : 0, CASES[i].days);
+            FAILED++;
+        }
+    }
+}
+
+/**
+ * cfg_write output parses back to the same settings.
+ */
+static void _test_round_trip() {
+    struct alarm_config_t config;
+    _parse("[WiFi AP Credentials]\nssid = \"net; 1\"\npassword = secret\n"
+           "[Audio]\nfile = alarm.mp3\nvolume = 0\nfade_in = 600\n"
+           "[Alarm]\ntime = 06:45 Sat-Mon\ntime = 12:00\n", &config);
+    char text[512];
+    FILE *file = fmemopen(text, sizeof(text), "w");
+    EXPECT("round trip", cfg_write(file, BASE_DIR, &config) == ESP_OK);
+    fclose(file);
+    struct alarm_config_t again;
+    _parse(text, &again);
+    EXPECT("round trip", memcmp(&config, &again, sizeof(config)) == 0);
+}
+
+/**
+ * A config of LARGE_LINES lines, every eighth malformed.
+ *
+ * @return the text, free it, and its number of malformed lines.
+ */
+static char *_large_config(uint32_t *malformed) {
+    static const char *LINES[] = {
+        "[WiFi AP Credentials]\n", "ssid = \"network\" # home\n", "password = \"secret;secret\"\n",
+        "; comment\n", "[Audio]\n", "volume = 80\n", "fade_in = 30\n", "volume = loud\n",
+    };
+    const size_t n_lines = sizeof(LINES) / sizeof(LINES[0]);
+    char *text = malloc(LARGE_LINES * 32 + 1);
+    char *end = text;
+    for (int i = 0; i < LARGE_LINES; i++) {
+        end = stpcpy(end, LINES[i % n_lines]);
+    }
+    *malformed = LARGE_LINES / n_lines;
+    return text;
+}
+
+static void _bench(int parses) {
+    uint32_t malformed;
+    char *text = _large_config(&malformed);
+    struct alarm_config_t config;
+    const int64_t start = esp_timer_get_time();
+    for (int i = 0; i < parses; i++) {
+        _parse(text, &config);
+    }
+    const int64_t us = esp_timer_get_time() - start;
+    EXPECT("large", config.errors == malformed);
+    EXPECT("large", config.volume == 80 && strcmp(config.password, "secret;secret") == 0);
+    ESP_LOGI(TEST_TAG, "%d lines, %u malformed: %.1f us per parse, %.0f lines/ms.", LARGE_LINES,
+             (unsigned) malformed, (double) us / parses, us ? (double) LARGE_LINES * parses * 1000 / us : 0.0);
+    free(text);
+}
+
+static bool _same(const struct alarm_config_t *a, const struct alarm_config_t *b) {
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+/**
+ * What cfg_load makes of the card with the power on.
+ */
+static void _load(struct alarm_config_t *config) {
+    storage_posix_set_power_budget(-1);
+    if (cfg_load(CONFIG_PATH, BASE_DIR, config) != ESP_OK) {
+        config->errors = UINT32_MAX;
+    }
+}
+
+/**
+ * Save NEW over OLD with the power cut after units, then load with the
+ * power cut straight away, as a boot that dies while recovering, and
+ * finally with the power on.
+ *
+ * @return true if the save completed.
+ */
+static bool _cut_save(int64_t units, const struct alarm_config_t *old, const struct alarm_config_t *new) {
+    storage_posix_set_power_budget(-1);
+    if (cfg_save(CONFIG_PATH, BASE_DIR, old) != ESP_OK) {
+        ESP_LOGE(TEST_TAG, "Failed to write the old config.");
+        FAILED++;
+        return true;
+    }
+    storage_posix_set_power_budget(units);
+    const bool saved = cfg_save(CONFIG_PATH, BASE_DIR, new) == ESP_OK;
+
+    struct alarm_config_t loaded;
+    storage_posix_set_power_budget(0);
+    cfg_load(CONFIG_PATH, BASE_DIR, &loaded);
+    _load(&loaded);
+    if (saved ? !_same(&loaded, new) : !_same(&loaded, new) && !_same(&loaded, old)) {
+        ESP_LOGE(TEST_TAG, "Power cut after %d units: loaded neither the %s config (%u errors).",
+                 (int) units, saved ? "new" : "old nor the new", (unsigned) loaded.errors);
+        FAILED++;
+    }
+    // The card is left as the cut left it, a later save must still work.
+    struct alarm_config_t again;
+    storage_posix_set_power_budget(-1);
+    if (cfg_save(CONFIG_PATH, BASE_DIR, old) != ESP_OK || (_load(&again), !_same(&again, old))) {
+        ESP_LOGE(TEST_TAG, "Power cut after %d units: the next save failed.", (int) units);
+        FAILED++;
+    }
+    return saved;
+}
+
+/**
+ * Save NEW onto a card without a config with the power cut after units,
+ * then load as _cut_save does. A save cut short must leave no config,
+ * never part of one.
+ *
+ * @return true if the save completed.
+ */
+static bool _cut_first_save(int64_t units, const char *tmp_path, const struct alarm_config_t *new) {
+    storage_posix_set_power_budget(-1);
+    storage_unlink(CONFIG_PATH);
+    storage_unlink(tmp_path);
+    storage_posix_set_power_budget(units);
+    const bool saved = cfg_save(CONFIG_PATH, BASE_DIR, new) == ESP_OK;
+
+    struct alarm_config_t loaded;
+    storage_posix_set_power_budget(0);
+    cfg_load(CONFIG_PATH, BASE_DIR, &loaded);
+    _load(&loaded);
+    const bool none = loaded.errors == UINT32_MAX;
+    if (saved ? !_same(&loaded, new) : !none && !_same(&loaded, new)) {
+        ESP_LOGE(TEST_TAG, "Power cut after %d units of the first save: loaded %s (%u errors).", (int) units,
+                 saved ? "not the new config" : "part of the new config", (unsigned) loaded.errors);
+        FAILED++;
+    }
+    struct alarm_config_t again;
+    storage_posix_set_power_budget(-1);
+    if (cfg_save(CONFIG_PATH, BASE_DIR, new) != ESP_OK || (_load(&again), !_same(&again, new))) {
+        ESP_LOGE(TEST_TAG, "Power cut after %d units of the first save: the next save failed.", (int) units);
+        FAILED++;
+    }
+    return saved;
+}
+
+static void _test_power_cuts() {
+    char root[] = "/tmp/config_test.XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        FAILED++;
+        return;
+    }
+    storage_posix_set_root(root);
+    set_up_storage();
+
+    // Reference settings as cfg_load reads them back.
+    struct alarm_config_t old;
+    struct alarm_config_t new;
+    _parse("[WiFi AP Credentials]\nssid = old\n[Audio]\nfile = old.mp3\nvolume = 40\n", &old);
+    _parse("[WiFi AP Credentials]\nssid = \"new network\"\npassword = secret\n"
+           "[Audio]\nfile = new.mp3\nvolume = 90\nfade_in = 20\n[Alarm]\ntime = 07:00 Mon-Fri\n", &new);
+
+    int64_t units = 0;
+    while (units < MAX_POWER_UNITS && !_cut_save(units, &old, &new)) {
+        units++;
+    }
+    EXPECT("power cuts", units < MAX_POWER_UNITS);
+    ESP_LOGI(TEST_TAG, "Cut the power at each of the %d units of a save.", (int) units);
+
+    char tmp_path[] = CONFIG_PATH;
+    tmp_path[sizeof(tmp_path) - 2] = CFG_TMP_MARK;
+    units = 0;
+    while (units < MAX_POWER_UNITS && !_cut_first_save(units, tmp_path, &new)) {
+        units++;
+    }
+    EXPECT("first save power cuts", units < MAX_POWER_UNITS);
+    ESP_LOGI(TEST_TAG, "Cut the power at each of the %d units of a first save.", (int) units);
+
+    storage_posix_set_power_budget(-1);
+    storage_unlink(CONFIG_PATH);
+    storage_unlink(tmp_path);
+    shut_down_storage();
+    rmdir(root);
+}
+
+int main(int argc, char **argv) {
+    const int parses = argc > 1 ? atoi(argv[1]) : DEFAULT_PARSES;
+    if (parses < 1) {
+        fprintf(stderr, "usage: %s [parses]\n", argv[0]);
+        return 2;
+    }
+    _test_legacy();
+    _test_quoting();
+    _test_malformed();
+    _test_overlong();
+    _test_days();
+    _test_round_trip();
+    _test_power_cuts();
+    _bench(parses);
+    ESP_LOGI(TEST_TAG, "%d failed.", FAILED);
+    return FAILED;
+}
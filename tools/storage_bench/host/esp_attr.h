@@ -0,0 +1,7 @@
+#ifndef _HOST_ESP_ATTR_H
+#define _HOST_ESP_ATTR_H
+
+// Plain statics on the host, nothing survives the process.
+#define RTC_DATA_ATTR
+
+#endif
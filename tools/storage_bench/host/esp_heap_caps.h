@@ -0,0 +1,10 @@
+#ifndef _HOST_ESP_HEAP_CAPS_H
+#define _HOST_ESP_HEAP_CAPS_H
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_DMA          (1 << 3)
+
+#define heap_caps_malloc(size, caps) malloc(size)
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _HOST_ESP_ROM_CRC_H
+#define _HOST_ESP_ROM_CRC_H
+
+#include <stdint.h>
+
+// CRC-32 with the same conventions as the ROM, bitwise.
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+#endif
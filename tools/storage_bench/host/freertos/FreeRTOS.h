@@ -0,0 +1,11 @@
+#ifndef _HOST_FREERTOS_H
+#define _HOST_FREERTOS_H
+
+// Host tools call into the firmware from one thread.
+typedef int portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux)      ((void) (mux))
+#define portEXIT_CRITICAL(mux)       ((void) (mux))
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _HOST_HAL_ADC_TYPES_H
+#define _HOST_HAL_ADC_TYPES_H
+
+typedef int adc_channel_t;
+typedef int adc_bits_width_t;
+typedef int adc_atten_t;
+typedef int adc_unit_t;
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef _HOST_SDKCONFIG_H
+#define _HOST_SDKCONFIG_H
+
+// Values of sdkconfig.defaults, or the Kconfig defaults, that the host
+// builds use.
+#define CONFIG_AUDIO_READ_AHEAD_SIZE 8192
+#define CONFIG_INPUT_DEBOUNCE_MS 30
+#define CONFIG_INPUT_DOUBLE_CLICK_MS 300
+#define CONFIG_INPUT_LONG_PRESS_MS 1000
+
+#endif
@@ -0,0 +1,208 @@
+/**
+ * Streams a file through the audio ring buffer on Linux the way the
+ * audio reader and decode tasks do, with SD timing injected by the host
+ * storage backend, and checks that the consumer never starves while the
+ * card keeps up and that starvation is counted once per gap when it
+ * does not.
+ *
+ * Build from the repository root, or with make -C tools check:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -pthread -DSTORAGE_POSIX -o stream_test \
+ *       -Itools/storage_bench/host -Icomponents/storage -Icomponents/audio \
+ *       tools/stream_test/stream_test.c components/storage/storage_posix.c \
+ *       components/storage/storage_bench.c components/audio/ring_buffer.c
+ *
+ * The exit status is the number of failed scenarios.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "ring_buffer.h"
+#include "storage.h"
+
+// Same sizes as the audio component.
+#define AUDIO_BUFFER_SIZE       16384
+#define READ_CHUNK_SIZE         4096
+#define MAINBUF_SIZE            1940  // helix's largest frame, the guard
+#define FRAME_US                26122 // 1152 samples at 44.1 kHz
+
+#define STREAM_FILE             "/stream.mp3"
+#define POLL_US                 1000
+
+static const char *TEST_TAG = "Stream";
+
+struct scenario_t {
+    const char *name;
+    struct storage_limits_t limits;
+    uint32_t kbps;            // bit rate the consumer plays at
+    uint32_t file_bytes;
+    bool starves;             // the card is slower than the bit rate
+};
+
+static const struct scenario_t SCENARIOS[] = {
+    {"class 10 card, 320 kbps", {2000, 400, 1200 * 1024}, 320, 96 * 1024, false},
+    {"slow card, 320 kbps", {2000, 20000, 400 * 1024}, 320, 96 * 1024, false},
+    {"card below bit rate", {2000, 400, 24 * 1024}, 320, 32 * 1024, true},
+};
+
+static uint8_t STORAGE[AUDIO_BUFFER_SIZE + MAINBUF_SIZE];
+static struct ring_buffer_t RING;
+static char READ_AHEAD[CONFIG_AUDIO_READ_AHEAD_SIZE];
+static volatile bool READ_ERROR = false;
+
+static uint8_t _byte_at(uint32_t offset) {
+    return (uint8_t) ((offset * 2654435761u) >> 24);
+}
+
+static bool _write_file(const char *path, uint32_t size) {
+    FILE *file = storage_fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        fputc(_byte_at(i), file);
+    }
+    return fclose(file) == 0;
+}
+
+/**
+ * aud_reader for one stream, polling where the task waits on a
+ * notification.
+ */
+static void *_reader(void *arg) {
+    FILE *file = (FILE *) arg;
+    while (1) {
+        uint8_t *window = NULL;
+        uint32_t free_bytes = rb_write_window(&RING, &window);
+        if (free_bytes == 0) {
+            usleep(POLL_US);
+            continue;
+        }
+        size_t to_read = free_bytes < READ_CHUNK_SIZE ? free_bytes : READ_CHUNK_SIZE;
+        size_t bytes_read = fread(window, 1, to_read, file);
+        if (bytes_read > 0) {
+            rb_commit(&RING, bytes_read);
+        }
+        if (bytes_read != to_read) {
+            READ_ERROR = ferror(file);
+            break;
+        }
+    }
+    rb_set_eof(&RING);
+    return NULL;
+}
+
+static void _sleep_until(int64_t deadline_us) {
+    const int64_t us = deadline_us - esp_timer_get_time();
+    if (us > 0) {
+        usleep((useconds_t) us);
+    }
+}
+
+/**
+ * Play the file at the scenario's bit rate, one frame per FRAME_US.
+ *
+ * @return true if the scenario passed.
+ */
+static bool _run(const struct scenario_t *scenario) {
+    storage_posix_set_limits(&(struct storage_limits_t) {0});
+    if (!_write_file(MOUNT_POINT STREAM_FILE, scenario->file_bytes)) {
+        ESP_LOGE(TEST_TAG, "Failed to write " STREAM_FILE ".");
+        return false;
+    }
+    storage_posix_set_limits(&scenario->limits);
+    FILE *file = storage_fopen(MOUNT_POINT STREAM_FILE, "r");
+    if (!file || setvbuf(file, READ_AHEAD, _IOFBF, sizeof(READ_AHEAD)) != 0) {
+        ESP_LOGE(TEST_TAG, "Failed to open " STREAM_FILE ".");
+        return false;
+    }
+
+    rb_reset(&RING);
+    READ_ERROR = false;
+    pthread_t reader;
+    pthread_create(&reader, NULL, _reader, file);
+
+    const uint32_t frame_bytes = scenario->kbps * 1000 / 8 * FRAME_US / 1000000;
+    uint32_t offset = 0;
+    uint32_t polls = 0;
+    uint32_t late = 0;
+    bool intact = true;
+    int64_t deadline = 0;
+    while (1) {
+        uint8_t *window;
+        uint32_t available = rb_read_window(&RING, &window, MAINBUF_SIZE);
+        while (available < MAINBUF_SIZE && !rb_is_eof(&RING)) {
+            polls++;
+            usleep(POLL_US);
+            available = rb_read_window(&RING, &window, MAINBUF_SIZE);
+        }
+        if (available == 0) {
+            break;
+        }
+        const uint32_t n_bytes = available < frame_bytes ? available : frame_bytes;
+        for (uint32_t i = 0; i < n_bytes && intact; i++) {
+            intact = window[i] == _byte_at(offset + i);
+        }
+        rb_consume(&RING, n_bytes);
+        offset += n_bytes;
+
+        // The first frame starts the clock, as the first i2s write does.
+        const int64_t now = esp_timer_get_time();
+        deadline = deadline ? deadline + FRAME_US : now + FRAME_US;
+        late += now > deadline;
+        _sleep_until(deadline);
+    }
+    pthread_join(reader, NULL);
+    fclose(file);
+
+    const uint32_t frames = (scenario->file_bytes + frame_bytes - 1) / frame_bytes;
+    ESP_LOGI(TEST_TAG, "%s: %u frames, %u late, %u polls, %u underruns, min fill %u.", scenario->name,
+             (unsigned) frames, (unsigned) late, (unsigned) polls, (unsigned) RING.underruns,
+             (unsigned) RING.min_fill);
+    bool ok = intact && !READ_ERROR && offset == scenario->file_bytes;
+    if (!ok) {
+        ESP_LOGE(TEST_TAG, "Stream read back wrong at byte %u.", (unsigned) offset);
+    }
+    if (scenario->starves) {
+        // Every gap counts once however often the consumer looked.
+        if (RING.underruns == 0 || RING.underruns > frames || RING.underruns >= polls) {
+            ESP_LOGE(TEST_TAG, "Expected one underrun per gap.");
+            ok = false;
+        }
+    } else if (RING.underruns != 0) {
+        ESP_LOGE(TEST_TAG, "Expected no underruns.");
+        ok = false;
+    }
+    return ok;
+}
+
+int main() {
+    char root[] = "/tmp/stream_test.XXXXXX";
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    storage_posix_set_root(root);
+    if (set_up_storage() != ESP_OK) {
+        return 1;
+    }
+    rb_init(&RING, STORAGE, AUDIO_BUFFER_SIZE, MAINBUF_SIZE);
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++) {
+        failed += !_run(&SCENARIOS[i]);
+    }
+    storage_unlink(MOUNT_POINT STREAM_FILE);
+    rmdir(root);
+    shut_down_storage();
+    return failed;
+}
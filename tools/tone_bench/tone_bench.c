@@ -0,0 +1,169 @@
+/**
+ * Times the DDS tone engine against the per-sample sin() loop it
+ * replaced and checks its output against the exact sine.
+ *
+ * Build from the repository root, or with make -C tools check:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -o tone_bench -Itools/storage_bench/host \
+ *       -Icomponents/audio tools/tone_bench/tone_bench.c \
+ *       components/audio/tone.c -lm
+ *
+ * Run with the number of buffers to time, 100 by default. The exit
+ * status is the number of failed checks.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "tone.h"
+
+// Same as the audio component.
+#define SAMPLE_RATE             44100
+#define TONE_BUFFER_FRAMES      (4 * 4410)
+#define DEFAULT_BUFFERS         100
+
+// Interpolating a 256 entry table is within 0.01 % of full scale.
+#define MAX_ERROR               4
+
+static const char *BENCH_TAG = "Tone";
+
+static int16_t BUFFER[2 * TONE_BUFFER_FRAMES];
+static int16_t BLOCK[2 * SAMPLE_RATE];   // longest periodic block, one second
+
+// Keeps the compiler from dropping the rendered samples.
+static volatile int32_t SINK;
+
+/**
+ * The loop sine_wave ran before the DDS engine, one double precision
+ * sin() per sample.
+ */
+static void _render_sin(int16_t *out, uint32_t n_frames, uint32_t freq, uint32_t *j) {
+    for (uint32_t i = 0; i < n_frames; i++) {
+        out[2 * i] = (int16_t) (sin(M_PI * (float) (2 * freq * *j) / (float) SAMPLE_RATE) * (float) 0x00ff);
+        out[2 * i + 1] = out[2 * i];
+        (*j)++;
+    }
+}
+
+static void _report(const char *name, int64_t us, int buffers) {
+    const double frames = (double) buffers * TONE_BUFFER_FRAMES;
+    ESP_LOGI(BENCH_TAG, "%-18s %8.1f us per buffer, %7.1f Mframes/s", name, (double) us / buffers,
+             us ? frames / (double) us : 0.0);
+}
+
+static int64_t _bench_sin(int buffers) {
+    uint32_t j = 0;
+    const int64_t start = esp_timer_get_time();
+    for (int b = 0; b < buffers; b++) {
+        _render_sin(BUFFER, TONE_BUFFER_FRAMES, 441, &j);
+        SINK += BUFFER[b];
+    }
+    return esp_timer_get_time() - start;
+}
+
+static int64_t _bench_pattern(const struct tone_pattern_t *pattern, int buffers) {
+    struct tone_t tone;
+    tone_start(&tone, pattern, SAMPLE_RATE);
+    const int64_t start = esp_timer_get_time();
+    for (int b = 0; b < buffers; b++) {
+        tone_render(&tone, BUFFER, TONE_BUFFER_FRAMES);
+        SINK += BUFFER[b];
+    }
+    return esp_timer_get_time() - start;
+}
+
+static int64_t _bench_periodic(int buffers) {
+    uint32_t periods;
+    const uint32_t frames = tone_period_frames(441, SAMPLE_RATE, &periods);
+    const uint32_t repeats = TONE_BUFFER_FRAMES / frames;
+    const int64_t start = esp_timer_get_time();
+    for (int b = 0; b < buffers; b++) {
+        tone_render_periodic(BUFFER, frames * repeats, periods * repeats, TONE_DEFAULT_AMPLITUDE);
+        SINK += BUFFER[b];
+    }
+    return esp_timer_get_time() - start;
+}
+
+/**
+ * @return the largest difference to the exact sine over one buffer of
+ *         a steady tone at freq and full scale.
+ */
+static int _max_error(uint32_t freq) {
+    const struct tone_step_t step = {
+        .start_hz = (uint16_t) freq,
+        .end_hz = (uint16_t) freq,
+        .duration_ms = 0,
+        .amplitude = 0x7fff,
+    };
+    const struct tone_pattern_t steady = {
+        .steps = &step,
+        .n_steps = 1,
+    };
+    struct tone_t tone;
+    tone_start(&tone, &steady, SAMPLE_RATE);
+    tone_render(&tone, BUFFER, TONE_BUFFER_FRAMES);
+    int worst = 0;
+    for (uint32_t i = 0; i < TONE_BUFFER_FRAMES; i++) {
+        const double exact = sin(2.0 * M_PI * (double) freq * i / SAMPLE_RATE) * 0x7fff * 0x7fff / 32768.0;
+        const int error = abs(BUFFER[2 * i] - (int) lrint(exact));
+        worst = error > worst ? error : worst;
+        if (BUFFER[2 * i] != BUFFER[2 * i + 1]) {
+            return INT32_MAX;
+        }
+    }
+    return worst;
+}
+
+/**
+ * @return true if a periodic block of freq ends one sample before it
+ *         starts again.
+ */
+static bool _seamless(uint32_t freq) {
+    uint32_t periods;
+    const uint32_t frames = tone_period_frames(freq, SAMPLE_RATE, &periods);
+    tone_render_periodic(BLOCK, frames, periods, 0x7fff);
+    // The frame after the last one is the first one again.
+    const double next = sin(2.0 * M_PI * freq * frames / SAMPLE_RATE) * 0x7fff * 0x7fff / 32768.0;
+    return abs(BLOCK[0] - (int) lrint(next)) <= MAX_ERROR
+           && abs(BLOCK[2 * (frames - 1)] - BLOCK[0]) <= abs(BLOCK[2] - BLOCK[0]) + MAX_ERROR;
+}
+
+int main(int argc, char **argv) {
+    const int buffers = argc > 1 ? atoi(argv[1]) : DEFAULT_BUFFERS;
+    if (buffers < 1) {
+        fprintf(stderr, "usage: %s [buffers]\n", argv[0]);
+        return 2;
+    }
+    tone_init();
+
+    int failed = 0;
+    static const uint32_t FREQS[] = {1, 50, 441, 880, 1000, 4000, 12345, 20000};
+    for (size_t i = 0; i < sizeof(FREQS) / sizeof(FREQS[0]); i++) {
+        const int error = _max_error(FREQS[i]);
+        const bool seamless = _seamless(FREQS[i]);
+        if (error > MAX_ERROR || !seamless) {
+            ESP_LOGE(BENCH_TAG, "%u Hz: error %d, %s.", (unsigned) FREQS[i], error,
+                     seamless ? "seamless" : "seam between blocks");
+            failed++;
+        }
+    }
+    ESP_LOGI(BENCH_TAG, "Output checked against sin() at %u pitches.", (unsigned) (sizeof(FREQS) / sizeof(FREQS[0])));
+
+    const int64_t sin_us = _bench_sin(buffers);
+    const int64_t steady_us = _bench_periodic(buffers);
+    const int64_t sweep_us = _bench_pattern(&TONE_SIREN_SWEEP, buffers);
+    const int64_t beep_us = _bench_pattern(&TONE_BEEP_CADENCE, buffers);
+    _report("sin() per sample", sin_us, buffers);
+    _report("periodic block", steady_us, buffers);
+    _report("DDS siren sweep", sweep_us, buffers);
+    _report("DDS beep cadence", beep_us, buffers);
+    if (sweep_us > 0) {
+        ESP_LOGI(BENCH_TAG, "DDS renders %.1fx as fast as sin().", (double) sin_us / (double) sweep_us);
+    }
+    return failed;
+}
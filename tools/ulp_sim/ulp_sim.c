@@ -0,0 +1,529 @@
+/**
+ * Runs the ULP program of main/ulp_controller on Linux. Models the ESP32
+ * ULP FSM instruction set, RTC slow memory, the RTC registers the program
+ * reads and writes, the wakeup timer and wake/halt, driven by a script
+ * of GPIO levels, ADC readings and expectations.
+ *
+ * Build from the repository root:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -o ulp_sim tools/ulp_sim/ulp_sim.c
+ *
+ * make -C tools ulp-check assembles the program with the IDF's toolchain
+ * and runs every script here on it.
+ *
+ * Run on the ULP binary and symbols of an idf.py build:
+ *
+ *   ./ulp_sim [-v] build/esp-idf/main/ulp_main/ulp_main.bin \
+ *       build/esp-idf/main/ulp_main/ulp_main.ld tools/ulp_sim/button.txt
+ *
+ * Each script line is "<ms> <command> [args]", in time order, # starts a
+ * comment:
+ *
+ *   gpio <rtc_io> <level>       level of an RTC IO pin
+ *   adc <sar> <channel> <raw>   reading of an ADC channel, sar 0 is ADC1
+ *   set <symbol> <value>        write a variable, as the CPU does
+ *   start                       ulp_run and put the CPU to sleep
+ *   period <us>                 ulp_set_wakeup_period
+ *   expect <symbol> <value>     check the low 16 bits of a variable
+ *   wakes <n>                   check the CPU wakes so far
+ *   budget <cycles>             fail any run longer than this from now on
+ *   end                         run the timer up to here and stop
+ *
+ * Prints the cycles of each run with -v and a summary at the end. The
+ * exit status is the number of failed checks.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MEM_WORDS               2048      // 8 KB of RTC slow memory
+#define BIN_MAGIC               0x00706c75  // "ulp\0"
+#define SYMBOL_LEN              48
+#define MAX_SYMBOLS             128
+#define LINE_LEN                160
+#define ULP_CLOCK_HZ            8500000   // RTC_FAST_CLK
+#define RUN_LIMIT               100000    // cycles before a run is taken to never halt
+#define DEFAULT_PERIOD_US       20000
+
+// RTC registers, as in soc/rtc_cntl_reg.h and soc/rtc_io_reg.h.
+#define DR_REG_RTCCNTL_BASE     0x3ff48000
+#define REG_WORDS               1024      // RTC_CNTL, RTC_IO, SENS and RTC_I2C
+#define RTC_CNTL_STATE0_REG     (DR_REG_RTCCNTL_BASE + 0x18)
+#define RTC_CNTL_ULP_CP_SLP_TIMER_EN_S  24
+#define RTC_CNTL_LOW_POWER_ST_REG       (DR_REG_RTCCNTL_BASE + 0xc0)
+#define RTC_CNTL_RDY_FOR_WAKEUP_S       19
+#define RTC_GPIO_IN_REG         (DR_REG_RTCCNTL_BASE + 0x400 + 0x24)
+#define RTC_GPIO_IN_NEXT_S      14
+
+// Opcodes and sub opcodes, as in esp32/ulp.h.
+#define OPCODE_WR_REG           1
+#define OPCODE_RD_REG           2
+#define OPCODE_DELAY            4
+#define OPCODE_ADC              5
+#define OPCODE_ST               6
+#define OPCODE_ALU              7
+#define OPCODE_BRANCH           8
+#define OPCODE_END              9
+#define OPCODE_HALT             11
+#define OPCODE_LD               13
+
+#define SUB_OPCODE_ALU_REG      0
+#define SUB_OPCODE_ALU_IMM      1
+#define SUB_OPCODE_ALU_CNT      2
+#define SUB_OPCODE_BX           0
+#define SUB_OPCODE_B            1
+#define SUB_OPCODE_BS           2
+#define SUB_OPCODE_END          0
+#define SUB_OPCODE_SLEEP        1
+
+enum { ALU_ADD, ALU_SUB, ALU_AND, ALU_OR, ALU_MOVE, ALU_LSH, ALU_RSH };
+enum { STAGE_INC, STAGE_DEC, STAGE_RST };
+enum { BX_DIRECT, BX_ZERO, BX_OVERFLOW };
+enum { B_LT, B_GE };
+enum { BS_LT, BS_GE, BS_LE };
+
+/**
+ * Cycles to execute and fetch the next instruction, from the ESP32
+ * technical reference. ADC assumes the default SENS timing.
+ */
+#define CYCLES_ALU              6
+#define CYCLES_LD_ST            8
+#define CYCLES_BRANCH           4
+#define CYCLES_RD_REG           8
+#define CYCLES_WR_REG           12
+#define CYCLES_ADC              (23 + 10 + 10 + 1 + 9 + 3 + 4)
+#define CYCLES_END              6
+#define CYCLES_HALT             2
+
+struct symbol_t {
+    char name[SYMBOL_LEN];
+    uint32_t word;
+};
+
+struct sim_t {
+    uint32_t mem[MEM_WORDS];
+    uint32_t regs[REG_WORDS];
+    uint32_t entry;
+    uint16_t r[4];
+    uint8_t stage;
+    bool zero;
+    bool overflow;
+
+    bool cpu_asleep;
+    bool timer_on;
+    uint64_t period_us;
+    uint64_t next_run_us;
+    uint32_t gpio;              // RTC IO levels, bit n for RTC_IO n
+    uint16_t adc[2][16];
+
+    uint32_t budget;
+    uint32_t runs;
+    uint32_t wakes;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+    uint32_t failures;
+    bool verbose;
+
+    struct symbol_t symbols[MAX_SYMBOLS];
+    uint32_t n_symbols;
+};
+
+static uint32_t _bits(uint32_t word, int low, int width) {
+    return (word >> low) & ((1u << width) - 1);
+}
+
+static uint32_t _cycles_to_us(uint64_t cycles) {
+    return (uint32_t) ((cycles * 1000000 + ULP_CLOCK_HZ - 1) / ULP_CLOCK_HZ);
+}
+
+static uint32_t _reg_read(const struct sim_t *sim, uint32_t index) {
+    const uint32_t address = DR_REG_RTCCNTL_BASE + index * 4;
+    if (address == RTC_GPIO_IN_REG) {
+        return sim->gpio << RTC_GPIO_IN_NEXT_S;
+    }
+    if (address == RTC_CNTL_LOW_POWER_ST_REG) {
+        return (uint32_t) sim->cpu_asleep << RTC_CNTL_RDY_FOR_WAKEUP_S;
+    }
+    return sim->regs[index];
+}
+
+static void _reg_write(struct sim_t *sim, uint32_t index, uint32_t value) {
+    sim->regs[index] = value;
+    if (DR_REG_RTCCNTL_BASE + index * 4 == RTC_CNTL_STATE0_REG) {
+        sim->timer_on = (value >> RTC_CNTL_ULP_CP_SLP_TIMER_EN_S) & 1;
+    }
+}
+
+static void _alu(struct sim_t *sim, int dreg, uint32_t sel, uint32_t a, uint32_t b) {
+    uint32_t result;
+    bool overflow = false;
+    switch (sel) {
+        case ALU_ADD:
+            result = a + b;
+            overflow = result > UINT16_MAX;
+            break;
+        case ALU_SUB:
+            result = a - b;
+            overflow = a < b;
+            break;
+        case ALU_AND:
+            result = a & b;
+            break;
+        case ALU_OR:
+            result = a | b;
+            break;
+        case ALU_MOVE:
+            result = b;
+            break;
+        case ALU_LSH:
+            result = (b & 0x1f) < 16 ? a << (b & 0x1f) : 0;
+            break;
+        case ALU_RSH:
+            result = (b & 0x1f) < 16 ? a >> (b & 0x1f) : 0;
+            break;
+        default:
+            fprintf(stderr, "Unknown ALU operation %u.\n", (unsigned) sel);
+            exit(2);
+    }
+    sim->r[dreg] = (uint16_t) result;
+    sim->zero = sim->r[dreg] == 0;
+    sim->overflow = overflow;
+}
+
+static uint32_t _branch_target(uint32_t pc, uint32_t word) {
+    const uint32_t offset = _bits(word, 17, 7);
+    return _bits(word, 24, 1) ? pc - offset : pc + offset;
+}
+
+/**
+ * Execute from the entry point to halt.
+ *
+ * @return cycles used.
+ */
+static uint32_t _run(struct sim_t *sim, uint64_t now_us) {
+    uint32_t pc = sim->entry;
+    uint32_t cycles = 0;
+    while (cycles < RUN_LIMIT) {
+        if (pc >= MEM_WORDS) {
+            fprintf(stderr, "%llu ms: pc %u outside RTC slow memory.\n",
+                    (unsigned long long) now_us / 1000, (unsigned) pc);
+            exit(2);
+        }
+        const uint32_t word = sim->mem[pc];
+        const uint32_t opcode = _bits(word, 28, 4);
+        const uint32_t sub = _bits(word, 25, 3);
+        const int dreg = _bits(word, 0, 2);
+        const int sreg = _bits(word, 2, 2);
+        uint32_t next = pc + 1;
+        switch (opcode) {
+            case OPCODE_ALU:
+                cycles += CYCLES_ALU;
+                if (sub == SUB_OPCODE_ALU_REG) {
+                    // A register move copies sreg, other operations take treg second.
+                    const uint32_t sel = _bits(word, 21, 4);
+                    _alu(sim, dreg, sel, sim->r[sreg], sim->r[sel == ALU_MOVE ? (uint32_t) sreg : _bits(word, 4, 2)]);
+                } else if (sub == SUB_OPCODE_ALU_IMM) {
+                    _alu(sim, dreg, _bits(word, 21, 4), sim->r[sreg], _bits(word, 4, 16));
+                } else if (sub == SUB_OPCODE_ALU_CNT) {
+                    const uint32_t imm = _bits(word, 4, 8);
+                    const uint32_t sel = _bits(word, 21, 4);
+                    sim->stage = sel == STAGE_INC ? sim->stage + imm :
+                                 sel == STAGE_DEC ? sim->stage - imm : 0;
+                }
+                break;
+            case OPCODE_ST: {
+                cycles += CYCLES_LD_ST;
+                // dreg holds the address, sreg the value. The upper half
+                // word records the pc and the address register.
+                const uint32_t address = (sim->r[dreg] + _bits(word, 10, 11)) % MEM_WORDS;
+                sim->mem[address] = (pc << 21) | ((uint32_t) dreg << 16) | sim->r[sreg];
+                break;
+            }
+            case OPCODE_LD: {
+                cycles += CYCLES_LD_ST;
+                const uint32_t address = (sim->r[sreg] + _bits(word, 10, 11)) % MEM_WORDS;
+                sim->r[dreg] = (uint16_t) sim->mem[address];
+                break;
+            }
+            case OPCODE_BRANCH:
+                cycles += CYCLES_BRANCH;
+                if (sub == SUB_OPCODE_BX) {
+                    const uint32_t type = _bits(word, 22, 3);
+                    const uint32_t target = _bits(word, 21, 1) ? sim->r[dreg] : _bits(word, 2, 11);
+                    if (type == BX_DIRECT || (type == BX_ZERO && sim->zero) ||
+                        (type == BX_OVERFLOW && sim->overflow)) {
+                        next = target;
+                    }
+                } else if (sub == SUB_OPCODE_B) {
+                    const uint32_t imm = _bits(word, 0, 16);
+                    const bool taken = _bits(word, 16, 1) == B_GE ? sim->r[0] >= imm : sim->r[0] < imm;
+                    if (taken) {
+                        next = _branch_target(pc, word);
+                    }
+                } else if (sub == SUB_OPCODE_BS) {
+                    const uint32_t imm = _bits(word, 0, 8);
+                    const uint32_t cmp = _bits(word, 15, 2);
+                    const bool taken = cmp == BS_LT ? sim->stage < imm :
+                                       cmp == BS_GE ? sim->stage >= imm : sim->stage <= imm;
+                    if (taken) {
+                        next = _branch_target(pc, word);
+                    }
+                }
+                break;
+            case OPCODE_RD_REG: {
+                cycles += CYCLES_RD_REG;
+                const uint32_t low = _bits(word, 18, 5);
+                const uint32_t high = _bits(word, 23, 5);
+                const uint32_t width = high - low + 1;
+                const uint32_t value = _reg_read(sim, _bits(word, 0, 10)) >> low;
+                sim->r[0] = (uint16_t) (width >= 16 ? value : value & ((1u << width) - 1));
+                break;
+            }
+            case OPCODE_WR_REG: {
+                cycles += CYCLES_WR_REG;
+                const uint32_t index = _bits(word, 0, 10);
+                const uint32_t low = _bits(word, 18, 5);
+                const uint32_t high = _bits(word, 23, 5);
+                const uint32_t mask = (high - low + 1 >= 32 ? UINT32_MAX : (1u << (high - low + 1)) - 1) << low;
+                const uint32_t value = (_reg_read(sim, index) & ~mask) | ((_bits(word, 10, 8) << low) & mask);
+                _reg_write(sim, index, value);
+                break;
+            }
+            case OPCODE_ADC:
+                cycles += CYCLES_ADC;
+                // mux 0 selects no channel, mux n channel n - 1.
+                sim->r[dreg] = _bits(word, 2, 4) ? sim->adc[_bits(word, 6, 1)][_bits(word, 2, 4) - 1] : 0;
+                break;
+            case OPCODE_DELAY:
+                cycles += _bits(word, 0, 16) + 4;
+                break;
+            case OPCODE_END:
+                cycles += CYCLES_END;
+                if (sub == SUB_OPCODE_END && _bits(word, 0, 1) && sim->cpu_asleep) {
+                    sim->cpu_asleep = false;
+                    sim->wakes++;
+                    if (sim->verbose) {
+                        printf("%8.3f ms  wake\n", now_us / 1000.0);
+                    }
+                }
+                break;
+            case OPCODE_HALT:
+                return cycles + CYCLES_HALT;
+            default:
+                fprintf(stderr, "Unsupported instruction 0x%08x at word %u.\n", (unsigned) word, (unsigned) pc);
+                exit(2);
+        }
+        pc = next;
+    }
+    fprintf(stderr, "%llu ms: no halt within %d cycles.\n", (unsigned long long) now_us / 1000, RUN_LIMIT);
+    exit(2);
+}
+
+/**
+ * Run the program every period up to until_us, as the ULP timer does. The
+ * period counts from the halt of the previous run.
+ */
+static void _advance(struct sim_t *sim, uint64_t until_us) {
+    while (sim->timer_on && sim->next_run_us <= until_us) {
+        const uint64_t start_us = sim->next_run_us;
+        const uint32_t cycles = _run(sim, start_us);
+        sim->runs++;
+        sim->total_cycles += cycles;
+        sim->min_cycles = cycles < sim->min_cycles ? cycles : sim->min_cycles;
+        sim->max_cycles = cycles > sim->max_cycles ? cycles : sim->max_cycles;
+        if (sim->verbose) {
+            printf("%8.3f ms  %5u cycles  %4u us\n", start_us / 1000.0, (unsigned) cycles,
+                   (unsigned) _cycles_to_us(cycles));
+        }
+        if (sim->budget && cycles > sim->budget) {
+            printf("FAIL %.3f ms: run took %u cycles, budget %u\n", start_us / 1000.0,
+                   (unsigned) cycles, (unsigned) sim->budget);
+            sim->failures++;
+        }
+        sim->next_run_us = start_us + _cycles_to_us(cycles) + sim->period_us;
+    }
+}
+
+static const struct symbol_t *_symbol(const struct sim_t *sim, const char *name) {
+    for (uint32_t i = 0; i < sim->n_symbols; i++) {
+        if (strcmp(sim->symbols[i].name, name) == 0) {
+            return &sim->symbols[i];
+        }
+    }
+    return NULL;
+}
+
+static void _load_binary(struct sim_t *sim, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        exit(2);
+    }
+    uint32_t magic;
+    uint16_t text_offset, text_size, data_size, bss_size;
+    if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != BIN_MAGIC ||
+        fread(&text_offset, sizeof(text_offset), 1, file) != 1 ||
+        fread(&text_size, sizeof(text_size), 1, file) != 1 ||
+        fread(&data_size, sizeof(data_size), 1, file) != 1 ||
+        fread(&bss_size, sizeof(bss_size), 1, file) != 1) {
+        fprintf(stderr, "%s is not a ULP binary.\n", path);
+        exit(2);
+    }
+    // As ulp_load_binary at offset 0: text, data, then zeroed bss.
+    const size_t size = (size_t) text_size + data_size;
+    if (size + bss_size > sizeof(sim->mem) ||
+        fseek(file, text_offset, SEEK_SET) != 0 ||
+        fread(sim->mem, 1, size, file) != size) {
+        fprintf(stderr, "%s is truncated or too large.\n", path);
+        exit(2);
+    }
+    fclose(file);
+}
+
+/**
+ * Read the symbols from the linker script the build generates for the
+ * main program, lines of "PROVIDE ( ulp_name = 0x500000a0 );".
+ */
+static void _load_symbols(struct sim_t *sim, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        exit(2);
+    }
+    char line[LINE_LEN];
+    while (fgets(line, sizeof(line), file) && sim->n_symbols < MAX_SYMBOLS) {
+        struct symbol_t *symbol = &sim->symbols[sim->n_symbols];
+        unsigned address;
+        if (sscanf(line, " PROVIDE ( ulp_%47s = 0x%x ) ;", symbol->name, &address) == 2) {
+            symbol->word = (address & 0xffff) / 4;
+            sim->n_symbols++;
+        }
+    }
+    fclose(file);
+    const struct symbol_t *entry = _symbol(sim, "entry");
+    if (!entry) {
+        fprintf(stderr, "No entry symbol in %s.\n", path);
+        exit(2);
+    }
+    sim->entry = entry->word;
+}
+
+static const struct symbol_t *_need_symbol(const struct sim_t *sim, const char *name, int line_no) {
+    const struct symbol_t *symbol = _symbol(sim, name);
+    if (!symbol) {
+        fprintf(stderr, "Line %d: unknown symbol %s.\n", line_no, name);
+        exit(2);
+    }
+    return symbol;
+}
+
+static void _run_script(struct sim_t *sim, FILE *script) {
+    char line[LINE_LEN];
+    int line_no = 0;
+    uint64_t now_us = 0;
+    while (fgets(line, sizeof(line), script)) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        double ms;
+        char command[16];
+        char arg[SYMBOL_LEN];
+        int consumed;
+        if (sscanf(line, " %lf %15s%n", &ms, command, &consumed) < 2) {
+            continue;
+        }
+        const uint64_t at_us = (uint64_t) (ms * 1000);
+        if (at_us < now_us) {
+            fprintf(stderr, "Line %d: time goes backwards.\n", line_no);
+            exit(2);
+        }
+        _advance(sim, at_us);
+        now_us = at_us;
+
+        const char *args = line + consumed;
+        unsigned a, b, c;
+        if (strcmp(command, "gpio") == 0 && sscanf(args, "%u %u", &a, &b) == 2 && a < 18) {
+            sim->gpio = b ? sim->gpio | (1u << a) : sim->gpio & ~(1u << a);
+        } else if (strcmp(command, "adc") == 0 && sscanf(args, "%u %u %u", &a, &b, &c) == 3 && a < 2 && b < 16) {
+            sim->adc[a][b] = (uint16_t) c;
+        } else if (strcmp(command, "set") == 0 && sscanf(args, "%47s %i", arg, (int *) &a) == 2) {
+            sim->mem[_need_symbol(sim, arg, line_no)->word] = a;
+        } else if (strcmp(command, "start") == 0) {
+            sim->cpu_asleep = true;
+            sim->timer_on = true;
+            sim->next_run_us = now_us;
+        } else if (strcmp(command, "period") == 0 && sscanf(args, "%u", &a) == 1) {
+            sim->period_us = a;
+        } else if (strcmp(command, "expect") == 0 && sscanf(args, "%47s %i", arg, (int *) &a) == 2) {
+            const uint32_t value = sim->mem[_need_symbol(sim, arg, line_no)->word] & UINT16_MAX;
+            if (value != (a & UINT16_MAX)) {
+                printf("FAIL line %d, %.3f ms: %s is %u, expected %u\n", line_no, ms, arg,
+                       (unsigned) value, a & UINT16_MAX);
+                sim->failures++;
+            }
+        } else if (strcmp(command, "wakes") == 0 && sscanf(args, "%u", &a) == 1) {
+            if (sim->wakes != a) {
+                printf("FAIL line %d, %.3f ms: %u wakes, expected %u\n", line_no, ms,
+                       (unsigned) sim->wakes, a);
+                sim->failures++;
+            }
+        } else if (strcmp(command, "budget") == 0 && sscanf(args, "%u", &a) == 1) {
+            sim->budget = a;
+        } else if (strcmp(command, "end") == 0) {
+            return;
+        } else {
+            fprintf(stderr, "Line %d: bad command.\n", line_no);
+            exit(2);
+        }
+    }
+}
+
+static void _report(const struct sim_t *sim) {
+    printf("%u runs, %u wakes\n", (unsigned) sim->runs, (unsigned) sim->wakes);
+    if (sim->runs == 0) {
+        return;
+    }
+    const uint64_t average = sim->total_cycles / sim->runs;
+    printf("cycles per run: min %u, average %llu, max %u (%u us at %d Hz)\n",
+           (unsigned) sim->min_cycles, (unsigned long long) average, (unsigned) sim->max_cycles,
+           (unsigned) _cycles_to_us(sim->max_cycles), ULP_CLOCK_HZ);
+    printf("ULP duty: %.4f %% at a %llu us period\n",
+           100.0 * _cycles_to_us(average) / (sim->period_us + _cycles_to_us(average)),
+           (unsigned long long) sim->period_us);
+}
+
+int main(int argc, char **argv) {
+    static struct sim_t sim;
+    sim.period_us = DEFAULT_PERIOD_US;
+    sim.min_cycles = UINT32_MAX;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt == 'v') {
+            sim.verbose = true;
+        } else {
+            return 2;
+        }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "Usage: %s [-v] ulp_main.bin ulp_main.ld script\n", argv[0]);
+        return 2;
+    }
+    _load_binary(&sim, argv[optind]);
+    _load_symbols(&sim, argv[optind + 1]);
+    FILE *script = fopen(argv[optind + 2], "r");
+    if (!script) {
+        perror(argv[optind + 2]);
+        return 2;
+    }
+    _run_script(&sim, script);
+    fclose(script);
+    _report(&sim);
+    return sim.failures > 255 ? 255 : (int) sim.failures;
+}